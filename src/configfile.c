@@ -33,6 +33,39 @@
 
 char *submit_url[MAX_URLS];
 int url_count = 0;
+int fingerprint_submit = 0;
+long long submit_rate = 0;
+int submit_concurrency = 4;
+int submit_fanout = 0;
+int analyze_workers = 0;
+int queue_depth = 64;
+int keep_minidumps = 0;
+int summary_reports = 0;
+int gdb_timeout = 300;
+long long gdb_memory_limit = 0;
+int gdb_cpu_limit = 0;
+int gdb_session_cores = 0;
+
+/* "SIZE[K|M|G]" in bytes, 0 if not a size */
+long long parse_size(const char *s)
+{
+	char *end;
+	long long n = strtoll(s, &end, 10);
+
+	switch (*end) {
+	case 'G': case 'g':
+		n *= 1024;
+		/* fall through */
+	case 'M': case 'm':
+		n *= 1024;
+		/* fall through */
+	case 'K': case 'k':
+		n *= 1024;
+		break;
+	}
+
+	return n > 0 ? n : 0;
+}
 
 void read_config_file(char *filename)
 {
@@ -40,6 +73,8 @@ void read_config_file(char *filename)
 	char *line = NULL, *line_end = NULL;
 	size_t line_len = 0;
 
+	init_rules();
+
 	file = fopen(filename, "r");
 	if (!file)
 		return;
@@ -63,6 +98,15 @@ void read_config_file(char *filename)
 
 		line_end = line + line_len;
 
+		/* ignore and allow rules, see rules.c */
+		c = strchr(line, '=');
+		if (c) {
+			char key[32];
+
+			if (sscanf(line, " %31[a-z-]", key) == 1 && add_rule(key, c + 1))
+				continue;
+		}
+
 		c = strstr(line, "allow-submit");
 		if (c) {
 			c+=13;
@@ -87,8 +131,131 @@ void read_config_file(char *filename)
 			}
 		}
 
+		c = strstr(line, "submit-mode");
+		if (c) {
+			c += 12;
+			if (c < line_end && strstr(c, "fingerprint"))
+				fingerprint_submit = 1;
+		}
+
+		c = strstr(line, "submit-to");
+		if (c && (c = strchr(c, '=')))
+			submit_fanout = strstr(c, "all") != NULL;
+
+		c = strstr(line, "submit-rate");
+		if (c && (c = strchr(c, '=')))
+			submit_rate = parse_size(c + 1);
+
+		c = strstr(line, "submit-concurrency");
+		if (c && (c = strchr(c, '=')) && atoi(c + 1) > 0)
+			submit_concurrency = atoi(c + 1);
+
+		c = strstr(line, "analyze-workers");
+		if (c && (c = strchr(c, '=')))
+			analyze_workers = atoi(c + 1);
+
+		c = strstr(line, "queue-depth");
+		if (c && (c = strchr(c, '=')) && atoi(c + 1) > 0)
+			queue_depth = atoi(c + 1);
+
+		c = strstr(line, "gdb-timeout");
+		if (c && (c = strchr(c, '=')))
+			gdb_timeout = atoi(c + 1);
+
+		c = strstr(line, "gdb-memory-limit");
+		if (c && (c = strchr(c, '=')))
+			gdb_memory_limit = parse_size(c + 1);
+
+		c = strstr(line, "gdb-cpu-limit");
+		if (c && (c = strchr(c, '=')))
+			gdb_cpu_limit = atoi(c + 1);
+
+		c = strstr(line, "gdb-session-cores");
+		if (c && (c = strchr(c, '=')))
+			gdb_session_cores = atoi(c + 1);
+
+		c = strstr(line, "analyze-cpus");
+		if (c && (c = strchr(c, '='))) {
+			free(analyze_cpus);
+			analyze_cpus = strdup(c + 1 + strspn(c + 1, " \t"));
+		}
+
+		c = strstr(line, "analyze-numa-node");
+		if (c && (c = strchr(c, '=')))
+			analyze_node = atoi(c + 1);
+
+		c = strstr(line, "analyze-cgroup");
+		if (c && (c = strchr(c, '='))) {
+			free(analyze_cgroup);
+			analyze_cgroup = strdup(c + 1 + strspn(c + 1, " \t"));
+		}
+
+		c = strstr(line, "analyze-cpu-max");
+		if (c && (c = strchr(c, '='))) {
+			free(analyze_cpu_max);
+			analyze_cpu_max = strdup(c + 1 + strspn(c + 1, " \t"));
+		}
+
+		c = strstr(line, "analyze-memory-max");
+		if (c && (c = strchr(c, '=')))
+			analyze_memory_max = parse_size(c + 1);
+
+		c = strstr(line, "pressure-cpu");
+		if (c && (c = strchr(c, '=')))
+			psi_limit[PSI_CPU] = atof(c + 1);
+
+		c = strstr(line, "pressure-io");
+		if (c && (c = strchr(c, '=')))
+			psi_limit[PSI_IO] = atof(c + 1);
+
+		c = strstr(line, "pressure-memory");
+		if (c && (c = strchr(c, '=')))
+			psi_limit[PSI_MEMORY] = atof(c + 1);
+
+		c = strstr(line, "pressure-max-defer");
+		if (c && (c = strchr(c, '=')))
+			max_defer = atoi(c + 1);
+
+		c = strstr(line, "max-load");
+		if (c && (c = strchr(c, '=')))
+			max_load = atof(c + 1);
+
+		c = strstr(line, "keep-cores");
+		if (c && (c = strchr(c, '=')))
+			keep_minidumps = strstr(c, "minidump") != NULL;
+
+		c = strstr(line, "summary-reports");
+		if (c && (c = strchr(c, '=')))
+			summary_reports = strstr(c, "yes") != NULL;
+
+		c = strstr(line, "crash-prefetch");
+		if (c && (c = strchr(c, '=')))
+			crash_prefetch = strstr(c, "yes") != NULL;
+
+		c = strstr(line, "symbol-cache");
+		if (c && (c = strchr(c, '='))) {
+			free(symbol_cache);
+			symbol_cache = strdup(c + 1 + strspn(c + 1, " \t"));
+		}
+
+		c = strstr(line, "metered-interfaces");
+		if (c && (c = strchr(c, '='))) {
+			g_strfreev(metered_interfaces);
+			metered_interfaces = g_strsplit_set(c + 1, " \t,", -1);
+		}
+
+		c = strstr(line, "processed-layout");
+		if (c && (c = strchr(c, '='))) {
+			if (strstr(c, "date"))
+				processed_layout = LAYOUT_DATE;
+			else if (strstr(c, "hash"))
+				processed_layout = LAYOUT_HASH;
+			else
+				processed_layout = LAYOUT_FLAT;
+		}
+
 		c = strstr(line, "submit-url");
-		if (c && url_count <= MAX_URLS) {
+		if (c && url_count < MAX_URLS) {
 			c += 11;
 			if (c < line_end) {
 				c = strstr(c, "http");
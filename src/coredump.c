@@ -27,13 +27,19 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <asm/unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <spawn.h>
+#include <signal.h>
 #include <syslog.h>
 #include <dirent.h>
 #include <glib.h>
@@ -41,18 +47,6 @@
 
 #include "corewatcher.h"
 
-/*
- * processing "queue" loop's condition variable and associated
- * lock.  Note the queue is an implicit data structure consisting
- * of the non-submitted core files in the filesystem, but the bool pq is
- * used to mark whether the "queue" holds something to prevent the possible
- * race where the condition is set before the thread is awaiting it and
- * thus is not woken.
- */
-GMutex *pq_mtx;
-static gboolean pq = FALSE;
-GCond *pq_work;
-
 static int diskfree = 100;
 
 static char *get_release(void)
@@ -133,177 +127,322 @@ out:
 }
 
 /*
- * Strip the directories from the path
- * given by fullname
+ * Move core name from core_folder to processed_folder subdir as
+ * ".to-process", its new path goes to newpath.  Cores whose name can't
+ * be made sense of, or that already are in processed_folder, are
+ * unlinked.
+ *
+ * TODO: rate limit submissions of extremely crashy applications, e.g.
+ * unlink a core if one of the same application and nearly the same
+ * timestamp is already in processed_folder.
  */
-char *strip_directories(char *fullpath)
+int move_core(const char *name, char *newpath, size_t size)
 {
-	char *dfile = NULL, *c1 = NULL, *c2 = NULL, *r = NULL;
-	char delim[] = "/";
-	char *saveptr;
-
-	if (!fullpath)
-		return NULL;
+	struct core_name cn;
+	const char *why;
+	int ret;
 
-	dfile = strdup(fullpath);
-	if (!dfile)
-		return NULL;
+	if (parse_core_name(name, &cn)) {
+		fprintf(stderr, "+ ...move failed, ignoring/unlinking %s\n", name);
+		unlinkat(core_dirfd, name, 0);
+		return -1;
+	}
+	why = unwanted_core(&cn);
+	if (why) {
+		fprintf(stderr, "+ ...%s, unlinking %s\n", why, cn.base);
+		unlinkat(core_dirfd, cn.base, 0);
+		return -1;
+	}
 
-	c1 = strtok_r(dfile, delim, &saveptr);
-	while(c1) {
-		c2 = c1;
-		c1 = strtok_r(NULL, delim, &saveptr);
+	ret = core_rename(&cn, CORE_TO_PROCESS, newpath, size);
+	if (ret == -EEXIST) {
+		fprintf(stderr, "+ %s already is in %s, unlinking\n", cn.base, processed_folder);
+		unlinkat(core_dirfd, cn.base, 0);
+		return -1;
+	} else if (ret) {
+		fprintf(stderr, "+ Unable to move %s: %s\n", cn.base, strerror(-ret));
+		return -1;
 	}
 
-	if (c2)
-		r = strdup(c2);
+	return 0;
+}
+
+static void skip_core(struct job *job)
+{
+	char procfn[PATH_MAX];
+	int ret;
 
-	free(dfile);
+	ret = core_rename(&job->name, CORE_SKIPPED, procfn, sizeof(procfn));
+	if (ret) {
+		fprintf(stderr, "+  Unable to move %s to .skipped: %s\n", job->fullpath, strerror(-ret));
+		return;
+	}
 
-	return r;
+	fprintf(stderr, "+  Moved %s to %s\n", job->fullpath, procfn);
 }
 
 /*
- * Move corefile from core_folder to processed_folder subdir.
- * If this type of core has recently been seen, unlink this more recent
- * example in order to rate limit submissions of extremely crashy
- * applications.
- * Add extension and attempt to create directories if needed.
+ * gdb's environment: ours, in the C locale so its output parses.
+ * Returns a NULL terminated array to free() (not its strings).
  */
-static int move_core(char *fullpath, char *extension)
+static char **gdb_environ(void)
 {
-	char *corefilename = NULL, *newpath = NULL, *coreprefix = NULL;
-	char *s = NULL;
-	size_t prefix_len;
-	DIR *dir = NULL;
-	struct dirent *entry = NULL;
-	int ret = 0;
+	char **env;
+	int i, n = 0;
 
-	if (!fullpath)
-		return -1;
+	for (i = 0; environ[i]; i++)
+		;
+	env = calloc(i + 3, sizeof(char *));
+	if (!env)
+		return NULL;
+	for (i = 0; environ[i]; i++)
+		if (strncmp(environ[i], "LANG=", 5) && strncmp(environ[i], "LC_ALL=", 7) &&
+		    strncmp(environ[i], "LANGUAGE=", 9))
+			env[n++] = environ[i];
+	env[n++] = "LANG=C";
+	env[n++] = "LC_ALL=C";
+
+	return env;
+}
 
-	corefilename = strip_directories(fullpath);
-	if (!corefilename)
-		return -ENOMEM;
+/* limit what gdb may take, see gdb-* in corewatcher.conf */
+static void limit_gdb(pid_t pid)
+{
+	struct rlimit rl = { 0, 0 };
 
-	/* if the corefile's name minus any suffixes (such as .$PID) and
-	 * minus two additional characters (ie: last two digits of
-	 * timestamp assuming core_%e_%t) matches another core file in the
-	 * processed_folder, simply unlink it instead of processing it for
-	 * submission.  TODO: consider a (configurable) time delta greater
-	 * than which the cores must be separated, stat'ing the files, etc.
-	 */
-	coreprefix = strdup(corefilename);
-	if (!coreprefix) {
-		free(corefilename);
-		return -ENOMEM;
-	}
-	s = strstr(coreprefix, ".");
-	if (!s) {
-		free(coreprefix);
-		free(corefilename);
-		return -1;
+	/* a crashing gdb must not leave a core for us to pick up */
+	prlimit(pid, RLIMIT_CORE, &rl, NULL);
+	if (gdb_memory_limit) {
+		rl.rlim_cur = rl.rlim_max = gdb_memory_limit;
+		prlimit(pid, RLIMIT_AS, &rl, NULL);
 	}
-	*s = '\0';
-	prefix_len = strlen(coreprefix);
-	if (prefix_len > 2) {
-		s = strndup(coreprefix, prefix_len - 2);
-		free(coreprefix);
-		coreprefix = s;
-	} else {
-		ret = -1;
-		goto out;
+	if (gdb_cpu_limit) {
+		/* SIGXCPU, and SIGKILL should gdb catch that */
+		rl.rlim_cur = gdb_cpu_limit;
+		rl.rlim_max = gdb_cpu_limit + 5;
+		prlimit(pid, RLIMIT_CPU, &rl, NULL);
 	}
-	dir = opendir(processed_folder);
-	if (!dir) {
-		ret = -1;
-		goto out;
+}
+
+/* gdb ran out of wall clock time: kill it and whatever it started */
+static void gdb_timed_out(int fd, guint32 __unused events, void *data)
+{
+	struct job *job = data;
+
+	event_drain(fd);
+	fprintf(stderr, "+ gdb over %s timed out after %d s, killing it\n",
+		job->fullpath, gdb_timeout);
+	kill(-job->gdb_pid, SIGKILL);
+}
+
+/*
+ * Start gdb with args (what follows "gdb" on its command line), directly
+ * rather than through a shell, in a process group of its own and with
+ * its resources limited.  Its stdin is in, or ours if -1.  Everything
+ * it prints goes to a pipe.  Returns the non blocking read end of the
+ * pipe with gdb's pid in pid, or -1.
+ */
+int start_gdb(char *const args[], int in, pid_t *pid)
+{
+	char dir[PATH_MAX], index_cache[PATH_MAX + 32];
+	char *argv[16];
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	char **env;
+	int fds[2], ret, argc = 0;
+
+	argv[argc++] = "gdb";
+	/* gdb's per build-id index cache spares it indexing the same DWARF on every core */
+	if (!cache_subdir(dir, sizeof(dir), "gdb-index")) {
+		snprintf(index_cache, sizeof(index_cache), "set index-cache directory %s", dir);
+		argv[argc++] = "-iex";
+		argv[argc++] = index_cache;
+		argv[argc++] = "-iex";
+		argv[argc++] = "set index-cache enabled on";
 	}
+	while (*args && argc < (int)G_N_ELEMENTS(argv) - 1)
+		argv[argc++] = *args++;
+	argv[argc] = NULL;
 
-	while(1) {
-		entry = readdir(dir);
-		if (!entry || !entry->d_name)
-			break;
-		if (entry->d_name[0] == '.')
-			continue;
-		if (!strstr(entry->d_name, coreprefix))
-			continue;
-		break;
+	env = gdb_environ();
+	if (!env)
+		return -1;
+	if (pipe2(fds, O_CLOEXEC)) {
+		free(env);
+		return -1;
 	}
-	closedir(dir);
-	free(coreprefix);
 
-	if (asprintf(&newpath, "%s%s.%s", processed_folder, corefilename, extension) == -1) {
-		ret = -1;
-		goto out;
+	spawn_placement(1);
+	ret = spawn_into_cgroup(pid, argv, env, in, fds[1]);
+	if (ret < 0) {
+		/* not started in the cgroup, moved there after */
+		posix_spawn_file_actions_init(&actions);
+		if (in >= 0)
+			posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+		posix_spawnattr_init(&attr);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK |
+					 POSIX_SPAWN_SETSIGDEF);
+		posix_spawnattr_setpgroup(&attr, 0);
+		sigemptyset(&mask);
+		posix_spawnattr_setsigmask(&attr, &mask);
+		sigfillset(&mask);
+		posix_spawnattr_setsigdefault(&attr, &mask);
+		ret = posix_spawnp(pid, argv[0], &actions, &attr, argv, env);
+		posix_spawnattr_destroy(&attr);
+		posix_spawn_file_actions_destroy(&actions);
+		if (!ret)
+			place_process(*pid);
+	}
+	spawn_placement(0);
+	free(env);
+	close(fds[1]);
+	if (ret) {
+		close(fds[0]);
+		return -1;
 	}
-	free(corefilename);
+	limit_gdb(*pid);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
 
-	rename(fullpath, newpath);
-	free(newpath);
-	return 0;
+	return fds[0];
+}
 
-out:
-	free(coreprefix);
-	free(corefilename);
-	fprintf(stderr, "+ ...move failed, ignoring/unlinking %s\n", fullpath);
-	unlink(fullpath);
-	return ret;
+/*
+ * Start "gdb --batch" over the core, with a timer for its wall clock
+ * limit.  Returns the read end of the pipe its output goes to, or -1.
+ */
+static int spawn_gdb(struct job *job)
+{
+	char *args[] = { "--batch", "-f", job->appfile, job->fullpath,
+			 "-x", "/etc/corewatcher/gdb.command", NULL };
+	int fd;
+
+	job->gdb_timer = -1;
+	fd = start_gdb(args, -1, &job->gdb_pid);
+	if (fd < 0)
+		return -1;
+
+	if (gdb_timeout > 0) {
+		job->gdb_timer = timer_new(gdb_timed_out, job);
+		if (job->gdb_timer >= 0)
+			timer_arm(job->gdb_timer, gdb_timeout * 1000, 0);
+	}
+
+	return fd;
 }
 
-static void skip_core(char *fullpath, char *extension)
+/* gdb is gone, reap it.  Returns 1 if it didn't finish by itself */
+static int reap_gdb(struct job *job)
 {
-	char *procfn;
-	int ret;
+	int status = 0;
 
-	procfn = replace_name(fullpath, extension, ".skipped");
-	if (!procfn) {
-		fprintf(stderr, "+  Problems with filename manipulation for %s\n", fullpath);
-		return;
+	if (job->gdb_timer >= 0) {
+		event_del(job->gdb_timer);
+		close(job->gdb_timer);
+		job->gdb_timer = -1;
 	}
+	while (waitpid(job->gdb_pid, &status, 0) < 0 && errno == EINTR)
+		;
 
-	ret = rename(fullpath, procfn);
-	if (ret) {
-		fprintf(stderr, "+  Unable to move %s to %s\n", fullpath, procfn);
-		free(procfn);
-		return;
+	return WIFSIGNALED(status);
+}
+
+/*
+ * Collect what gdb prints into one buffer so it can be handed to
+ * parse_gdb_output() in a single go.  Once gdb is done the job goes on
+ * to the parse stage.
+ */
+static void gdb_output_ready(int fd, guint32 __unused events, void *data)
+{
+	struct job *job = data;
+	ssize_t got;
+	char *n;
+
+	while (1) {
+		if (job->output_alloc - job->output_len < 4096) {
+			size_t alloc = job->output_alloc ? job->output_alloc * 2 : 65536;
+
+			n = realloc(job->output, alloc + 1);
+			if (!n)
+				break;
+			job->output = n;
+			job->output_alloc = alloc;
+		}
+		got = read(fd, job->output + job->output_len, job->output_alloc - job->output_len);
+		if (got > 0) {
+			job->output_len += got;
+			continue;
+		}
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0 && errno == EAGAIN)
+			return;
+		break;
 	}
 
-	fprintf(stderr, "+  Moved %s to %s\n", fullpath, procfn);
-	free(procfn);
-	return;
+	/* EOF (or out of memory): gdb is finished with us */
+	event_del(fd);
+	close(fd);
+	if (reap_gdb(job)) {
+		/* timed out or over its limits, what it said so far won't parse */
+		fprintf(stderr, "+ gdb killed over %s, reporting without a backtrace\n",
+			job->fullpath);
+		free(job->output);
+		job->output = NULL;
+		job->output_len = job->output_alloc = 0;
+	}
+	if (job->output)
+		job->output[job->output_len] = '\0';
+
+	/* never full, see start_pipeline() */
+	stage_push(&parse_stage, job, FALSE);
 }
 
 /*
- * Use GDB to extract backtrace information from corefile
+ * Reports come in two qualities: a "summary" made from the core's notes
+ * alone as soon as the core is seen (with summary-reports=yes), and the
+ * "full" one made from gdb's output whenever gdb gets to run.  Both carry
+ * the same report-id, the full report replaces the summary on disk and,
+ * once sent, on the server.
  */
-static struct oops *extract_core(char *fullpath, char *appfile, char *reportname)
+#define REPORT_HEAD (PATH_MAX + 256)
+
+/* does the report starting with text say it is a summary */
+int summary_report(const char *text, size_t len)
 {
-	struct oops *oops = NULL;
-	int ret = 0;
-	char *command = NULL, *h1 = NULL, *c1 = NULL, *c2 = NULL, *line = NULL;
-	char *text = NULL, *coretime = NULL;
-	char *m1 = NULL, *m2 = NULL;
-	int bt_lines = 0, maps_lines = 0;
-	FILE *file = NULL;
-	char *badchar = NULL;
-	char *release = get_release();
-	int parsing_maps = 0;
-	struct stat stat_buf;
-	size_t size = 0;
-	ssize_t bytesread = 0;
+	return memmem(text, MIN(len, REPORT_HEAD), "\nquality: summary\n", 18) != NULL;
+}
 
-	fprintf(stderr, "+ extract_core() called for %s\n", fullpath);
+/* is the report at path a summary, going by its first lines */
+int summary_report_at(const char *path)
+{
+	char head[REPORT_HEAD];
+	const char *name;
+	ssize_t len;
+	int fd;
+
+	fd = openat(folder_at(path, &name), name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	len = read(fd, head, sizeof(head));
+	close(fd);
 
-	if (asprintf(&command, "LANG=C gdb --batch -f '%s' '%s' -x /etc/corewatcher/gdb.command 2>&1", appfile, fullpath) == -1)
-		return NULL;
+	return len > 0 && summary_report(head, len);
+}
 
-	file = popen(command, "r");
-	free(command);
-	if (!file)
-		fprintf(stderr, "+ gdb failed for %s\n", fullpath);
+/* the lines every report of job's core starts with, up to "release" */
+static char *report_header(struct job *job, int summary)
+{
+	char *h1 = NULL, *coretime = NULL;
+	char *release = get_release();
+	char *details = crash_details(&job->name);
+	struct stat stat_buf;
+	const char *name;
+	int ret, dirfd = folder_at(job->fullpath, &name);
 
-	if (stat(fullpath, &stat_buf) != -1) {
+	if (fstatat(dirfd, name, &stat_buf, 0) != -1) {
 		coretime = malloc(26);
 		if (coretime)
 			ctime_r(&stat_buf.st_mtime, coretime);
@@ -311,348 +450,522 @@ static struct oops *extract_core(char *fullpath, char *appfile, char *reportname
 
 	ret = asprintf(&h1,
 		       "cmdline: %s\n"
-		       "time: %s",
-		       appfile,
-		       coretime ? coretime : "Unknown");
-	if (coretime)
-		free(coretime);
-	if (ret == -1)
+		       "time: %s"
+		       "report-id: %016llx\n"
+		       "quality: %s\n"
+		       "%s"
+		       "release: |\n"
+		       "%s",
+		       job->appfile,
+		       coretime ? coretime : "Unknown\n",
+		       (unsigned long long)report_id(job->fullpath),
+		       summary ? "summary" : "full",
+		       details ? details : "",
+		       release ? release : "        Unknown\n");
+	free(coretime);
+	free(details);
+	free(release);
+
+	return ret == -1 ? NULL : h1;
+}
+
+static struct oops *new_report(struct job *job, char *text)
+{
+	struct oops *oops;
+
+	oops = calloc(1, sizeof(struct oops));
+	if (!oops) {
+		free(text);
 		return NULL;
+	}
+	oops->application = strdup(job->appfile);
+	oops->text = text;
+	oops->filename = strdup(job->fullpath);
+	oops->detail_filename = strdup(job->reportname);
 
-	while (file && !feof(file)) {
-		bytesread = getline(&line, &size, file);
-		if (!size)
-			break;
-		if (bytesread == -1)
-			break;
+	return oops;
+}
 
-		/* gdb outputs (to stderr) many "warning: " strings
-		 * We can't trust the gdb 'bt' if these two are seen.
-		 */
-		if ((strncmp(line, "warning: core file may not match specified executable file.", 59) == 0) ||
-		    (strncmp(line, "warning: exec file is newer than core file.", 43) == 0)) {
-			free(line);
-			pclose(file);
-			free(h1);
-			fprintf(stderr, "+ core/executable mismatch for %s\n", fullpath);
+static struct oops *summarize_core(struct job *job);
+static struct oops *load_report(struct job *job, off_t size);
+
+/*
+ * Turn gdb's output for a core into a report
+ */
+static struct oops *extract_core(struct job *job)
+{
+	int ret = 0;
+	char *h1 = NULL;
+	char *text = NULL;
+	struct gdb_summary summary;
+	struct oops *oops;
+
+	memset(&summary, 0, sizeof(struct gdb_summary));
+
+	fprintf(stderr, "+ extract_core() called for %s\n", job->fullpath);
+
+	if (job->output) {
+		ret = parse_gdb_output(job->output, job->output_len, &summary);
+		if (ret == -EINVAL) {
+			fprintf(stderr, "+ core/executable mismatch for %s\n", job->fullpath);
 			return NULL;
 		}
+	}
 
-		/* try to figure out if we're onto the maps output yet */
-		if (strncmp(line, "From", 4) == 0) {
-			parsing_maps = 1;
-		}
-		/* maps might not be present */
-		if (strncmp(line, "No shared libraries", 19) == 0) {
-			break;
+	/*
+	 * gdb failed, was killed or got no backtrace: the core's notes still
+	 * say more than a report of "Unknown"s, which would replace a summary
+	 * already sent with nothing.  One already on disk is kept as it is.
+	 */
+	if (!summary.backtrace.text) {
+		struct stat stat_buf;
+		const char *name;
+
+		if (summary_report_at(job->reportname) &&
+		    fstatat(folder_at(job->reportname, &name), name, &stat_buf, 0) == 0)
+			oops = load_report(job, stat_buf.st_size);
+		else
+			oops = summarize_core(job);
+		if (oops) {
+			fprintf(stderr, "+ No backtrace for %s, reporting its summary\n",
+				job->fullpath);
+			free_gdb_summary(&summary);
+			oops->summary = 0;
+			oops->gdb_failed = 1;
+			return oops;
 		}
+	}
 
-		if (!parsing_maps) { /* parsing backtrace */
-			c2 = c1;
-
-			/* gdb's backtrace lines start with a line number */
-			if (line[0] != '#')
-				continue;
-
-			/* gdb prints some initial info which may include the
-			 * "#0" line of the backtrace, then prints the
-			 * backtrace in its entirety, leading to a
-			 * duplicate "#0" in our summary if we do do: */
-			if ((bt_lines == 1) && (strncmp(line, "#0 ", 3) == 0))
-				continue;
-			bt_lines++;
-
-			/* gdb outputs some 0x1a's which break XML */
-			do {
-				badchar = memchr(line, 0x1a, bytesread);
-				if (badchar)
-					*badchar = ' ';
-			} while (badchar);
-
-			if (c1) {
-				c1 = NULL;
-				if (asprintf(&c1, "%s        %s", c2, line) == -1)
-					continue;
-				free(c2);
-			} else {
-				/* keep going even if asprintf has errors */
-				ret = asprintf(&c1, "        %s", line);
-			}
-		} else { /* parsing maps */
-			m2 = m1;
-			maps_lines++;
-			if (m1) {
-				m1 = NULL;
-				if (asprintf(&m1, "%s        %s", m2, line) == -1)
-					continue;
-				free(m2);
-			} else {
-				/* keep going even if asprintf has errors */
-				ret = asprintf(&m1, "        %s", line);
-			}
-		}
+	h1 = report_header(job, 0);
+	if (!h1) {
+		free_gdb_summary(&summary);
+		return NULL;
 	}
-	if (line)
-		free(line);
-	if (file)
-		pclose(file);
 
 	ret = asprintf(&text,
-		       "%s"
-		       "release: |\n"
 		       "%s"
 		       "backtrace: |\n"
 		       "%s"
 		       "maps: |\n"
 		       "%s",
 		       h1,
-		       release ? release : "        Unknown\n",
-		       c1 ? c1 : "        Unknown\n",
-		       m1 ? m1 : "        Unknown\n");
+		       summary.backtrace.text ? summary.backtrace.text : "        Unknown\n",
+		       summary.maps.text ? summary.maps.text : "        Unknown\n");
 	free(h1);
-	if (c1)
-		free(c1);
-	if (m1)
-		free(m1);
-	if (release)
-		free(release);
+	free_gdb_summary(&summary);
 
 	if (ret == -1)
 		return NULL;
 
-	oops = malloc(sizeof(struct oops));
-	if (!oops) {
-		free(text);
-		return NULL;
-	}
-	memset(oops, 0, sizeof(struct oops));
-	oops->next = NULL;
-	oops->application = strdup(appfile);
-	oops->text = text;
-	oops->filename = strdup(fullpath);
-	oops->detail_filename = strdup(reportname);
-	return oops;
+	return new_report(job, text);
 }
 
-/*
- * input filename has the form: core_$APP_$TIMESTAMP[.$PID]
- * output filename has form of: $APP_$TIMESTAMP.txt
- */
-static char *make_report_filename(char *filename)
+/* a summary report for job's core, from its notes */
+static struct oops *summarize_core(struct job *job)
 {
-	char *name = NULL, *dotpid = NULL, *stamp = NULL, *detail_filename = NULL;
-
-	if (!filename)
-		return NULL;
-
-	if (!(stamp = strstr(filename, "_")))
-		return NULL;
+	struct oops *oops;
+	char *h1, *notes, *text = NULL;
+	const char *name;
+	int ret;
 
-	if (!(++stamp))
+	notes = core_summary(folder_at(job->fullpath, &name), name);
+	if (!notes)
 		return NULL;
-
-	if (!(name = strdup(stamp)))
+	h1 = report_header(job, 1);
+	ret = h1 ? asprintf(&text, "%s%s", h1, notes) : -1;
+	free(h1);
+	free(notes);
+	if (ret == -1)
 		return NULL;
 
-	/* strip trailing .PID if present */
-	dotpid = strstr(name, ".");
-	if (dotpid)
-		*dotpid = '\0';
+	oops = new_report(job, text);
+	if (oops)
+		oops->summary = 1;
 
-	if ((asprintf(&detail_filename, "%s%s.txt", processed_folder, name)) == -1) {
-		free(name);
-		return NULL;
-	}
-	free(name);
-
-	return detail_filename;
+	return oops;
 }
 
 /*
  * Write the backtrace from the core file into a text
- * file named as $APP_$TIMESTAMP.txt
+ * file named as $APP_$TIMESTAMP.txt.  A full report replaces the
+ * summary by renaming over it, as the summary may be mapped by the
+ * submitter just then.
  */
 static void write_core_detail_file(struct oops *oops)
 {
-	int fd = 0;
+	char tmp[PATH_MAX];
+	const char *name, *base;
+	int dirfd, fd = 0;
 
 	if (!oops->detail_filename)
 		return;
 
-	fd = open(oops->detail_filename, O_WRONLY | O_CREAT | O_TRUNC, 0);
+	dirfd = folder_at(oops->detail_filename, &name);
+	base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	if (snprintf(tmp, sizeof(tmp), "%.*s.%s.tmp", (int)(base - name), name, base) >=
+	    (int)sizeof(tmp))
+		return;
+	fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0);
+	if (fd == -1 && errno == ENOENT && dirfd == processed_dirfd && make_shard(name) == 0)
+		fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0);
 	if (fd == -1) {
 		fprintf(stderr, "+ Error creating/opening %s for write\n", oops->detail_filename);
 		return;
 	}
 
-	if(write(fd, oops->text, strlen(oops->text)) >= 0) {
+	oops->size = strlen(oops->text);
+	if (write(fd, oops->text, oops->size) == oops->size && fchmod(fd, 0644) == 0 &&
+	    renameat(dirfd, tmp, dirfd, name) == 0) {
 		fprintf(stderr, "+ Wrote %s\n", oops->detail_filename);
-		fchmod(fd, 0644);
 	} else {
 		fprintf(stderr, "+ Error writing %s\n", oops->detail_filename);
-		unlink(oops->detail_filename);
+		unlinkat(dirfd, tmp, 0);
 	}
 	close(fd);
 }
 
+/*
+ * Send a summary report for job's core right away, ahead of its turn
+ * with gdb.  Returns 0 if one was queued.
+ */
+static int send_summary(struct job *job)
+{
+	struct oops *oops;
 
+	oops = summarize_core(job);
+	if (!oops) {
+		fprintf(stderr, "+  No summary for %s\n", job->fullpath);
+		return -1;
+	}
+	write_core_detail_file(oops);
+	if (fingerprint_submit)
+		report_fingerprint(oops->application, oops->text, oops->fingerprint);
+	free(oops->text);
+	oops->text = NULL;
+	if (fingerprint_submit && fingerprint_suppressed(oops->fingerprint)) {
+		FREE_OOPS(oops);
+		return -1;
+	}
+
+	fprintf(stderr, "+  Queued summary %s\n", oops->detail_filename);
+	queue_backtrace(oops);
+
+	return 0;
+}
 
 /*
- * Creates $APP_$TIMESTAMP.txt report summaries if they don't exist and
- * adds the oops struct to the submit queue
+ * Queue entry for an existing $APP_$TIMESTAMP.txt report: only where it
+ * is and how big, its text stays on disk until it is needed.
  */
-static void *create_report(char *fullpath)
-{
-	struct oops *oops = NULL;
-	char *procfn = NULL;
-	char *app = NULL, *appname = NULL, *appfile = NULL, *corefn = NULL, *reportname = NULL;
-	char *old_ext = ".processed";
-	char *new_ext = ".to-process";
-	char *ext = NULL;
-	struct stat stat_buf;
-	int new = 0, ret;
+static struct oops *load_report(struct job *job, off_t size)
+{
+	struct oops *oops;
+
+	oops = malloc(sizeof(struct oops));
+	if (!oops) {
+		fprintf(stderr, "+  Malloc failed for struct oops\n");
+		return NULL;
+	}
+	memset(oops, 0, sizeof(struct oops));
+
+	oops->next = NULL;
+	oops->application = strdup(job->appfile);
+	oops->filename = strdup(job->fullpath);
+	oops->detail_filename = strdup(job->reportname);
+	oops->size = size;
 
-	fprintf(stderr, "+ Entered create_report() for %s\n", fullpath);
+	return oops;
+}
 
-	if (strstr(fullpath, ".to-process")) {
-		new = 1;
-		ext = new_ext;
-	} else if (strstr(fullpath, ".processed")) {
-		ext = old_ext;
-	} else if (strstr(fullpath, ".skipped")) {
-		fprintf(stderr, "+  Already skipped\n");
+/*
+ * Read a report's text back in from its $APP_$TIMESTAMP.txt, for the
+ * rare callers that need all of it at once.  The caller frees it.
+ */
+char *read_report(struct oops *oops)
+{
+	struct stat stat_buf;
+	const char *name;
+	char *text;
+	ssize_t ret;
+	int fd;
+
+	fd = openat(folder_at(oops->detail_filename, &name), name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "+  Open failed for %s\n", oops->detail_filename);
 		return NULL;
-	} else { /* bad state */
-		fprintf(stderr, "+  Missing extension? (%s)\n", fullpath);
-		unlink(fullpath);
+	}
+	if (fstat(fd, &stat_buf) || !(text = malloc(stat_buf.st_size + 1))) {
+		close(fd);
 		return NULL;
 	}
-
-	corefn = strip_directories(fullpath);
-	if (!corefn) {
-		fprintf(stderr, "+  No corefile? (%s)\n", fullpath);
+	ret = read(fd, text, stat_buf.st_size);
+	close(fd);
+	if (ret != stat_buf.st_size) {
+		fprintf(stderr, "+  Read failed for %s\n", oops->detail_filename);
+		free(text);
 		return NULL;
 	}
+	text[ret] = '\0';
+
+	return text;
+}
+
+/*
+ * Fingerprint a report, reading only the start of its backtrace back in
+ * if its text is on disk.
+ */
+static void fingerprint_report(struct oops *oops)
+{
+	const char *name;
+	int fd;
 
-	/* don't process rpm, gdb or corewatcher crashes */
-	appname = find_causingapp(fullpath);
-	if (!appname) {
+	if (oops->text) {
+		report_fingerprint(oops->application, oops->text, oops->fingerprint);
+		return;
+	}
+
+	fd = openat(folder_at(oops->detail_filename, &name), name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "+  Open failed for %s\n", oops->detail_filename);
+		report_fingerprint(oops->application, NULL, oops->fingerprint);
+		return;
+	}
+	file_fingerprint(fd, oops->application, oops->fingerprint);
+}
+
+/*
+ * Triage stage: decide whether a core gets a report at all, and whether
+ * that needs gdb (analyze stage) or a report already exists (straight to
+ * the persist stage).
+ */
+void triage_core(struct job *job)
+{
+	char app[NAME_MAX + 1], reportname[PATH_MAX];
+	const char *corefn = job->name.base, *name;
+	struct stat stat_buf;
+	int have_report;
+
+	fprintf(stderr, "+ Triaging %s\n", job->fullpath);
+
+	/*
+	 * New cores were checked against the ignore rules before they were
+	 * moved, but the rules may have changed since older ones were.
+	 */
+	if (core_app(app, sizeof(app), &job->name)) {
 		fprintf(stderr, "+  No appname in %s\n", corefn);
-		skip_core(fullpath, ext);
-		free(corefn);
-		return NULL;
+		skip_core(job);
+		goto done;
 	}
-	app = strip_directories(appname);
-	if (!app ||
-	    !strncmp(app, "rpm", 3) ||
-	    !strncmp(app, "gdb", 3) ||
-	    !strncmp(app, "corewatcher", 11)) {
+	if (!app_allowed(app)) {
 		fprintf(stderr, "+  ...skipping %s's %s\n", app, corefn);
-		skip_core(fullpath, ext);
-		free(corefn);
-		free(appname);
-		free(app);
-		return NULL;
+		skip_core(job);
+		goto done;
 	}
 
-	/* also skip apps which don't appear to be part of the OS */
-	appfile = find_apppath(appname);
-	if (!appfile) {
-		fprintf(stderr, "+  ...skipping %s's %s\n", appname, corefn);
-		skip_core(fullpath, ext);
-		free(corefn);
-		free(appname);
-		free(app);
-		return NULL;
+	/* also skip apps which don't appear to be part of the OS, or are ignored */
+	job->appfile = crash_exe(&job->name);
+	if (!job->appfile)
+		job->appfile = find_apppath(app);
+	if (!job->appfile || !path_allowed(job->appfile)) {
+		fprintf(stderr, "+  ...skipping %s's %s\n", app, corefn);
+		skip_core(job);
+		goto done;
 	}
-	free(appname);
-	free(app);
 
-	reportname = make_report_filename(corefn);
-	if (!reportname) {
+	/* the server may have asked for no more of this application's crashes */
+	if (fingerprint_submit) {
+		char fp[APP_FINGERPRINT_LEN + 1];
+
+		app_fingerprint(job->appfile, fp);
+		if (fingerprint_suppressed(fp)) {
+			fprintf(stderr, "+  ...server suppressed %s, skipping %s\n", job->appfile, corefn);
+			skip_core(job);
+			goto done;
+		}
+	}
+
+	if (core_report_path(reportname, sizeof(reportname), &job->name) ||
+	    !(job->reportname = strdup(reportname))) {
 		fprintf(stderr, "+  Couldn't make report name for %s\n", corefn);
-		free(corefn);
-		free(appfile);
-		return NULL;
+		goto done;
 	}
-	free(corefn);
-	if (stat(reportname, &stat_buf) == 0) {
-		int fd, ret;
-		/*
-		 * TODO:
-		 *   If the file already had trailing ".processed" but the txt file
-		 *   is a low quality report, then create a new report.
-		 */
-		fprintf(stderr, "+  Report already exists in %s\n", reportname);
 
-		oops = malloc(sizeof(struct oops));
-		if (!oops) {
-			fprintf(stderr, "+  Malloc failed for struct oops\n");
-			free(reportname);
-			free(appfile);
-			return NULL;
-		}
-		memset(oops, 0, sizeof(struct oops));
-
-		oops->next = NULL;
-		oops->application = strdup(appfile);
-		oops->filename = strdup(fullpath);
-		oops->detail_filename = strdup(reportname);
-		free(reportname);
-		free(appfile);
-
-		oops->text = malloc(stat_buf.st_size + 1);
-		if (!oops->text) {
-			fprintf(stderr, "+  Malloc failed for oops text\n");
-			goto err;
-		}
-		fd = open(oops->detail_filename, O_RDONLY);
-		if (fd == -1) {
-			fprintf(stderr, "+  Open failed for oops text\n");
-			goto err;
-		}
-		ret = read(fd, oops->text, stat_buf.st_size);
-		close(fd);
-		if (ret != stat_buf.st_size) {
-			fprintf(stderr, "+  Read failed for oops text\n");
-			goto err;
-		}
-		oops->text[stat_buf.st_size] = '\0';
+	have_report = fstatat(folder_at(reportname, &name), name, &stat_buf, 0) == 0;
+	if (have_report && job->name.state == CORE_TO_PROCESS && summary_report_at(reportname)) {
+		/* only a summary was sent so far, gdb still has to run */
+		fprintf(stderr, "+  Upgrading summary %s\n", job->reportname);
+	} else if (have_report) {
+		fprintf(stderr, "+  Report already exists in %s\n", job->reportname);
+		job->oops = load_report(job, stat_buf.st_size);
+		if (!job->oops)
+			goto done;
+		if (stage_push(&persist_stage, job, FALSE) == 0)
+			job = NULL;
+		else
+			fprintf(stderr, "+  Persist backlogged, deferring %s\n", corefn);
+		goto done;
+	} else if (summary_reports && job->name.state == CORE_TO_PROCESS) {
+		/* the full report follows once gdb had its go */
+		send_summary(job);
+	}
+
+	if (stage_push(&analyze_stage, job, FALSE) == 0) {
+		job = NULL;
+	} else if (stage_has_app(&analyze_stage, job->appfile)) {
+		/* a crash storm: one core of this app is plenty */
+		fprintf(stderr, "+  Analysis backlogged, shedding duplicate %s\n", corefn);
+		skip_core(job);
 	} else {
-		oops = extract_core(fullpath, appfile, reportname);
-		free(reportname);
-		free(appfile);
+		/* leave it on disk for the next scan */
+		fprintf(stderr, "+  Analysis backlogged, deferring %s\n", corefn);
+	}
 
-		if (!oops) {
-			fprintf(stderr, "+  Did not generate struct oops for %s\n", fullpath);
-			skip_core(fullpath, ext);
-			return NULL;
-		}
+done:
+	finish_job(job);
+}
+
+/*
+ * Analyze stage: load the core into a gdb session (see gdbmi.c), or else
+ * start gdb over it, its output is collected from the event loop by
+ * gdb_output_ready().
+ */
+void analyze_core(struct job *job)
+{
+	int fd;
+
+	if (gdb_session_cores > 0 && !session_analyze(job))
+		return;
+
+	fprintf(stderr, "+ Running gdb over %s\n", job->fullpath);
+
+	fd = spawn_gdb(job);
+	if (fd >= 0 && event_add(fd, EPOLLIN, gdb_output_ready, job)) {
+		close(fd);
+		kill(-job->gdb_pid, SIGKILL);
+		reap_gdb(job);
+		fd = -1;
+	}
+	if (fd < 0) {
+		/* still worth a report, from the core's notes (see extract_core()) */
+		fprintf(stderr, "+ gdb failed for %s\n", job->fullpath);
+		stage_push(&parse_stage, job, FALSE);
+	}
+}
+
+/*
+ * Parse stage: turn gdb's output into a report.  Ends the job's turn in
+ * the analyze stage, making room for another gdb.
+ */
+void parse_core(struct job *job)
+{
+	int ret;
+
+	job->oops = extract_core(job);
+	/* gdb got what it could out of the core, keep only what a second look needs */
+	if (job->oops && !job->oops->gdb_failed && keep_minidumps) {
+		ret = shrink_core(job->fullpath);
+		if (ret && ret != -ENOTSUP)
+			fprintf(stderr, "+ Keeping %s whole, no minidump: %s\n",
+				job->fullpath, strerror(-ret));
+	}
+	free(job->output);
+	job->output = NULL;
+	job->output_len = job->output_alloc = 0;
+
+	stage_done(&analyze_stage);
+
+	if (!job->oops) {
+		fprintf(stderr, "+  Did not generate struct oops for %s\n", job->fullpath);
+		skip_core(job);
+		finish_job(job);
+		return;
+	}
+	job->analyzed = 1;
+
+	stage_push(&persist_stage, job, TRUE);
+}
+
+/*
+ * Persist stage: write out a freshly generated report, move the core on
+ * to ".processed" and hand the report to the submitter.
+ */
+void persist_core(struct job *job)
+{
+	struct oops *oops = job->oops;
+	char procfn[PATH_MAX];
+	int ret;
+
+	/* a summary kept for want of a backtrace is on disk already */
+	if (job->analyzed && oops->text)
 		write_core_detail_file(oops);
+
+	/* existing reports are only read (in part) if the server wants fingerprints */
+	if (fingerprint_submit)
+		fingerprint_report(oops);
+	/* only a handle is queued for submission, the text stays on disk */
+	free(oops->text);
+	oops->text = NULL;
+	if (fingerprint_submit && fingerprint_suppressed(oops->fingerprint)) {
+		fprintf(stderr, "+  ...server suppressed %s, skipping\n", oops->fingerprint);
+		skip_core(job);
+		finish_job(job);
+		return;
 	}
 
-	if (new) {
-		fprintf(stderr, "+  Renaming %s (%s -> %s)\n", fullpath, new_ext, old_ext);
-		procfn = replace_name(fullpath, new_ext, old_ext);
-		if (!procfn) {
-			fprintf(stderr, "+  Problems with filename manipulation for %s\n", fullpath);
-			return oops;
-		}
-		ret = rename(fullpath, procfn);
+	if (job->name.state == CORE_TO_PROCESS) {
+		fprintf(stderr, "+  Renaming %s to .processed\n", job->fullpath);
+		ret = core_rename(&job->name, CORE_PROCESSED, procfn, sizeof(procfn));
 		if (ret) {
-			fprintf(stderr, "+  Unable to move %s to %s\n", fullpath, procfn);
-			free(procfn);
-			return oops;
+			fprintf(stderr, "+  Unable to move %s to .processed: %s\n",
+				job->fullpath, strerror(-ret));
+		} else {
+			free(oops->filename);
+			oops->filename = strdup(procfn);
 		}
-		free(oops->filename);
-		oops->filename = strdup(procfn);
-		free(procfn);
 	}
 
-	return oops;
-err:
-	FREE_OOPS(oops);
-	return NULL;
+	fprintf(stderr, "+ Queued backtrace from %s\n", oops->detail_filename);
+	queue_backtrace(oops);
+	job->oops = NULL;
+	finish_job(job);
+}
+
+/*
+ * Hand a core in processed_folder to the pipeline, unless it already is
+ * in there.  Returns 1 if it was queued.  Never blocks: if triage is
+ * backlogged the core simply stays on disk until the next scan, and
+ * -EBUSY is returned.
+ */
+int ingest_core(const char *fullpath)
+{
+	struct core_name cn;
+	struct job *job;
+
+	if (parse_core_name(fullpath, &cn) || cn.state == CORE_NEW) {
+		/* bad state */
+		const char *name;
+
+		fprintf(stderr, "+  Missing extension? (%s)\n", fullpath);
+		unlinkat(folder_at(fullpath, &name), name, 0);
+		return 0;
+	}
+	if (cn.state == CORE_SKIPPED || cn.state == CORE_SUBMITTED)
+		return 0;
+	if (cn.state == CORE_PROCESSED && backtrace_queued(fullpath))
+		return 0;
+
+	job = claim_core(fullpath);
+	if (!job)
+		return 0;
+
+	if (stage_push(&triage_stage, job, FALSE)) {
+		fprintf(stderr, "+ Triage backlogged, leaving %s for later\n", fullpath);
+		finish_job(job);
+		return -EBUSY;
+	}
+
+	return 1;
 }
 
 /*
@@ -663,116 +976,121 @@ int scan_core_folder(void __unused *unused)
 {
 	DIR *dir = NULL;
 	struct dirent *entry = NULL;
-	char *fullpath = NULL;
-	int ret, work = 0;
+	char newpath[PATH_MAX];
+	int work = 0;
+	int fd;
 
-	dir = opendir(core_folder);
+	fd = openat(core_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir = fd < 0 ? NULL : fdopendir(fd);
 	if (!dir) {
+		if (fd >= 0)
+			close(fd);
 		fprintf(stderr, "+ Unable to open %s\n", core_folder);
 		return -1;
 	}
 	fprintf(stderr, "+ Begin scanning %s...\n", core_folder);
 	while(1) {
 		entry = readdir(dir);
-		if (!entry || !entry->d_name)
+		if (!entry)
 			break;
 		if (entry->d_name[0] == '.')
 			continue;
 		if (strncmp(entry->d_name, "core_", 5))
 			continue;
 
-		/* matched core_#### */
-		if (asprintf(&fullpath, "%s%s", core_folder, entry->d_name) == -1) {
-			fullpath = NULL;
-			continue;
-		}
-
-		/* If one were to prompt the user before submitting, that
+		/* matched core_####
+		 * If one were to prompt the user before submitting, that
 		 * might happen here.  */
 
-		fprintf(stderr, "+ Looking at %s\n", fullpath);
+		fprintf(stderr, "+ Looking at %s%s\n", core_folder, entry->d_name);
 
-		ret = move_core(fullpath, "to-process");
-		if (ret == 0)
-			work++;
-
-		free(fullpath);
-		fullpath = NULL;
+		if (move_core(entry->d_name, newpath, sizeof(newpath)) == 0)
+			work += ingest_core(newpath) > 0;
 	}
 	closedir(dir);
 
-	if (work) {
-		fprintf(stderr, "+ Found %d files, setting pq_work condition\n", work);
-		g_mutex_lock(pq_mtx);
-		g_cond_signal(pq_work);
-		pq = TRUE;
-		g_mutex_unlock(pq_mtx);
-	}
-
-	fprintf(stderr, "+ End scanning %s...\n", core_folder);
+	fprintf(stderr, "+ End scanning %s, %d new cores...\n", core_folder, work);
 	return TRUE;
 }
 
 /*
- * scan for core_*.to-process and core_*.processed,
- * insure a summary *.txt report exists, then queue it
+ * scan one shard ("" for the top) of processed_folder, see
+ * scan_processed_folder().  Returns the number of cores queued, or -1
+ * if the shard has nothing left to do.
  */
-void *scan_processed_folder(void __unused *unused)
+static int scan_shard(const char *shard)
 {
 	DIR *dir = NULL;
 	struct dirent *entry = NULL;
+	struct core_name cn;
 	char *fullpath = NULL;
-	struct oops *oops = NULL;
+	int work = 0, pending = 0;
+	int fd;
 
+	fd = openat(processed_dirfd, shard[0] ? shard : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!dir) {
+		if (fd >= 0)
+			close(fd);
+		fprintf(stderr, "+ Unable to open %s%s\n", processed_folder, shard);
+		return errno == ENOENT ? -1 : 0;
+	}
 	while(1) {
-		g_mutex_lock(pq_mtx);
-		while (pq != TRUE) {
-			fprintf(stderr, "+ Awaiting work in %s...\n", processed_folder);
-			g_cond_wait(pq_work, pq_mtx);
-		}
-		pq = FALSE;
-		g_mutex_unlock(pq_mtx);
+		entry = readdir(dir);
+		if (!entry)
+			break;
+		if (entry->d_name[0] == '.')
+			continue;
 
-		fprintf(stderr, "+ Begin scanning %s...\n", processed_folder);
+		/* files with trailing ".to-process" or "processed" represent new work */
+		if (parse_core_name(entry->d_name, &cn) ||
+		    (cn.state != CORE_TO_PROCESS && cn.state != CORE_PROCESSED))
+			continue;
+		pending++;
 
-		dir = opendir(processed_folder);
-		if (!dir) {
-			fprintf(stderr, "+ Unable to open %s\n", processed_folder);
+		if (asprintf(&fullpath, "%s%s%s", processed_folder, shard, entry->d_name) == -1) {
+			fullpath = NULL;
 			continue;
 		}
-		while(1) {
-			entry = readdir(dir);
-			if (!entry || !entry->d_name)
-				break;
-			if (entry->d_name[0] == '.')
-				continue;
 
-			/* files with trailing ".to-process" or "processed" represent new work */
-			if (!strstr(entry->d_name, "process"))
-				continue;
+		work += ingest_core(fullpath) > 0;
 
-			if (asprintf(&fullpath, "%s%s", processed_folder, entry->d_name) == -1) {
-				fullpath = NULL;
-				continue;
-			}
+		free(fullpath);
+		fullpath = NULL;
+	}
+	closedir(dir);
 
-			fprintf(stderr, "+ Looking at %s\n", fullpath);
+	return pending ? work : -1;
+}
 
-			oops = create_report(fullpath);
+/*
+ * scan for core_*.to-process and core_*.processed and feed any not yet
+ * being worked on into the pipeline to insure a summary *.txt report
+ * exists and is queued for submission.  Only the shards in the index
+ * are looked at, besides the top of processed_folder.
+ */
+int scan_processed_folder(void __unused *unused)
+{
+	char **shards;
+	int i, ret, work = 0;
 
-			if (oops) {
-				fprintf(stderr, "+ Queued backtrace from %s\n", oops->detail_filename);
-				queue_backtrace(oops);
-			}
+	fprintf(stderr, "+ Begin scanning %s...\n", processed_folder);
 
-			free(fullpath);
-			fullpath = NULL;
-		}
-		closedir(dir);
-		fprintf(stderr, "+ End scanning %s...\n", processed_folder);
+	ret = scan_shard("");
+	work += MAX(ret, 0);
+
+	shards = active_shards();
+	for (i = 0; shards[i]; i++) {
+		ret = scan_shard(shards[i]);
+		if (ret < 0)
+			shard_idle(shards[i]);
+		work += MAX(ret, 0);
 	}
+	g_strfreev(shards);
 
-	return NULL;
+	fprintf(stderr, "+ End scanning %s, %d cores queued...\n", processed_folder, work);
+
+	return TRUE;
 }
 
 static void disable_corefiles(int diskfree)
@@ -835,7 +1153,7 @@ int scan_folders(void __unused *unused)
 	struct statvfs stat;
 	int newdiskfree;
 
-	if (statvfs(core_folder, &stat) == 0) {
+	if (fstatvfs(core_dirfd, &stat) == 0) {
 		newdiskfree = (int)(100 * stat.f_bavail / stat.f_blocks);
 
 		if ((newdiskfree < 10) && (diskfree >= 10))
@@ -847,11 +1165,10 @@ int scan_folders(void __unused *unused)
 	}
 
 	scan_core_folder(NULL);
+	scan_processed_folder(NULL);
 
-	g_mutex_lock(pq_mtx);
-	g_cond_signal(pq_work);
-	pq = TRUE;
-	g_mutex_unlock(pq_mtx);
+	/* give reports that failed to send another try */
+	kick_submitter();
 
 	return TRUE;
 }
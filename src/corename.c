@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * Core file names are "core_$APP_$TIMESTAMP.$PID$STATE": the kernel's
+ * core_%e_%t with core_uses_pid, plus the state extension corewatcher
+ * adds as the core moves along (none while it sits in core_folder).
+ *
+ * $APP is the kernel's comm for the process and may itself contain '_'
+ * and '.', so the name is taken apart from the right: state, then .$PID,
+ * then _$TIMESTAMP, and whatever is left after "core_" is $APP.
+ */
+static const char *state_ext[] = {
+	[CORE_NEW] = "",
+	[CORE_TO_PROCESS] = ".to-process",
+	[CORE_PROCESSED] = ".processed",
+	[CORE_SUBMITTED] = ".submitted",
+	[CORE_SKIPPED] = ".skipped",
+};
+
+const char *core_state_ext(enum core_state state)
+{
+	return state_ext[state];
+}
+
+/* parse the digits in [s, end), returns -1 if there are none or others */
+static long long parse_number(const char *s, const char *end)
+{
+	long long n = 0;
+
+	if (s == end)
+		return -1;
+	for (; s < end; s++) {
+		if (*s < '0' || *s > '9')
+			return -1;
+		n = n * 10 + (*s - '0');
+	}
+
+	return n;
+}
+
+/*
+ * Parse path (with or without directories) into cn, which points into
+ * path and is valid for as long as it is.  Returns 0, or -EINVAL if this
+ * isn't a core file name.
+ */
+int parse_core_name(const char *path, struct core_name *cn)
+{
+	const char *base, *end, *c;
+	long long n;
+	int state;
+
+	memset(cn, 0, sizeof(struct core_name));
+
+	base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	if (strncmp(base, "core_", 5))
+		return -EINVAL;
+	end = base + strlen(base);
+
+	cn->state = CORE_NEW;
+	for (state = CORE_TO_PROCESS; state < CORE_STATES; state++) {
+		size_t len = strlen(state_ext[state]);
+
+		if ((size_t)(end - base) > len && !strcmp(end - len, state_ext[state])) {
+			cn->state = state;
+			end -= len;
+			break;
+		}
+	}
+	cn->path = path;
+	cn->base = base;
+	cn->key_len = end - base;
+
+	/* .$PID, if there is one */
+	for (c = end - 1; c > base && *c != '.' && *c != '_'; c--)
+		;
+	if (*c == '.') {
+		n = parse_number(c + 1, end);
+		if (n < 0 || n > G_MAXINT)
+			return -EINVAL;
+		cn->pid = n;
+		end = c;
+	}
+
+	/* _$TIMESTAMP */
+	for (c = end - 1; c > base + 4 && *c != '_'; c--)
+		;
+	if (c <= base + 5)
+		return -EINVAL;
+	n = parse_number(c + 1, end);
+	if (n < 0)
+		return -EINVAL;
+	cn->timestamp = n;
+	cn->stamp = c + 1;
+	cn->stamp_len = end - (c + 1);
+
+	cn->app = base + 5;
+	cn->app_len = c - cn->app;
+
+	return 0;
+}
+
+static int check_len(int n, size_t size)
+{
+	return (n < 0 || (size_t)n >= size) ? -ENAMETOOLONG : 0;
+}
+
+/*
+ * The name of core cn once it is in state, relative to its folder:
+ * core_folder for CORE_NEW, its shard of processed_folder for everything
+ * else.
+ */
+static int core_relname(char *buf, size_t size, const struct core_name *cn,
+			enum core_state state)
+{
+	char shard[SHARD_MAX] = "";
+
+	if (state != CORE_NEW && core_shard(shard, sizeof(shard), cn))
+		return -EINVAL;
+
+	return check_len(snprintf(buf, size, "%s%.*s%s", shard, (int)cn->key_len,
+				  cn->base, state_ext[state]), size);
+}
+
+/* format the full path of core cn once it is in state */
+int core_path(char *buf, size_t size, const struct core_name *cn, enum core_state state)
+{
+	char name[PATH_MAX];
+
+	if (core_relname(name, sizeof(name), cn, state))
+		return -ENAMETOOLONG;
+
+	return check_len(snprintf(buf, size, "%s%s",
+				  state == CORE_NEW ? core_folder : processed_folder,
+				  name), size);
+}
+
+/* $APP alone, for looking up the executable */
+int core_app(char *buf, size_t size, const struct core_name *cn)
+{
+	return check_len(snprintf(buf, size, "%.*s", (int)cn->app_len, cn->app), size);
+}
+
+/* the core's report: $APP_$TIMESTAMP.txt in the core's shard */
+int core_report_path(char *buf, size_t size, const struct core_name *cn)
+{
+	char shard[SHARD_MAX];
+
+	if (core_shard(shard, sizeof(shard), cn))
+		return -EINVAL;
+
+	return check_len(snprintf(buf, size, "%s%s%.*s_%.*s.txt", processed_folder,
+				  shard, (int)cn->app_len, cn->app,
+				  (int)cn->stamp_len, cn->stamp), size);
+}
+
+/*
+ * core_folder and processed_folder are held open for the life of the
+ * daemon and files in them are only ever reached relative to these, so
+ * each operation looks up one name instead of walking the whole path.
+ */
+int core_dirfd = -1;
+int processed_dirfd = -1;
+
+/* open both folders, once they exist */
+int open_folders(void)
+{
+	core_dirfd = open(core_folder, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (core_dirfd < 0) {
+		fprintf(stderr, "+ Unable to open %s\n", core_folder);
+		return -1;
+	}
+	processed_dirfd = open(processed_folder, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (processed_dirfd < 0) {
+		fprintf(stderr, "+ Unable to open %s\n", processed_folder);
+		close(core_dirfd);
+		core_dirfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The folder path is in as a directory fd, with *name set to path
+ * relative to it (including its shard, in processed_folder).  Paths
+ * outside both folders come back as is, relative to AT_FDCWD.
+ */
+int folder_at(const char *path, const char **name)
+{
+	size_t len = strlen(processed_folder);
+
+	/* processed_folder lives inside core_folder, so look for it first */
+	if (!strncmp(path, processed_folder, len)) {
+		*name = path + len;
+		return processed_dirfd;
+	}
+	len = strlen(core_folder);
+	if (!strncmp(path, core_folder, len) && !strchr(path + len, '/')) {
+		*name = path + len;
+		return core_dirfd;
+	}
+	*name = path;
+
+	return AT_FDCWD;
+}
+
+/* rename that fails with EEXIST rather than replace an existing file */
+int rename_noreplace(int olddir, const char *old, int newdir, const char *new)
+{
+	if (renameat2(olddir, old, newdir, new, RENAME_NOREPLACE) == 0)
+		return 0;
+	if (errno != EINVAL && errno != ENOSYS)
+		return -1;
+
+	/* the filesystem or kernel can't do it; link() never replaces either */
+	if (linkat(olddir, old, newdir, new, 0))
+		return -1;
+	unlinkat(olddir, old, 0);
+
+	return 0;
+}
+
+/*
+ * Move core cn on to state, into its shard of processed_folder if it is
+ * still in core_folder.  Its new full path goes to newpath unless that
+ * is NULL.  Returns 0 or -errno, -EEXIST if a core of the same name
+ * already is in that state.
+ */
+int core_rename(const struct core_name *cn, enum core_state state, char *newpath, size_t size)
+{
+	char name[PATH_MAX], path[PATH_MAX];
+	const char *old = cn->base;
+	int olddir = core_dirfd;
+	int newdir = state == CORE_NEW ? core_dirfd : processed_dirfd;
+	int ret;
+
+	/* wherever it is in processed_folder, maybe not where the layout wants it */
+	if (cn->state != CORE_NEW)
+		olddir = folder_at(cn->path, &old);
+
+	if (core_relname(name, sizeof(name), cn, state) ||
+	    core_path(path, sizeof(path), cn, state))
+		return -ENAMETOOLONG;
+
+	ret = rename_noreplace(olddir, old, newdir, name);
+	if (ret && errno == ENOENT && newdir == processed_dirfd && make_shard(name) == 0)
+		ret = rename_noreplace(olddir, old, newdir, name);
+	if (ret)
+		return -errno;
+
+	/* only now, newpath may well be what cn was parsed from */
+	if (newpath && check_len(snprintf(newpath, size, "%s", path), size))
+		return -ENAMETOOLONG;
+
+	if (state == CORE_TO_PROCESS || state == CORE_PROCESSED) {
+		char *slash = strchr(name, '/');
+
+		if (slash) {
+			slash[1] = '\0';
+			shard_active(name);
+		}
+	}
+
+	return 0;
+}
@@ -33,7 +33,6 @@
 #include <sys/prctl.h>
 #include <asm/unistd.h>
 #include <curl/curl.h>
-#include <dirent.h>
 #include <sys/stat.h>
 #include <errno.h>
 
@@ -56,28 +55,35 @@ static struct option opts[] = {
 	{ "nodaemon", 0, NULL, 'n' },
 	{ "always",   0, NULL, 'a' },
 	{ "test",     0, NULL, 't' },
+	{ "migrate",  0, NULL, 'm' },
 	{ "help",     0, NULL, 'h' },
 	{ 0, 0, NULL, 0 }
 };
 
 int testmode = 0;
 
+/* long poll for crashes the inotify watch missed, and for retries */
+#define SCAN_INTERVAL_MS (900 * 1000)
+
+static void scan_timer_fired(int fd, guint32 __unused events, void __unused *data)
+{
+	event_drain(fd);
+	scan_folders(NULL);
+}
+
 static void usage(const char *name)
 {
 	fprintf(stderr, "Usage: %s [OPTIONS...]\n", name);
 	fprintf(stderr, "  -n, --nodaemon  Do not daemonize, run in foreground\n");
 	fprintf(stderr, "  -t, --test      Do not send anything\n");
+	fprintf(stderr, "  -m, --migrate   Move processed files to processed-layout and exit\n");
 	fprintf(stderr, "  -h, --help      Display this help message\n");
 }
 
 int main(int argc, char**argv)
 {
-	GMainLoop *loop;
 	int godaemon = 1;
-	DIR *dir = NULL;
-	GThread *inotify_thread = NULL;
-	GThread *submit_thread = NULL;
-	GThread *processing_thread = NULL;
+	int scan_timer;
 
 /*
  * Signal the kernel that we're not timing critical
@@ -94,32 +100,19 @@ int main(int argc, char**argv)
 
 	read_config_file("/etc/corewatcher/corewatcher.conf");
 
-	/* insure our directories exist */
-	dir = opendir(core_folder);
-	if (!dir) {
-		mkdir(core_folder, S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX);
-		dir = opendir(core_folder);
-		if (!dir)
-			return 1;
-	}
-	chmod(core_folder, S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX);
-	closedir(dir);
-	dir = opendir(processed_folder);
-	if (!dir) {
-		mkdir(processed_folder, S_IRWXU);
-		chmod(processed_folder, S_IRWXU);
-		dir = opendir(processed_folder);
-		if (!dir)
-			return 1;
-	}
-	chmod(processed_folder, S_IRWXU);
-	closedir(dir);
+	/* insure our directories exist, then hold them open */
+	mkdir(core_folder, S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX);
+	mkdir(processed_folder, S_IRWXU);
+	if (open_folders())
+		return 1;
+	fchmod(core_dirfd, S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX);
+	fchmod(processed_dirfd, S_IRWXU);
 
 	while (1) {
 		int c;
 		int i;
 
-		c = getopt_long(argc, argv, "adnth", opts, &i);
+		c = getopt_long(argc, argv, "adnthm", opts, &i);
 		if (c == -1)
 			break;
 
@@ -132,6 +125,8 @@ int main(int argc, char**argv)
 			testmode = 1;
 			fprintf(stderr, "+ Test mode enabled: not sending anything\n");
 			break;
+		case 'm':
+			return migrate_processed() ? EXIT_FAILURE : EXIT_SUCCESS;
 		case 'h':
 			usage(argv[0]);
 			return EXIT_SUCCESS;
@@ -155,64 +150,50 @@ int main(int argc, char**argv)
 	}
 	sched_yield();
 
-	loop = g_main_loop_new(NULL, FALSE);
-	bt_mtx = g_new(GMutex, 1);
-	bt_work = g_new(GCond, 1);
-	bt_hash = g_hash_table_new(g_str_hash, g_str_equal);
-	pq_mtx = g_new(GMutex, 1);
-	pq_work = g_new(GCond, 1);
-
-	if (loop == NULL ||
-	    bt_mtx == NULL ||
-	    bt_work == NULL ||
-	    bt_hash == NULL ||
-	    pq_mtx == NULL ||
-	    pq_work == NULL) {
-		fprintf(stderr, "+ Unable to allocate required GLib pieces...exiting\n");
+	if (event_loop_init() || init_submit_queue()) {
+		fprintf(stderr, "+ Unable to set up the event loop...exiting\n");
 		return EXIT_FAILURE;
 	}
 
-	g_mutex_init(bt_mtx);
-	g_cond_init(bt_work);
-	submit_thread = g_thread_new("corewatchersubm", submit_loop, NULL);
-	if (submit_thread == NULL) {
-		fprintf(stderr, "+ Unable to start submit thread...exiting\n");
-		return EXIT_FAILURE;
-	}
+	load_suppressions();
+	load_shards();
 
-	g_mutex_init(pq_mtx);
-	g_cond_init(pq_work);
-	processing_thread = g_thread_new("corewatcherproc", scan_processed_folder, NULL);
-	if (processing_thread == NULL) {
-		fprintf(stderr, "+ Unable to start processing thread...exiting\n");
+	if (start_pipeline()) {
+		fprintf(stderr, "+ Unable to start processing pipeline...exiting\n");
 		return EXIT_FAILURE;
 	}
 
-	scan_folders(NULL);
-
 	if (testmode) {
+		scan_folders(NULL);
 		fprintf(stderr, "+ Exiting from testmode\n");
 		return EXIT_SUCCESS;
 	}
 
-	sd_journal_print(LOG_INFO, "Nitra corewatcher %s", VERSION);
+	/* hear of crashes before their cores are written */
+	if (start_procwatch())
+		fprintf(stderr, "+ Unable to watch for processes dumping core\n");
+
+	/* watch for new cores before looking at what's already there */
+	if (start_inotify())
+		fprintf(stderr, "+ Unable to start inotify\n");
 
-	inotify_thread = g_thread_new("corewatcherinot", inotify_loop, NULL);
-	if (inotify_thread == NULL)
-		fprintf(stderr, "+ Unable to start inotify thread\n");
+	/* resubmit as soon as the network comes back */
+	if (start_netwatch())
+		fprintf(stderr, "+ Unable to watch the network\n");
+
+	if (start_recovery()) {
+		fprintf(stderr, "+ Unable to start recovery, scanning now\n");
+		scan_folders(NULL);
+	}
+
+	sd_journal_print(LOG_INFO, "Nitra corewatcher %s", VERSION);
 
 	enable_corefiles(-1);
 
 	/*
-	 * TODO: add a thread / event source tied to a connmand plugin
-	 *  o  network up: trigger scan_folders(), enables event sources
-	 *  o  network down: disable sources (or allow them to run and create
-	 *     a low quality crash reports?)
-	 *  o  low bandwidth net up: allow transmitting of .txt crash
-	 *     summaries (ie: no running gdb)
-	 *  o  high bandwidth net up: look at existing cores vs .txt's for
-	 *     quality and if debuginfo is retrievable, try to improve
-	 *     the report quality and submit again
+	 * TODO: once on a fast network, look at existing cores vs .txt's
+	 * for quality and if debuginfo is retrievable, try to improve the
+	 * report quality and submit again
 	 */
 
 	/*
@@ -221,9 +202,11 @@ int main(int argc, char**argv)
 	 * If the system seems to generally work well, this time could be
 	 * extended quite a bit longer probably.
 	 */
-	g_timeout_add_seconds(900, scan_folders, NULL);
+	scan_timer = timer_new(scan_timer_fired, NULL);
+	if (scan_timer >= 0)
+		timer_arm(scan_timer, SCAN_INTERVAL_MS, SCAN_INTERVAL_MS);
 
-	g_main_loop_run(loop);
+	event_loop_run();
 
 	return EXIT_SUCCESS;
 }
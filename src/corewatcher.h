@@ -30,7 +30,22 @@
 /* borrowed from the kernel */
 #define __unused  __attribute__ ((__unused__))
 
-#define MAX_URLS 2
+#define MAX_URLS 11
+
+/* "$APPHASH-$STACKHASH", see fingerprint.c */
+#define APP_FINGERPRINT_LEN 16
+#define FINGERPRINT_LEN 33
+
+/* processed_folder layouts, see shard.c */
+enum {
+	LAYOUT_FLAT,
+	LAYOUT_DATE,		/* YYYYMMDD/ */
+	LAYOUT_HASH		/* 00/ to ff/ */
+};
+#define SHARD_MAX 16
+
+/* /proc/pressure files, see pressure.c */
+enum { PSI_CPU, PSI_IO, PSI_MEMORY, PSI_KINDS };
 
 #define FREE_OOPS(oops)					\
 	do {						\
@@ -45,47 +60,279 @@
 
 struct oops {
 	struct oops *next;
+	guint64 id;
 	char *application;
-	char *text;
+	char *text;		/* only while the report is being made */
 	char *filename;
 	char *detail_filename;
+	off_t size;		/* of the report in detail_filename */
+	int summary;		/* made from the core's notes, gdb is yet to run */
+	int gdb_failed;		/* made from the core's notes, gdb got nothing out of it */
+	int *fanout;		/* submit-to=all: copies still queued, shared */
+	char fingerprint[FINGERPRINT_LEN + 1];
 };
 
+/* the state a core is in, kept as an extension of its file name */
+enum core_state {
+	CORE_NEW,		/* in core_folder, no extension */
+	CORE_TO_PROCESS,
+	CORE_PROCESSED,
+	CORE_SUBMITTED,
+	CORE_SKIPPED,
+	CORE_STATES
+};
+
+/* core_$APP_$TIMESTAMP.$PID$STATE taken apart, see corename.c */
+struct core_name {
+	const char *path;	/* as parsed */
+	const char *base;	/* the file name, without directories */
+	size_t key_len;		/* of base without the state extension */
+	const char *app;
+	size_t app_len;
+	const char *stamp;	/* $TIMESTAMP as text */
+	size_t stamp_len;
+	long long timestamp;
+	int pid;		/* 0 if the name has none */
+	enum core_state state;
+};
+
+/* a core file travelling through the processing pipeline, see pipeline.c */
+struct job {
+	char *key;		/* core name without directories or state */
+	char *fullpath;		/* the core, as currently named on disk */
+	struct core_name name;	/* of fullpath */
+	char *appfile;		/* executable gdb is pointed at */
+	char *reportname;	/* $APP_$TIMESTAMP.txt */
+	gint64 queued;		/* monotonic time it was queued on its stage */
+	pid_t gdb_pid;		/* gdb, while it runs */
+	int gdb_timer;		/* timerfd: gdb's wall clock limit */
+	char *output;		/* what gdb printed so far */
+	size_t output_len;
+	size_t output_alloc;
+	int analyzed;		/* report was just generated and needs writing */
+	struct oops *oops;	/* the report, once there is one */
+};
+
+struct stage {
+	const char *name;
+	GMutex mtx;
+	GCond not_empty;
+	GCond not_full;
+	GQueue queue;
+	guint capacity;
+	guint workers;		/* threads, 0 when run from the event loop */
+	guint limit;		/* max jobs in progress, 0 for no limit */
+	guint running;		/* jobs in progress, when limited */
+	int wake;		/* eventfd waking the event loop */
+	void (*work)(struct job *job);
+	/* if set, and returns 1, the next job has to wait */
+	int (*gate)(struct stage *s, struct job *job);
+};
+
+/* see lockfree.c */
+struct id_set {
+	guint64 *slots;
+	guint mask;
+	gint live;
+	gint inserters;
+	gint rebuilding;
+	guint tombstones;
+};
+
+/* one section ("backtrace" or "maps") of a gdb derived report summary */
+struct gdb_section {
+	char *text;
+	size_t len;
+	size_t alloc;
+	int lines;
+};
+
+struct gdb_summary {
+	struct gdb_section backtrace;
+	struct gdb_section maps;
+};
+
+typedef void (*event_fn)(int fd, guint32 events, void *data);
+
+/* eventloop.c */
+extern int event_loop_init(void);
+extern int event_add(int fd, guint32 events, event_fn fn, void *data);
+extern void event_del(int fd);
+extern int timer_new(event_fn fn, void *data);
+extern void timer_arm(int fd, long ms, long interval_ms);
+extern void event_drain(int fd);
+extern void event_loop_run(void);
+
 /* inotification.c */
-extern void *inotify_loop(void __unused *unused);
+extern int start_inotify(void);
+
+/* netwatch.c */
+extern char **metered_interfaces;
+extern int start_netwatch(void);
+extern int network_online(void);
+extern int network_metered(void);
+
+/* recovery.c */
+extern int start_recovery(void);
 
 /* submit.c */
-extern GMutex *bt_mtx;
-extern GCond *bt_work;
-extern GHashTable *bt_hash;
+extern int init_submit_queue(void);
+extern void kick_submitter(void);
 extern void queue_backtrace(struct oops *oops);
-extern char *replace_name(char *filename, char *replace, char *new);
-extern void *submit_loop(void __unused *unused);
+extern int backtrace_queued(const char *filename);
 
 /* coredump.c */
-extern GMutex *pq_mtx;
-extern GCond *pq_work;
 extern int scan_folders(void __unused *unused);
 extern int scan_core_folder(void __unused *unused);
-extern void *scan_processed_folder(void __unused *unused);
+extern int scan_processed_folder(void __unused *unused);
+extern int move_core(const char *name, char *newpath, size_t size);
+extern int ingest_core(const char *fullpath);
+extern void triage_core(struct job *job);
+extern void analyze_core(struct job *job);
+extern void parse_core(struct job *job);
+extern void persist_core(struct job *job);
 extern const char *core_folder;
 extern const char *processed_folder;
 extern void enable_corefiles(int diskfree);
-extern char *strip_directories(char *fullpath);
+extern char *read_report(struct oops *oops);
+extern int summary_report(const char *text, size_t len);
+extern int summary_report_at(const char *path);
+extern int start_gdb(char *const args[], int in, pid_t *pid);
 
 /* configfile.c */
 extern void read_config_file(char *filename);
 extern int allow_distro_to_pass_on;
 extern char *submit_url[MAX_URLS];
 extern int url_count;
+extern int fingerprint_submit;
+extern long long submit_rate;
+extern int submit_concurrency;
+extern int submit_fanout;
+extern int analyze_workers;
+extern int queue_depth;
+extern int keep_minidumps;
+extern int summary_reports;
+extern int gdb_timeout;
+extern long long gdb_memory_limit;
+extern int gdb_cpu_limit;
+extern int gdb_session_cores;
+extern long long parse_size(const char *s);
 
 /* corewatcher.c */
 extern int testmode;
 extern int pinged;
 extern struct core_status core_status;
 
+/* pipeline.c */
+extern struct stage triage_stage;
+extern struct stage analyze_stage;
+extern struct stage parse_stage;
+extern struct stage persist_stage;
+extern int start_pipeline(void);
+extern struct job *claim_core(const char *fullpath);
+extern void finish_job(struct job *job);
+extern int stage_push(struct stage *s, struct job *job, gboolean wait);
+extern void stage_done(struct stage *s);
+extern gboolean stage_has_app(struct stage *s, const char *appfile);
+extern guint64 report_id(const char *fullpath);
+
+/* lockfree.c */
+extern void oops_push(struct oops **head, struct oops *oops);
+extern struct oops *oops_take_all(struct oops **head);
+extern int id_set_init(struct id_set *set, guint entries);
+extern int id_set_insert(struct id_set *set, guint64 id);
+extern int id_set_contains(struct id_set *set, guint64 id);
+extern void id_set_remove(struct id_set *set, guint64 id);
+extern void id_set_compact(struct id_set *set);
+
+/* corename.c */
+extern int parse_core_name(const char *path, struct core_name *cn);
+extern const char *core_state_ext(enum core_state state);
+extern int core_path(char *buf, size_t size, const struct core_name *cn, enum core_state state);
+extern int core_app(char *buf, size_t size, const struct core_name *cn);
+extern int core_report_path(char *buf, size_t size, const struct core_name *cn);
+extern int core_dirfd;
+extern int processed_dirfd;
+extern int open_folders(void);
+extern int folder_at(const char *path, const char **name);
+extern int core_rename(const struct core_name *cn, enum core_state state, char *newpath, size_t size);
+extern int rename_noreplace(int olddir, const char *old, int newdir, const char *new);
+
+/* elfcore.c */
+extern int shrink_core(const char *path);
+extern int core_signal(int dirfd, const char *name);
+extern char *core_summary(int dirfd, const char *name);
+
+/* gdbmi.c */
+extern int session_analyze(struct job *job);
+extern void session_prewarm(const char *appfile);
+
+/* symcache.c */
+extern char *symbol_cache;
+extern int cache_subdir(char *buf, size_t size, const char *sub);
+extern int note_build_id(const char *notes, size_t len, size_t align, char *hex, size_t size);
+extern int symbolize(const char *path, const char *build_id, guint64 offset, char *name, size_t size);
+extern int prewarm_symbols(const char *path, const char *name);
+
+/* procwatch.c */
+extern int crash_prefetch;
+extern int start_procwatch(void);
+extern char *crash_exe(const struct core_name *cn);
+extern char *crash_details(const struct core_name *cn);
+
+/* rules.c */
+extern long long max_core_size;
+extern void init_rules(void);
+extern int add_rule(const char *key, const char *value);
+extern int app_allowed(const char *app);
+extern int path_allowed(const char *path);
+extern const char *unwanted_core(const struct core_name *cn);
+
+/* placement.c */
+extern char *analyze_cpus;
+extern int analyze_node;
+extern char *analyze_cgroup;
+extern char *analyze_cpu_max;
+extern long long analyze_memory_max;
+extern int start_placement(void);
+extern void place_thread(void);
+extern void spawn_placement(int spawning);
+extern int spawn_into_cgroup(pid_t *pid, char *const argv[], char *const env[], int in, int out);
+extern void place_process(pid_t pid);
+
+/* pressure.c */
+extern double psi_limit[PSI_KINDS];
+extern double max_load;
+extern int max_defer;
+extern int analysis_deferred(struct stage *s, struct job *job);
+extern int start_pressure(void);
+
+/* shard.c */
+extern int processed_layout;
+extern int core_shard(char *buf, size_t size, const struct core_name *cn);
+extern int make_shard(const char *name);
+extern void shard_active(const char *shard);
+extern void shard_idle(const char *shard);
+extern char **active_shards(void);
+extern void load_shards(void);
+extern int migrate_processed(void);
+
+/* gdbparse.c */
+extern int parse_gdb_output(char *buf, size_t len, struct gdb_summary *summary);
+extern void free_gdb_summary(struct gdb_summary *summary);
+extern char *mi_unquote(const char **p);
+extern void mi_quote(GString *cmd, const char *s);
+
+/* fingerprint.c */
+extern void app_fingerprint(const char *app, char *fp);
+extern void report_fingerprint(const char *app, const char *text, char *fp);
+extern void file_fingerprint(int fd, const char *app, char *fp);
+extern void load_suppressions(void);
+extern void suppress_fingerprint(const char *fp, int hours);
+extern int fingerprint_suppressed(const char *fp);
+
 /* find_file.c */
 extern char *find_apppath(char *fragment);
-extern char *find_causingapp(char *fullpath);
+extern int system_path(const char *path);
 
 #endif
@@ -0,0 +1,776 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <link.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/procfs.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * Minidumps: once a core has its report, what is worth keeping for a
+ * later look with gdb is a small part of it.  shrink_core() rewrites a
+ * core in place as an ELF core file with all its notes (registers of
+ * every thread, signal info, auxv and the NT_FILE map of mapped files)
+ * but only these parts of memory:
+ *  - every thread's stack, from just below its stack pointer up
+ *  - a window around every thread's pc and around the faulting address
+ *  - the first page of every mapped file, which holds its ELF headers
+ *    and build-id so gdb can find the matching binaries and debuginfo
+ * gdb loads the result like any core, reading the rest of memory from
+ * the binaries where it can.
+ *
+ * Only cores of our own ELF class and machine are handled.
+ */
+#if defined(__x86_64__)
+#include <sys/reg.h>
+#define ELF_MACHINE EM_X86_64
+#define SP_REG RSP
+#define PC_REG RIP
+#elif defined(__i386__)
+#include <sys/reg.h>
+#define ELF_MACHINE EM_386
+#define SP_REG UESP
+#define PC_REG EIP
+#elif defined(__aarch64__)
+#define ELF_MACHINE EM_AARCH64
+#define SP_REG 31
+#define PC_REG 32
+#else
+#define ELF_MACHINE EM_NONE	/* no minidumps here */
+#define SP_REG 0
+#define PC_REG 0
+#endif
+
+#if __ELF_NATIVE_CLASS == 64
+#define ELF_CLASS ELFCLASS64
+#else
+#define ELF_CLASS ELFCLASS32
+#endif
+
+#define STACK_BELOW	512		/* red zone and then some */
+#define STACK_ABOVE	(256 * 1024)
+#define PC_WINDOW	2048
+#define FAULT_WINDOW	4096
+#define FILE_HEAD	4096
+#define NOTES_MAX	(16 * 1024 * 1024)
+
+struct window {
+	ElfW(Addr) start, end;
+};
+
+struct minidump {
+	const char *core;
+	size_t size;
+	const ElfW(Ehdr) *ehdr;
+	const ElfW(Phdr) *phdr;
+	struct window *win;
+	int nwin, alloc;
+	int lost;		/* a window couldn't be kept, no minidump then */
+};
+
+/* one window per thread's stack and pc and per mapped file, so grown as needed */
+static void add_window(struct minidump *md, ElfW(Addr) start, ElfW(Addr) end)
+{
+	struct window *n;
+
+	if (end <= start)
+		return;
+	if (md->nwin == md->alloc) {
+		if (md->alloc > INT_MAX / 2 / (int)sizeof(struct window)) {
+			md->lost = 1;
+			return;
+		}
+		n = realloc(md->win, (md->alloc ? md->alloc * 2 : 256) * sizeof(struct window));
+		if (!n) {
+			md->lost = 1;
+			return;
+		}
+		md->win = n;
+		md->alloc = md->alloc ? md->alloc * 2 : 256;
+	}
+	md->win[md->nwin].start = start;
+	md->win[md->nwin].end = end;
+	md->nwin++;
+}
+
+static void add_around(struct minidump *md, ElfW(Addr) addr, ElfW(Addr) below, ElfW(Addr) above)
+{
+	add_window(md, addr > below ? addr - below : 0,
+		   addr + above > addr ? addr + above : (ElfW(Addr))-1);
+}
+
+/*
+ * NT_FILE: count, page size, count * (start, end, page offset), names.
+ * Returns count, or 0 if it doesn't fit in len.
+ */
+static ElfW(Addr) file_count(const char *desc, size_t len)
+{
+	const ElfW(Addr) *v = (const ElfW(Addr) *)desc;
+
+	if (len < 2 * sizeof(ElfW(Addr)) || v[0] > (len / sizeof(ElfW(Addr)) - 2) / 3)
+		return 0;
+
+	return v[0];
+}
+
+static void file_heads(struct minidump *md, const char *desc, size_t len)
+{
+	const ElfW(Addr) *v = (const ElfW(Addr) *)desc;
+	ElfW(Addr) count = file_count(desc, len), i;
+
+	for (i = 0; i < count; i++) {
+		const ElfW(Addr) *f = v + 2 + i * 3;
+
+		/* a mapping of the start of a file */
+		if (f[2] == 0)
+			add_window(md, f[0], f[0] + MIN(FILE_HEAD, f[1] - f[0]));
+	}
+}
+
+/* pick the windows to keep out of the core's notes */
+static void read_notes(struct minidump *md, const ElfW(Phdr) *ph)
+{
+	const char *p = md->core + ph->p_offset;
+	const char *end = p + ph->p_filesz;
+
+	while (p + sizeof(ElfW(Nhdr)) <= end) {
+		const ElfW(Nhdr) *nh = (const ElfW(Nhdr) *)p;
+		const char *name = p + sizeof(ElfW(Nhdr));
+		const char *desc = name + ((nh->n_namesz + 3) & ~3);
+
+		p = desc + ((nh->n_descsz + 3) & ~3);
+		if (p > end || p < desc)
+			break;
+		if (nh->n_namesz != 5 || memcmp(name, "CORE", 5))
+			continue;
+
+		if (nh->n_type == NT_PRSTATUS && nh->n_descsz >= sizeof(struct elf_prstatus)) {
+			struct elf_prstatus prs;
+
+			memcpy(&prs, desc, sizeof(prs));
+			add_around(md, prs.pr_reg[SP_REG], STACK_BELOW, STACK_ABOVE);
+			add_around(md, prs.pr_reg[PC_REG], PC_WINDOW, PC_WINDOW);
+		} else if (nh->n_type == NT_SIGINFO && nh->n_descsz >= sizeof(siginfo_t)) {
+			siginfo_t si;
+
+			memcpy(&si, desc, sizeof(si));
+			if (si.si_signo == SIGSEGV || si.si_signo == SIGBUS ||
+			    si.si_signo == SIGILL || si.si_signo == SIGFPE)
+				add_around(md, (ElfW(Addr))si.si_addr, FAULT_WINDOW, FAULT_WINDOW);
+		} else if (nh->n_type == NT_FILE) {
+			file_heads(md, desc, nh->n_descsz);
+		}
+	}
+}
+
+static int window_cmp(const void *a, const void *b)
+{
+	const struct window *wa = a, *wb = b;
+
+	return wa->start < wb->start ? -1 : wa->start > wb->start;
+}
+
+/* sort and merge the windows so none overlap */
+static void merge_windows(struct minidump *md)
+{
+	int i, n = 0;
+
+	if (!md->nwin)
+		return;
+	qsort(md->win, md->nwin, sizeof(struct window), window_cmp);
+	for (i = 1; i < md->nwin; i++) {
+		if (md->win[i].start <= md->win[n].end)
+			md->win[n].end = MAX(md->win[n].end, md->win[i].end);
+		else
+			md->win[++n] = md->win[i];
+	}
+	md->nwin = n + 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * The program headers of the minidump: the notes, then for every
+ * window the part of it the core has contents for.  Where in the core
+ * each one's contents are goes to from[].  Returns how many there are,
+ * only counting them if out is NULL.
+ */
+static int minidump_phdrs(struct minidump *md, ElfW(Phdr) *out, ElfW(Off) *from)
+{
+	int i, w, n = 0;
+
+	for (i = 0; i < md->ehdr->e_phnum; i++) {
+		if (md->phdr[i].p_type != PT_NOTE)
+			continue;
+		if (out) {
+			from[n] = md->phdr[i].p_offset;
+			out[n] = md->phdr[i];
+			out[n].p_align = 4;
+		}
+		n++;
+	}
+
+	for (w = 0; w < md->nwin; w++) {
+		for (i = 0; i < md->ehdr->e_phnum; i++) {
+			const ElfW(Phdr) *ph = &md->phdr[i];
+			ElfW(Addr) start, end;
+
+			if (ph->p_type != PT_LOAD || !ph->p_filesz)
+				continue;
+			start = MAX(md->win[w].start, ph->p_vaddr);
+			end = MIN(md->win[w].end, ph->p_vaddr + ph->p_filesz);
+			if (start >= end)
+				continue;
+			if (out) {
+				from[n] = ph->p_offset + (start - ph->p_vaddr);
+				out[n] = *ph;
+				out[n].p_vaddr = start;
+				out[n].p_paddr = 0;
+				out[n].p_filesz = out[n].p_memsz = end - start;
+				out[n].p_align = 1;
+			}
+			n++;
+		}
+	}
+
+	return n;
+}
+
+static int write_minidump(struct minidump *md, int fd)
+{
+	static const char pad[8];
+	ElfW(Ehdr) ehdr = *md->ehdr;
+	ElfW(Phdr) *phdr;
+	ElfW(Off) *from, offset;
+	int i, n, ret = -1;
+
+	/* more than e_phnum holds would need PN_XNUM, keep the core whole then */
+	n = minidump_phdrs(md, NULL, NULL);
+	if (n >= PN_XNUM) {
+		errno = E2BIG;
+		return -1;
+	}
+	phdr = calloc(n ? n : 1, sizeof(ElfW(Phdr)));
+	from = calloc(n ? n : 1, sizeof(ElfW(Off)));
+	if (!phdr || !from)
+		goto out;
+	minidump_phdrs(md, phdr, from);
+
+	ehdr.e_phoff = sizeof(ElfW(Ehdr));
+	ehdr.e_phnum = n;
+	ehdr.e_shoff = 0;
+	ehdr.e_shnum = 0;
+	ehdr.e_shstrndx = SHN_UNDEF;
+
+	/* the contents follow the headers, 8 byte aligned, in header order */
+	offset = ehdr.e_phoff + n * sizeof(ElfW(Phdr));
+	for (i = 0; i < n; i++) {
+		offset = (offset + 7) & ~(ElfW(Off))7;
+		phdr[i].p_offset = offset;
+		offset += phdr[i].p_filesz;
+	}
+
+	if (write_all(fd, &ehdr, sizeof(ehdr)) ||
+	    write_all(fd, phdr, n * sizeof(ElfW(Phdr))))
+		goto out;
+	offset = ehdr.e_phoff + n * sizeof(ElfW(Phdr));
+	for (i = 0; i < n; i++) {
+		if (write_all(fd, pad, phdr[i].p_offset - offset) ||
+		    write_all(fd, md->core + from[i], phdr[i].p_filesz))
+			goto out;
+		offset = phdr[i].p_offset + phdr[i].p_filesz;
+	}
+	ret = 0;
+out:
+	free(from);
+	free(phdr);
+
+	return ret;
+}
+
+/* is this an ELF core of ours with everything its headers promise */
+static int check_core(struct minidump *md)
+{
+	const ElfW(Ehdr) *eh = md->ehdr;
+	int i;
+
+	if (md->size < sizeof(ElfW(Ehdr)) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+	    eh->e_ident[EI_CLASS] != ELF_CLASS || eh->e_type != ET_CORE ||
+	    eh->e_machine != ELF_MACHINE || eh->e_phentsize != sizeof(ElfW(Phdr)) ||
+	    eh->e_phoff > md->size || eh->e_phnum > (md->size - eh->e_phoff) / sizeof(ElfW(Phdr)) ||
+	    eh->e_phnum == PN_XNUM)
+		return -1;
+
+	md->phdr = (const ElfW(Phdr) *)(md->core + eh->e_phoff);
+	for (i = 0; i < eh->e_phnum; i++) {
+		const ElfW(Phdr) *ph = &md->phdr[i];
+
+		if ((ph->p_type == PT_NOTE || ph->p_type == PT_LOAD) &&
+		    (ph->p_offset > md->size || ph->p_filesz > md->size - ph->p_offset))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* open core name in dirfd, checking it is a core of our class */
+static int open_core(int dirfd, const char *name, ElfW(Ehdr) *ehdr)
+{
+	int fd;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (pread(fd, ehdr, sizeof(*ehdr), 0) != sizeof(*ehdr) ||
+	    memcmp(ehdr->e_ident, ELFMAG, SELFMAG) || ehdr->e_ident[EI_CLASS] != ELF_CLASS ||
+	    ehdr->e_type != ET_CORE || ehdr->e_phentsize != sizeof(ElfW(Phdr))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * The notes of the core open at fd, read from the start of the file
+ * without looking at the rest.  Returns them to free(), with their size
+ * in len, or NULL.
+ */
+static char *core_notes(int fd, const ElfW(Ehdr) *ehdr, size_t *len)
+{
+	ElfW(Phdr) phdr;
+	char *notes;
+	int i;
+
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (pread(fd, &phdr, sizeof(phdr), ehdr->e_phoff + i * sizeof(phdr)) != sizeof(phdr))
+			return NULL;
+		if (phdr.p_type == PT_NOTE)
+			break;
+	}
+	if (i == ehdr->e_phnum || phdr.p_filesz > NOTES_MAX)
+		return NULL;
+	notes = malloc(phdr.p_filesz);
+	if (notes && pread(fd, notes, phdr.p_filesz, phdr.p_offset) != (ssize_t)phdr.p_filesz) {
+		free(notes);
+		return NULL;
+	}
+	*len = phdr.p_filesz;
+
+	return notes;
+}
+
+/* len bytes of the crashed process' memory at addr, as far as the core has them; 0 or -1 */
+static int core_read(int fd, const ElfW(Ehdr) *ehdr, ElfW(Addr) addr, void *buf, size_t len)
+{
+	ElfW(Phdr) phdr;
+	int i;
+
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (pread(fd, &phdr, sizeof(phdr), ehdr->e_phoff + i * sizeof(phdr)) != sizeof(phdr))
+			return -1;
+		if (phdr.p_type != PT_LOAD || addr < phdr.p_vaddr ||
+		    addr - phdr.p_vaddr > phdr.p_filesz ||
+		    len > phdr.p_filesz - (addr - phdr.p_vaddr))
+			continue;
+
+		return pread(fd, buf, len, phdr.p_offset + addr - phdr.p_vaddr) == (ssize_t)len ? 0 : -1;
+	}
+
+	return -1;
+}
+
+/*
+ * Find the next "CORE" note of type type from *pos on, at least size
+ * bytes big.  Returns its contents and moves *pos past it, or NULL.
+ */
+static const char *next_note(const char **pos, const char *end, int type, size_t size,
+			     size_t *len)
+{
+	const char *p = *pos;
+
+	while (p + sizeof(ElfW(Nhdr)) <= end) {
+		const ElfW(Nhdr) *nh = (const ElfW(Nhdr) *)p;
+		const char *name = p + sizeof(ElfW(Nhdr));
+		const char *desc = name + ((nh->n_namesz + 3) & ~3);
+
+		p = desc + ((nh->n_descsz + 3) & ~3);
+		if (p > end || p < desc)
+			break;
+		if (nh->n_namesz == 5 && !memcmp(name, "CORE", 5) &&
+		    (int)nh->n_type == type && nh->n_descsz >= size) {
+			*pos = p;
+			if (len)
+				*len = nh->n_descsz;
+			return desc;
+		}
+	}
+	*pos = end;
+
+	return NULL;
+}
+
+/*
+ * The signal that killed the process of core name in dirfd, read from
+ * its notes.  Returns 0 if that can't be told.
+ */
+int core_signal(int dirfd, const char *name)
+{
+	struct elf_prstatus prs;
+	ElfW(Ehdr) ehdr;
+	const char *p, *desc;
+	char *notes;
+	size_t len;
+	int fd, sig = 0;
+
+	fd = open_core(dirfd, name, &ehdr);
+	if (fd < 0)
+		return 0;
+	notes = core_notes(fd, &ehdr, &len);
+	close(fd);
+	if (!notes)
+		return 0;
+
+	/* NT_PRSTATUS comes first, and says all we need */
+	p = notes;
+	desc = next_note(&p, notes + len, NT_PRSTATUS, sizeof(prs), NULL);
+	if (desc) {
+		memcpy(&prs, desc, sizeof(prs));
+		sig = prs.pr_cursig;
+	}
+	free(notes);
+
+	return sig;
+}
+
+#if defined(__x86_64__)
+static const char *reg_names[] = {
+	"r15", "r14", "r13", "r12", "rbp", "rbx", "r11", "r10", "r9", "r8",
+	"rax", "rcx", "rdx", "rsi", "rdi", "orig_rax", "rip", "cs", "eflags",
+	"rsp", "ss", "fs_base", "gs_base", "ds", "es", "fs", "gs"
+};
+#elif defined(__i386__)
+static const char *reg_names[] = {
+	"ebx", "ecx", "edx", "esi", "edi", "ebp", "eax", "ds", "es", "fs", "gs",
+	"orig_eax", "eip", "cs", "eflags", "esp", "ss"
+};
+#elif defined(__aarch64__)
+static const char *reg_names[] = {
+	"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10",
+	"x11", "x12", "x13", "x14", "x15", "x16", "x17", "x18", "x19", "x20",
+	"x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28", "x29", "x30",
+	"sp", "pc", "pstate"
+};
+#else
+static const char *reg_names[] = { NULL };
+#endif
+
+/* the NT_FILE mapping addr is in, as a file name and offset in it */
+static const char *mapped_at(const char *desc, size_t len, ElfW(Addr) addr, ElfW(Addr) *offset)
+{
+	const ElfW(Addr) *v = (const ElfW(Addr) *)desc;
+	const char *name, *end = desc + len;
+	ElfW(Addr) count, i;
+
+	if (!desc)
+		return NULL;
+	count = v[0];
+	name = (const char *)(v + 2 + count * 3);
+	for (i = 0; i < count && name < end; i++) {
+		const ElfW(Addr) *f = v + 2 + i * 3;
+
+		if (!memchr(name, '\0', end - name))
+			return NULL;
+		if (addr >= f[0] && addr < f[1]) {
+			*offset = addr - f[0] + f[2] * v[1];
+			return name;
+		}
+		name += strlen(name) + 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * The build-id of file as it was mapped by the crashed process, read
+ * from the ELF headers the core has of its first page (see
+ * coredump_filter in core(5)) rather than from whatever is at its path
+ * now.  Into hex; returns 0.
+ */
+static int mapped_build_id(int fd, const ElfW(Ehdr) *core, const char *desc, size_t len,
+			   const char *file, char *hex, size_t size)
+{
+	const ElfW(Addr) *v = (const ElfW(Addr) *)desc;
+	const char *name, *end = desc + len;
+	ElfW(Addr) count = v[0], i, start = 0, bias = 0;
+	ElfW(Ehdr) ehdr;
+	ElfW(Phdr) phdr;
+	char notes[512];
+	int have_bias = 0, j;
+
+	/* the mapping of the file's start */
+	name = (const char *)(v + 2 + count * 3);
+	for (i = 0; i < count && name < end && memchr(name, '\0', end - name); i++) {
+		if (!v[2 + i * 3 + 2] && !strcmp(name, file)) {
+			start = v[2 + i * 3];
+			break;
+		}
+		name += strlen(name) + 1;
+	}
+	if (!start || core_read(fd, core, start, &ehdr, sizeof(ehdr)) ||
+	    memcmp(ehdr.e_ident, ELFMAG, SELFMAG) || ehdr.e_ident[EI_CLASS] != ELF_CLASS ||
+	    ehdr.e_phentsize != sizeof(ElfW(Phdr)))
+		return -1;
+
+	for (j = 0; j < ehdr.e_phnum; j++) {
+		if (core_read(fd, core, start + ehdr.e_phoff + j * sizeof(phdr), &phdr, sizeof(phdr)))
+			return -1;
+		if (phdr.p_type == PT_LOAD) {
+			/* the first PT_LOAD is what got mapped at start */
+			bias = start - (phdr.p_vaddr - phdr.p_offset);
+			have_bias = 1;
+			break;
+		}
+	}
+	for (j = 0; have_bias && j < ehdr.e_phnum; j++) {
+		if (core_read(fd, core, start + ehdr.e_phoff + j * sizeof(phdr), &phdr, sizeof(phdr)))
+			return -1;
+		if (phdr.p_type != PT_NOTE)
+			continue;
+		len = MIN(phdr.p_filesz, sizeof(notes));
+		if (!core_read(fd, core, bias + phdr.p_vaddr, notes, len) &&
+		    !note_build_id(notes, len, phdr.p_align, hex, size))
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * A report summary straight from the notes of core name in dirfd, for
+ * when it has to go out before gdb gets to look at the core: the signal,
+ * the registers of the thread that crashed, the frame it crashed in (as
+ * an offset into a mapped file, and the function there if the symbol
+ * cache knows it, see symcache.c) and the mapped files.  Sections are in
+ * the yaml layout of gdbparse.c.  Returns the text to free(), or NULL.
+ */
+char *core_summary(int dirfd, const char *name)
+{
+	struct elf_prstatus prs;
+	ElfW(Ehdr) ehdr;
+	const char *p, *end, *desc, *files, *file;
+	char *notes, *text = NULL;
+	char build_id[128], func[256];
+	size_t len, text_len, files_len = 0;
+	ElfW(Addr) offset;
+	FILE *out;
+	unsigned int i;
+	int fd;
+
+	fd = open_core(dirfd, name, &ehdr);
+	if (fd < 0)
+		return NULL;
+	notes = core_notes(fd, &ehdr, &len);
+	if (!notes) {
+		close(fd);
+		return NULL;
+	}
+	end = notes + len;
+
+	/* the first NT_PRSTATUS is the thread that crashed */
+	p = notes;
+	desc = next_note(&p, end, NT_PRSTATUS, sizeof(prs), NULL);
+	if (!desc)
+		goto out;
+	memcpy(&prs, desc, sizeof(prs));
+	p = notes;
+	files = next_note(&p, end, NT_FILE, 2 * sizeof(ElfW(Addr)), &files_len);
+	if (files && !file_count(files, files_len))
+		files = NULL;
+
+	out = open_memstream(&text, &text_len);
+	if (!out)
+		goto out;
+
+	fprintf(out, "signal: %d\n", prs.pr_cursig);
+
+	if (reg_names[0]) {
+		fprintf(out, "registers: |\n");
+		for (i = 0; i < G_N_ELEMENTS(reg_names) && i < ELF_NGREG; i++)
+			fprintf(out, "        %-10s0x%016llx\n", reg_names[i],
+				(unsigned long long)prs.pr_reg[i]);
+	}
+
+	fprintf(out, "backtrace: |\n");
+	if (reg_names[0]) {
+		ElfW(Addr) pc = prs.pr_reg[PC_REG];
+
+		file = mapped_at(files, files_len, pc, &offset);
+		if (file && !mapped_build_id(fd, &ehdr, files, files_len, file,
+					     build_id, sizeof(build_id)) &&
+		    !symbolize(file, build_id, offset, func, sizeof(func)))
+			fprintf(out, "        #0  0x%016llx in %s () from %s+0x%llx\n",
+				(unsigned long long)pc, func, file, (unsigned long long)offset);
+		else if (file)
+			fprintf(out, "        #0  0x%016llx in ?? () from %s+0x%llx\n",
+				(unsigned long long)pc, file, (unsigned long long)offset);
+		else
+			fprintf(out, "        #0  0x%016llx in ?? ()\n", (unsigned long long)pc);
+	} else {
+		fprintf(out, "        Unknown\n");
+	}
+
+	fprintf(out, "maps: |\n");
+	if (files) {
+		const ElfW(Addr) *v = (const ElfW(Addr) *)files;
+		ElfW(Addr) count = v[0];
+
+		file = (const char *)(v + 2 + count * 3);
+		fprintf(out, "        From                To                  Offset      File\n");
+		for (i = 0; i < count && file < files + files_len &&
+			    memchr(file, '\0', files + files_len - file); i++) {
+			const ElfW(Addr) *f = v + 2 + i * 3;
+
+			fprintf(out, "        0x%016llx  0x%016llx  0x%08llx  %s\n",
+				(unsigned long long)f[0], (unsigned long long)f[1],
+				(unsigned long long)(f[2] * v[1]), file);
+			file += strlen(file) + 1;
+		}
+	} else {
+		fprintf(out, "        Unknown\n");
+	}
+
+	if (fclose(out)) {
+		free(text);
+		text = NULL;
+	}
+out:
+	free(notes);
+	close(fd);
+
+	return text;
+}
+
+/*
+ * Replace the core at path (with a report made already) by its
+ * minidump.  Returns 0, or -errno with the core left as it was.
+ */
+int shrink_core(const char *path)
+{
+	struct minidump *md;
+	struct stat stat_buf;
+	char tmp[PATH_MAX];
+	const char *name, *base;
+	int dirfd, fd, out = -1, i, ret = -ENOTSUP;
+	off_t mini;
+
+	dirfd = folder_at(path, &name);
+	base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	if (snprintf(tmp, sizeof(tmp), "%.*s.%s.mini", (int)(base - name), name, base) >=
+	    (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	md = calloc(1, sizeof(struct minidump));
+	if (!md)
+		return -ENOMEM;
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &stat_buf)) {
+		ret = -errno;
+		goto out;
+	}
+	md->size = stat_buf.st_size;
+	md->core = mmap(NULL, md->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (md->core == MAP_FAILED) {
+		ret = -errno;
+		md->core = NULL;
+		goto out;
+	}
+	md->ehdr = (const ElfW(Ehdr) *)md->core;
+	if (check_core(md))
+		goto out;
+
+	for (i = 0; i < md->ehdr->e_phnum; i++)
+		if (md->phdr[i].p_type == PT_NOTE)
+			read_notes(md, &md->phdr[i]);
+	/* a minidump missing some thread's stack couldn't be analyzed again */
+	if (md->lost) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	merge_windows(md);
+
+	out = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, stat_buf.st_mode & 0777);
+	if (out < 0 || write_minidump(md, out) || fsync(out) ||
+	    (mini = lseek(out, 0, SEEK_CUR)) < 0 ||
+	    renameat(dirfd, tmp, dirfd, name)) {
+		ret = -errno;
+		if (out >= 0)
+			unlinkat(dirfd, tmp, 0);
+		goto out;
+	}
+	fprintf(stderr, "+ Shrunk %s from %lld to %lld bytes\n", path,
+		(long long)md->size, (long long)mini);
+	ret = 0;
+out:
+	if (out >= 0)
+		close(out);
+	if (md->core)
+		munmap((void *)md->core, md->size);
+	if (fd >= 0)
+		close(fd);
+	free(md->win);
+	free(md);
+
+	return ret;
+}
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * The one event loop everything but gdb output parsing runs in: inotify,
+ * the periodic scan timer, the pipeline stages that only do a little
+ * filesystem work, the gdb child pipes, the submit queue eventfd and the
+ * curl sockets are all file descriptors in a single epoll set.
+ *
+ * Only the main thread touches the loop; other threads wake it by
+ * writing to an eventfd they were handed.
+ */
+#define MAX_EVENTS 16
+
+struct watch {
+	int fd;
+	int dead;
+	event_fn fn;
+	void *data;
+	struct watch *next;	/* on graveyard */
+};
+
+static int epfd = -1;
+/* fd -> struct watch */
+static GHashTable *watches = NULL;
+/*
+ * Watches removed while dispatching a batch of events; a later event of
+ * the same batch may still point at them, so free only after the batch.
+ */
+static struct watch *graveyard = NULL;
+
+int event_loop_init(void)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return -1;
+	watches = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	return 0;
+}
+
+/*
+ * Call fn whenever fd has any of events (EPOLLIN, EPOLLOUT), replacing
+ * whatever was watching fd before.
+ */
+int event_add(int fd, guint32 events, event_fn fn, void *data)
+{
+	struct epoll_event ev;
+	struct watch *w;
+	int op = EPOLL_CTL_MOD;
+
+	w = g_hash_table_lookup(watches, GINT_TO_POINTER(fd));
+	if (!w) {
+		w = calloc(1, sizeof(struct watch));
+		if (!w)
+			return -1;
+		w->fd = fd;
+		op = EPOLL_CTL_ADD;
+	}
+	w->fn = fn;
+	w->data = data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = w;
+	if (epoll_ctl(epfd, op, fd, &ev)) {
+		fprintf(stderr, "+ Unable to watch fd %d: %s\n", fd, strerror(errno));
+		if (op == EPOLL_CTL_ADD)
+			free(w);
+		return -1;
+	}
+	if (op == EPOLL_CTL_ADD)
+		g_hash_table_insert(watches, GINT_TO_POINTER(fd), w);
+
+	return 0;
+}
+
+/* stop watching fd; must be called before fd is closed */
+void event_del(int fd)
+{
+	struct watch *w;
+
+	w = g_hash_table_lookup(watches, GINT_TO_POINTER(fd));
+	if (!w)
+		return;
+	g_hash_table_remove(watches, GINT_TO_POINTER(fd));
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+
+	w->dead = 1;
+	w->next = graveyard;
+	graveyard = w;
+}
+
+/* a timerfd calling fn, disarmed until timer_arm() */
+int timer_new(event_fn fn, void *data)
+{
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (event_add(fd, EPOLLIN, fn, data)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Fire timer fd after ms milliseconds, then every interval_ms if that is
+ * non zero.  ms == 0 disarms the timer.
+ */
+void timer_arm(int fd, long ms, long interval_ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+	timerfd_settime(fd, 0, &its, NULL);
+}
+
+/* consume a timerfd or eventfd expiry count so it stops polling ready */
+void event_drain(int fd)
+{
+	guint64 count;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "+ Read of fd %d failed: %s\n", fd, strerror(errno));
+}
+
+void event_loop_run(void)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct watch *w;
+	int i, n;
+
+	while (1) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "+ epoll_wait failed: %s\n", strerror(errno));
+			return;
+		}
+
+		for (i = 0; i < n; i++) {
+			w = events[i].data.ptr;
+			if (!w->dead)
+				w->fn(w->fd, events[i].events, w->data);
+		}
+
+		while (graveyard) {
+			w = graveyard;
+			graveyard = w->next;
+			free(w);
+		}
+	}
+}
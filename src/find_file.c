@@ -65,38 +65,19 @@ out:
 }
 
 /*
- * Attempt to find application name from the core file name.
+ * Is path an executable in one of the directories find_apppath() looks
+ * in, for when the executable of a crash is known some other way.
  */
-char *find_causingapp(char *fullpath)
+int system_path(const char *path)
 {
-	char *fp = NULL, *c1 = NULL, *c2 = NULL;
-	char *app = NULL;
+	const char *dirs[] = { "/usr/bin/", "/usr/sbin/", "/bin/", "/sbin/" };
+	size_t i, len;
 
-	fp = strdup(fullpath);
-	if (!fp)
-		goto no_app_name;
-
-	/*
-	 * looking for application name from a string of the form:
-	 * "/path/to/core_appname_timestamp.pid.extension"
-	 */
-	c1 = strrchr(fp, '_');
-	if (!c1)
-		goto no_app_name;
-	*c1 = 0;
-	c1 = strrchr(fp, '/');
-	if (!c1)
-		goto no_app_name;
-	c2 = c1 + 1;
-	if (!c2)
-		goto no_app_name;
-	c1 = strchr(c2, '_');
-	if (!c1)
-		goto no_app_name;
-	*c1 = 0;
-	app = strdup(c1+1);
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+		len = strlen(dirs[i]);
+		if (!strncmp(path, dirs[i], len) && path[len] && !strchr(path + len, '/'))
+			return !access(path, X_OK);
+	}
 
-no_app_name:
-	free(fp);
-	return app;
+	return 0;
 }
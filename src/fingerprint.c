@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * A report fingerprint is "$APPHASH-$STACKHASH": a hash of the
+ * application's path, then a hash of the function names of the top of
+ * its backtrace.  Addresses, arguments and locals are left out so the
+ * same crash hashes the same across runs, ASLR and rebuilds.
+ *
+ * The server may suppress either a whole fingerprint, or only the
+ * $APPHASH part which then covers every crash of that application and
+ * can be checked before gdb is ever run.
+ */
+#define FINGERPRINT_FRAMES 16
+#define SUPPRESS_FILE ".suppressed"
+
+static GMutex suppress_mtx;
+static GHashTable *suppressed = NULL;
+
+static guint64 fnv1a(guint64 h, const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+void app_fingerprint(const char *app, char *fp)
+{
+	guint64 h = fnv1a(0xcbf29ce484222325ULL, app, strlen(app));
+
+	snprintf(fp, APP_FINGERPRINT_LEN + 1, "%016llx", (unsigned long long)h);
+}
+
+/* hash the function of backtrace line into h; returns 0 if it wasn't a frame */
+static int hash_frame(guint64 *h, const char *line)
+{
+	const char *c = line + strspn(line, " ");
+	const char *end = strchr(line, '\n');
+	size_t len;
+
+	if (*c != '#')
+		return 0;
+
+	/* "#N  [0xADDR in ]function (args...) ..." */
+	c += strcspn(c, " ");
+	c += strspn(c, " ");
+	if (!strncmp(c, "0x", 2)) {
+		const char *in = strstr(c, " in ");
+
+		if (in && (!end || in < end))
+			c = in + 4;
+	}
+	len = strcspn(c, " (\n");
+	*h = fnv1a(*h, c, len);
+	*h = fnv1a(*h, "\n", 1);
+
+	return 1;
+}
+
+static void stack_fingerprint(guint64 h, char *fp)
+{
+	snprintf(fp + APP_FINGERPRINT_LEN, FINGERPRINT_LEN - APP_FINGERPRINT_LEN + 1,
+		 "-%016llx", (unsigned long long)h);
+}
+
+void report_fingerprint(const char *app, const char *text, char *fp)
+{
+	guint64 h = 0xcbf29ce484222325ULL;
+	const char *line, *end;
+	int frames = 0;
+
+	app_fingerprint(app, fp);
+
+	line = text ? strstr(text, "backtrace: |\n") : NULL;
+	if (line)
+		line += 13;
+	while (line && *line && frames < FINGERPRINT_FRAMES && hash_frame(&h, line)) {
+		frames++;
+		end = strchr(line, '\n');
+		line = end ? end + 1 : NULL;
+	}
+
+	stack_fingerprint(h, fp);
+}
+
+/*
+ * report_fingerprint() of the report read from fd, reading no further
+ * than the frames it hashes.  Closes fd.
+ */
+void file_fingerprint(int fd, const char *app, char *fp)
+{
+	guint64 h = 0xcbf29ce484222325ULL;
+	char *line = NULL;
+	size_t size = 0;
+	int frames = 0, in_backtrace = 0;
+	FILE *file;
+
+	app_fingerprint(app, fp);
+
+	file = fdopen(fd, "r");
+	if (!file) {
+		close(fd);
+		stack_fingerprint(h, fp);
+		return;
+	}
+	while (frames < FINGERPRINT_FRAMES && getline(&line, &size, file) != -1) {
+		if (!in_backtrace) {
+			in_backtrace = !strcmp(line, "backtrace: |\n");
+			continue;
+		}
+		if (!hash_frame(&h, line))
+			break;
+		frames++;
+	}
+	free(line);
+	fclose(file);
+
+	stack_fingerprint(h, fp);
+}
+
+static void save_suppressions(void)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	FILE *file = NULL;
+	gint64 now = time(NULL);
+	int fd;
+
+	fd = openat(processed_dirfd, SUPPRESS_FILE ".tmp",
+		    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd >= 0 && !(file = fdopen(fd, "w")))
+		close(fd);
+	if (file) {
+		g_hash_table_iter_init(&iter, suppressed);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			if (*(gint64 *)value > now)
+				fprintf(file, "%s %lld\n", (char *)key, (long long)*(gint64 *)value);
+		}
+		if (fclose(file) == 0)
+			renameat(processed_dirfd, SUPPRESS_FILE ".tmp",
+				 processed_dirfd, SUPPRESS_FILE);
+	}
+}
+
+/*
+ * Load the server's suppression decisions persisted by an earlier run.
+ * Must be called before any processing or submit thread starts.
+ */
+void load_suppressions(void)
+{
+	char *line = NULL;
+	size_t size = 0;
+	FILE *file;
+	gint64 now = time(NULL);
+	int fd;
+
+	g_mutex_init(&suppress_mtx);
+	suppressed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	fd = openat(processed_dirfd, SUPPRESS_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	file = fdopen(fd, "r");
+	if (!file) {
+		close(fd);
+		return;
+	}
+
+	while (getline(&line, &size, file) != -1) {
+		char fp[FINGERPRINT_LEN + 1];
+		long long until;
+		gint64 *v;
+
+		if (sscanf(line, "%" G_STRINGIFY(FINGERPRINT_LEN) "s %lld", fp, &until) != 2)
+			continue;
+		if (until <= now)
+			continue;
+		v = g_new(gint64, 1);
+		*v = until;
+		g_hash_table_insert(suppressed, g_strdup(fp), v);
+	}
+	free(line);
+	fclose(file);
+}
+
+void suppress_fingerprint(const char *fp, int hours)
+{
+	gint64 *v;
+
+	if (hours <= 0)
+		return;
+
+	v = g_new(gint64, 1);
+	*v = time(NULL) + (gint64)hours * 3600;
+
+	g_mutex_lock(&suppress_mtx);
+	g_hash_table_insert(suppressed, g_strdup(fp), v);
+	save_suppressions();
+	g_mutex_unlock(&suppress_mtx);
+
+	fprintf(stderr, "+ server suppressed %s for %d hours\n", fp, hours);
+}
+
+/*
+ * Returns 1 if the server asked us to not send fp (either the full
+ * fingerprint or just its application part) and that hasn't expired yet.
+ */
+int fingerprint_suppressed(const char *fp)
+{
+	char app[APP_FINGERPRINT_LEN + 1];
+	gint64 *until;
+	int ret = 0;
+
+	if (!suppressed)
+		return 0;
+
+	snprintf(app, sizeof(app), "%s", fp);
+
+	g_mutex_lock(&suppress_mtx);
+	until = g_hash_table_lookup(suppressed, fp);
+	if (!until)
+		until = g_hash_table_lookup(suppressed, app);
+	if (until && *until > time(NULL))
+		ret = 1;
+	g_mutex_unlock(&suppress_mtx);
+
+	return ret;
+}
@@ -0,0 +1,747 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * gdb sessions: with gdb-session-cores set, the analyze stage keeps a
+ * long running "gdb --interpreter=mi2" per job it may have in progress
+ * instead of starting "gdb --batch" for every core.  A core is loaded
+ * into an idle session, preferably one that has its executable loaded
+ * already, so a burst of crashes of one binary pays for gdb starting up
+ * and reading the binary's symbols once, and shared libraries come from
+ * gdb's caches.  Per core the session runs:
+ *   -file-exec-and-symbols APP	only if the session has another executable
+ *   -target-select core CORE
+ *   -stack-list-frames, -stack-list-arguments 1, info shared
+ *   -stack-select-frame N and -stack-list-locals 1 for every frame
+ *   -target-detach
+ * all from the event loop.  The MI records are parsed into frames and
+ * written out the way "bt full" and "info shared" print them, so the
+ * rest of the pipeline can't tell the difference.  A session is
+ * restarted after gdb-session-cores cores to bound what gdb accumulates,
+ * and killed, along with the core it was at, on gdb-timeout or when
+ * gdb-cpu-limit seconds are used for one core.
+ */
+#define MAX_FRAMES	256
+
+/* what a command is, encoded in its token with the frame it is about */
+enum mi_cmd {
+	CMD_NONE,
+	CMD_EXEC,
+	CMD_CORE,
+	CMD_FRAMES,
+	CMD_ARGS,
+	CMD_SHARED,
+	CMD_LOCALS,
+	CMD_DETACH,
+};
+#define TOKEN(cmd, frame)	((cmd) * 10000 + (frame))
+
+/* a parsed MI value: a c-string, or a tuple or list of values */
+struct mi_val {
+	char *name;		/* as in name=value, else NULL */
+	char *str;		/* a c-string's contents, NULL for tuples and lists */
+	struct mi_val *child;
+	struct mi_val *next;
+};
+
+struct session {
+	pid_t pid;		/* gdb, 0 when not started */
+	int in;			/* socket to its stdin */
+	GString *pending;	/* commands gdb's stdin hasn't taken yet */
+	int writing;		/* in watched for room for them */
+	int out;		/* pipe from its stdout and stderr */
+	int timer;
+	char *appfile;		/* executable loaded */
+	struct stat app_stat;
+	int cores;		/* cores it loaded */
+	char *buf;		/* output not yet a full line */
+	size_t len, alloc;
+	GString *stream;	/* console and log output since the last result */
+	struct job *job;	/* core being analyzed, NULL while idle */
+	GString *text;		/* the core's report so far, as gdb prints it */
+	GString *shared;	/* what "info shared" printed */
+	struct mi_val *frames, *args, **locals;
+	int nframes;
+};
+
+static struct session *sessions = NULL;
+static guint nsessions;
+
+static void mi_free(struct mi_val *v)
+{
+	struct mi_val *next;
+
+	for (; v; v = next) {
+		next = v->next;
+		mi_free(v->child);
+		free(v->name);
+		free(v->str);
+		free(v);
+	}
+}
+
+static struct mi_val *mi_items(const char **p, char close);
+
+/* a value at *p: "c-string", {tuple} or [list] */
+static struct mi_val *mi_value(const char **p)
+{
+	struct mi_val *v = calloc(1, sizeof(struct mi_val));
+
+	if (!v)
+		return NULL;
+	if (**p == '"') {
+		v->str = mi_unquote(p);
+	} else if (**p == '{' || **p == '[') {
+		char close = **p == '{' ? '}' : ']';
+
+		(*p)++;
+		v->child = mi_items(p, close);
+		if (**p == close)
+			(*p)++;
+	} else {
+		free(v);
+		return NULL;
+	}
+
+	return v;
+}
+
+/* comma separated [name=]value items at *p, up to close */
+static struct mi_val *mi_items(const char **p, char close)
+{
+	struct mi_val *head = NULL, **tail = &head, *v;
+	const char *name, *eq;
+
+	while (**p && **p != close) {
+		name = NULL;
+		eq = *p + strcspn(*p, "=\"{[,]}");
+		if (*eq == '=') {
+			name = *p;
+			*p = eq + 1;
+		}
+		v = mi_value(p);
+		if (!v)
+			break;
+		if (name)
+			v->name = strndup(name, eq - name);
+		*tail = v;
+		tail = &v->next;
+		if (**p == ',')
+			(*p)++;
+	}
+
+	return head;
+}
+
+static const struct mi_val *mi_get(const struct mi_val *v, const char *name)
+{
+	for (; v; v = v->next)
+		if (v->name && !strcmp(v->name, name))
+			return v;
+
+	return NULL;
+}
+
+static const char *mi_str(const struct mi_val *v, const char *name)
+{
+	v = mi_get(v, name);
+
+	return v ? v->str : NULL;
+}
+
+/* s, with newlines flattened so a value stays on its line */
+static void append_flat(GString *out, const char *s)
+{
+	for (; *s; s++)
+		g_string_append_c(out, *s == '\n' ? ' ' : *s);
+}
+
+static void session_writable(int fd, guint32 events, void *data);
+
+/*
+ * Write as much of the pending commands as gdb's stdin takes; while it
+ * is full (gdb still busy with the last core, or a big batch of
+ * -stack-list-locals) the rest goes from session_writable().  Returns 0
+ * unless gdb is gone.
+ */
+static int mi_flush(struct session *s)
+{
+	ssize_t ret;
+
+	while (s->pending->len) {
+		ret = send(s->in, s->pending->str, s->pending->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN) {
+			if (!s->writing && event_add(s->in, EPOLLOUT, session_writable, s))
+				return -1;
+			s->writing = 1;
+			return 0;
+		}
+		if (ret <= 0)
+			return -1;
+		g_string_erase(s->pending, 0, ret);
+	}
+	if (s->writing) {
+		event_del(s->in);
+		s->writing = 0;
+	}
+
+	return 0;
+}
+
+/* queue a batch of commands for gdb; returns 0 unless gdb is gone */
+static int mi_send(struct session *s, GString *cmds)
+{
+	g_string_append_len(s->pending, cmds->str, cmds->len);
+	g_string_free(cmds, TRUE);
+
+	return mi_flush(s);
+}
+
+/* print a frame like "bt full" does */
+static void print_frame(struct session *s, const struct mi_val *frame, int i)
+{
+	const char *level = mi_str(frame, "level"), *addr = mi_str(frame, "addr");
+	const char *func = mi_str(frame, "func"), *file = mi_str(frame, "file");
+	const char *line = mi_str(frame, "line"), *from = mi_str(frame, "from");
+	const struct mi_val *args = NULL, *v;
+
+	/* the arguments of this level */
+	v = mi_get(s->args, "stack-args");
+	for (v = v ? v->child : NULL; v; v = v->next) {
+		const char *l = mi_str(v->child, "level");
+
+		if (l && level && !strcmp(l, level)) {
+			args = mi_get(v->child, "args");
+			break;
+		}
+	}
+
+	g_string_append_printf(s->text, "#%-2s ", level ? level : "?");
+	if (addr)
+		g_string_append_printf(s->text, "%s in ", addr);
+	g_string_append_printf(s->text, "%s (", func ? func : "??");
+	for (v = args ? args->child : NULL; v; v = v->next) {
+		const char *name = mi_str(v->child, "name"), *value = mi_str(v->child, "value");
+
+		if (!name)
+			continue;
+		g_string_append_printf(s->text, "%s=", name);
+		append_flat(s->text, value ? value : "<optimized out>");
+		if (v->next)
+			g_string_append(s->text, ", ");
+	}
+	g_string_append_c(s->text, ')');
+	if (file && line)
+		g_string_append_printf(s->text, " at %s:%s", file, line);
+	else if (from)
+		g_string_append_printf(s->text, " from %s", from);
+	g_string_append_c(s->text, '\n');
+
+	if (i >= s->nframes || !s->locals[i] || !(v = mi_get(s->locals[i], "locals")))
+		return;
+	for (v = v->child; v; v = v->next) {
+		const char *name = mi_str(v->child, "name"), *value = mi_str(v->child, "value");
+
+		if (!name)
+			continue;
+		g_string_append_printf(s->text, "        %s = ", name);
+		append_flat(s->text, value ? value : "<optimized out>");
+		g_string_append_c(s->text, '\n');
+	}
+}
+
+/* the core is done with (or gdb gone): hand the job on to parse */
+static void finish_core(struct session *s, int complete)
+{
+	struct job *job = s->job;
+	const struct mi_val *f;
+	int i;
+
+	if (!job)
+		return;
+	if (s->timer >= 0)
+		timer_arm(s->timer, 0, 0);
+
+	if (complete) {
+		f = mi_get(s->frames, "stack");
+		for (i = 0, f = f ? f->child : NULL; f; f = f->next, i++)
+			print_frame(s, f->child, i);
+		if (s->shared)
+			g_string_append_len(s->text, s->shared->str, s->shared->len);
+	} else {
+		fprintf(stderr, "+ gdb killed over %s, reporting without a backtrace\n",
+			job->fullpath);
+	}
+	if (complete && s->text->len) {
+		job->output_len = job->output_alloc = s->text->len;
+		job->output = g_string_free(s->text, FALSE);
+	} else {
+		g_string_free(s->text, TRUE);
+	}
+	s->text = NULL;
+	if (s->shared)
+		g_string_free(s->shared, TRUE);
+	s->shared = NULL;
+
+	mi_free(s->frames);
+	mi_free(s->args);
+	for (i = 0; i < s->nframes; i++)
+		mi_free(s->locals[i]);
+	free(s->locals);
+	s->frames = s->args = NULL;
+	s->locals = NULL;
+	s->nframes = 0;
+	s->job = NULL;
+
+	stage_push(&parse_stage, job, FALSE);
+}
+
+static void end_session(struct session *s)
+{
+	int status;
+
+	event_del(s->out);
+	close(s->out);
+	if (s->writing)
+		event_del(s->in);
+	close(s->in);
+	if (s->timer >= 0) {
+		event_del(s->timer);
+		close(s->timer);
+	}
+	kill(-s->pid, SIGKILL);
+	while (waitpid(s->pid, &status, 0) < 0 && errno == EINTR)
+		;
+	fprintf(stderr, "+ gdb session %d ended after %d cores\n", (int)(s - sessions), s->cores);
+
+	finish_core(s, 0);
+	free(s->appfile);
+	free(s->buf);
+	if (s->stream)
+		g_string_free(s->stream, TRUE);
+	if (s->pending)
+		g_string_free(s->pending, TRUE);
+	memset(s, 0, sizeof(struct session));
+}
+
+/* all of the core's frames are known, get their locals and let go of it */
+static int send_locals(struct session *s)
+{
+	GString *cmds = g_string_new(NULL);
+	const struct mi_val *f = mi_get(s->frames, "stack");
+	int i;
+
+	for (f = f ? f->child : NULL; f && s->nframes < MAX_FRAMES; f = f->next)
+		s->nframes++;
+	s->locals = calloc(s->nframes ? s->nframes : 1, sizeof(struct mi_val *));
+	if (!s->locals)
+		s->nframes = 0;
+	for (i = 0; i < s->nframes; i++)
+		g_string_append_printf(cmds, "-stack-select-frame %d\n%d-stack-list-locals 1\n",
+				       i, TOKEN(CMD_LOCALS, i));
+	g_string_append_printf(cmds, "%d-target-detach\n", TOKEN(CMD_DETACH, 0));
+
+	return mi_send(s, cmds);
+}
+
+/* a result record: [token]^class[,results] */
+static void mi_result(struct session *s, char *line)
+{
+	struct mi_val *results;
+	const char *p;
+	long token;
+	int cmd, frame, error;
+
+	token = strtol(line, (char **)&p, 10);
+	/* an idle session has only been loading an executable ahead */
+	if (p == line || *p != '^' || (!s->job && token / 10000 != CMD_EXEC))
+		return;
+	p++;
+	error = !strncmp(p, "error", 5);
+	p += strcspn(p, ",");
+	if (*p == ',')
+		p++;
+	results = mi_items(&p, '\0');
+	cmd = token / 10000;
+	frame = token % 10000;
+
+	switch (cmd) {
+	case CMD_EXEC:
+		/* try loading it again next time */
+		if (error) {
+			free(s->appfile);
+			s->appfile = NULL;
+		}
+		break;
+	case CMD_CORE:
+		/* "Core was generated by", the signal and warnings that the core doesn't match */
+		g_string_append_len(s->text, s->stream->str, s->stream->len);
+		break;
+	case CMD_FRAMES:
+		if (!error)
+			s->frames = results;
+		results = NULL;
+		break;
+	case CMD_ARGS:
+		if (!error)
+			s->args = mi_get(results, "stack-args") ? results : NULL;
+		if (s->args)
+			results = NULL;
+		break;
+	case CMD_SHARED:
+		s->shared = g_string_new_len(s->stream->str, s->stream->len);
+		if (send_locals(s)) {
+			mi_free(results);
+			end_session(s);
+			return;
+		}
+		break;
+	case CMD_LOCALS:
+		if (!error && frame < s->nframes) {
+			s->locals[frame] = results;
+			results = NULL;
+		}
+		break;
+	case CMD_DETACH:
+		finish_core(s, 1);
+		if (s->cores >= gdb_session_cores)
+			end_session(s);
+		break;
+	}
+	mi_free(results);
+}
+
+/* one line of MI output */
+static void mi_line(struct session *s, char *line)
+{
+	const char *p = line + 1;
+	char *text;
+
+	switch (line[0]) {
+	case '~':	/* console */
+	case '&':	/* log, where warnings go */
+		if (*p != '"')
+			break;
+		text = mi_unquote(&p);
+		g_string_append(s->stream, text);
+		free(text);
+		break;
+	case '*':	/* async records and the prompt */
+	case '+':
+	case '=':
+	case '@':
+	case '(':
+		break;
+	default:
+		/* anything else is gdb talking outside of MI */
+		if (line[strspn(line, "0123456789")] != '^')
+			break;
+		mi_result(s, line);
+		if (s->pid)
+			g_string_truncate(s->stream, 0);
+	}
+}
+
+static void session_ready(int fd, guint32 __unused events, void *data)
+{
+	struct session *s = data;
+	char *line, *nl, *n;
+	ssize_t got;
+
+	while (1) {
+		if (s->alloc - s->len < 4096) {
+			size_t alloc = s->alloc ? s->alloc * 2 : 65536;
+
+			n = realloc(s->buf, alloc + 1);
+			if (!n)
+				break;
+			s->buf = n;
+			s->alloc = alloc;
+		}
+		got = read(fd, s->buf + s->len, s->alloc - s->len);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0 && errno == EAGAIN)
+			return;
+		if (got <= 0)
+			break;
+		s->len += got;
+		s->buf[s->len] = '\0';
+
+		line = s->buf;
+		while ((nl = memchr(line, '\n', s->buf + s->len - line))) {
+			*nl = '\0';
+			if (nl > line && nl[-1] == '\r')
+				nl[-1] = '\0';
+			mi_line(s, line);
+			/* the line may have ended the session */
+			if (!s->pid)
+				return;
+			line = nl + 1;
+		}
+		s->len -= line - s->buf;
+		memmove(s->buf, line, s->len);
+	}
+
+	/* EOF (or out of memory): gdb is gone */
+	end_session(s);
+}
+
+/* gdb's stdin has room again */
+static void session_writable(int __unused fd, guint32 __unused events, void *data)
+{
+	struct session *s = data;
+
+	if (mi_flush(s))
+		end_session(s);
+}
+
+/* a core took too long, gdb goes and the core with it */
+static void session_timed_out(int fd, guint32 __unused events, void *data)
+{
+	struct session *s = data;
+
+	event_drain(fd);
+	fprintf(stderr, "+ gdb over %s timed out after %d s, killing it\n",
+		s->job ? s->job->fullpath : "?", gdb_timeout);
+	end_session(s);
+}
+
+/* the cpu seconds gdb has used, -1 if unknown */
+static long cpu_used(pid_t pid)
+{
+	unsigned long long utime, stime;
+	char path[64], buf[1024], *c;
+	ssize_t got;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	got = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (got <= 0)
+		return -1;
+	buf[got] = '\0';
+	/* past the command name, which may hold anything */
+	c = strrchr(buf, ')');
+	if (!c || sscanf(c + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+			 &utime, &stime) != 2)
+		return -1;
+
+	return (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int start_session(struct session *s)
+{
+	char *args[] = { "--interpreter=mi2", "--quiet", NULL };
+	GString *cmds;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+		return -1;
+	s->out = start_gdb(args, sv[1], &s->pid);
+	close(sv[1]);
+	if (s->out < 0) {
+		close(sv[0]);
+		s->pid = 0;
+		return -1;
+	}
+	s->in = sv[0];
+	s->timer = -1;
+	s->stream = g_string_new(NULL);
+	s->pending = g_string_new(NULL);
+	if (event_add(s->out, EPOLLIN, session_ready, s)) {
+		end_session(s);
+		return -1;
+	}
+	if (gdb_timeout > 0)
+		s->timer = timer_new(session_timed_out, s);
+
+	/* as in gdb.command */
+	cmds = g_string_new("-gdb-set width 0\n"
+			    "-gdb-set height 0\n"
+			    "-gdb-set confirm off\n"
+			    "-gdb-set print pretty off\n"
+			    "-gdb-set print object on\n");
+	if (mi_send(s, cmds)) {
+		end_session(s);
+		return -1;
+	}
+	fprintf(stderr, "+ gdb session %d started\n", (int)(s - sessions));
+
+	return 0;
+}
+
+/* does s have appfile loaded, unchanged since */
+static int has_app(struct session *s, const char *appfile, const struct stat *st)
+{
+	return s->appfile && !strcmp(s->appfile, appfile) &&
+		s->app_stat.st_dev == st->st_dev && s->app_stat.st_ino == st->st_ino &&
+		s->app_stat.st_mtime == st->st_mtime && s->app_stat.st_size == st->st_size;
+}
+
+/* an idle session for appfile, best one that has it loaded */
+static struct session *pick_session(const char *appfile, const struct stat *st)
+{
+	struct session *idle = NULL, *fresh = NULL;
+	guint i;
+
+	for (i = 0; i < nsessions; i++) {
+		struct session *s = &sessions[i];
+
+		if (!s->pid) {
+			if (!fresh)
+				fresh = s;
+			continue;
+		}
+		if (s->job)
+			continue;
+		if (has_app(s, appfile, st))
+			return s;
+		if (!idle)
+			idle = s;
+	}
+
+	return fresh ? fresh : idle;
+}
+
+static int alloc_sessions(void)
+{
+	if (sessions)
+		return 0;
+	nsessions = MAX(analyze_stage.limit, 1);
+	sessions = calloc(nsessions, sizeof(struct session));
+
+	return sessions ? 0 : -1;
+}
+
+/*
+ * Analyze job's core in a gdb session.  Returns 0 if it is under way,
+ * the job goes on to the parse stage once gdb is done with it.
+ */
+int session_analyze(struct job *job)
+{
+	struct session *s;
+	struct rlimit rl;
+	struct stat st;
+	GString *cmds;
+	long used;
+
+	if (alloc_sessions())
+		return -1;
+	if (stat(job->appfile, &st))
+		memset(&st, 0, sizeof(st));
+	s = pick_session(job->appfile, &st);
+	if (!s || (!s->pid && start_session(s)))
+		return -1;
+
+	cmds = g_string_new(NULL);
+	if (!has_app(s, job->appfile, &st)) {
+		free(s->appfile);
+		s->appfile = strdup(job->appfile);
+		s->app_stat = st;
+		g_string_append_printf(cmds, "%d-file-exec-and-symbols ", TOKEN(CMD_EXEC, 0));
+		mi_quote(cmds, job->appfile);
+		g_string_append_c(cmds, '\n');
+	}
+	g_string_append_printf(cmds, "%d-target-select core ", TOKEN(CMD_CORE, 0));
+	mi_quote(cmds, job->fullpath);
+	g_string_append_printf(cmds, "\n%d-stack-list-frames 0 %d\n", TOKEN(CMD_FRAMES, 0),
+			       MAX_FRAMES - 1);
+	g_string_append_printf(cmds, "%d-stack-list-arguments 1 0 %d\n", TOKEN(CMD_ARGS, 0),
+			       MAX_FRAMES - 1);
+	g_string_append_printf(cmds, "%d-interpreter-exec console \"info shared\"\n",
+			       TOKEN(CMD_SHARED, 0));
+
+	/* gdb-cpu-limit is per core, not for the session's lifetime */
+	if (gdb_cpu_limit && (used = cpu_used(s->pid)) >= 0) {
+		rl.rlim_cur = used + gdb_cpu_limit;
+		rl.rlim_max = used + gdb_cpu_limit + 5;
+		prlimit(s->pid, RLIMIT_CPU, &rl, NULL);
+	}
+
+	s->job = job;
+	s->text = g_string_new(NULL);
+	s->cores++;
+	if (mi_send(s, cmds)) {
+		end_session(s);
+		return 0;
+	}
+	if (s->timer >= 0)
+		timer_arm(s->timer, gdb_timeout * 1000, 0);
+	fprintf(stderr, "+ Loading %s into gdb session %d\n", job->fullpath, (int)(s - sessions));
+
+	return 0;
+}
+
+/*
+ * Have an idle session load appfile ahead of its core, which a process
+ * has only started dumping.  Sessions busy with a core are left be.
+ */
+void session_prewarm(const char *appfile)
+{
+	struct session *s;
+	struct stat st;
+	GString *cmds;
+
+	if (alloc_sessions() || stat(appfile, &st))
+		return;
+	s = pick_session(appfile, &st);
+	if (!s || has_app(s, appfile, &st) || (!s->pid && start_session(s)))
+		return;
+
+	free(s->appfile);
+	s->appfile = strdup(appfile);
+	s->app_stat = st;
+	cmds = g_string_new(NULL);
+	g_string_append_printf(cmds, "%d-file-exec-and-symbols ", TOKEN(CMD_EXEC, 0));
+	mi_quote(cmds, appfile);
+	g_string_append_c(cmds, '\n');
+	if (mi_send(s, cmds)) {
+		end_session(s);
+		return;
+	}
+	fprintf(stderr, "+ Loading %s into gdb session %d\n", appfile, (int)(s - sessions));
+}
@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/* every summary line is indented this much to sit under a yaml "|" key */
+#define INDENT "        "
+#define INDENT_LEN 8
+
+/*
+ * Append one indented line to a growing summary buffer.  The buffer
+ * doubles when full so a report costs a handful of allocations no matter
+ * how many frames or libraries gdb printed.
+ */
+static int append_line(struct gdb_section *s, const char *line, size_t len)
+{
+	size_t need = s->len + INDENT_LEN + len + 2;
+
+	if (need > s->alloc) {
+		size_t newalloc = s->alloc ? s->alloc : 4096;
+		char *n;
+
+		while (newalloc < need)
+			newalloc *= 2;
+		n = realloc(s->text, newalloc);
+		if (!n)
+			return -ENOMEM;
+		s->text = n;
+		s->alloc = newalloc;
+	}
+
+	memcpy(s->text + s->len, INDENT, INDENT_LEN);
+	s->len += INDENT_LEN;
+	memcpy(s->text + s->len, line, len);
+	s->len += len;
+	if (!len || line[len - 1] != '\n')
+		s->text[s->len++] = '\n';
+	s->text[s->len] = '\0';
+	s->lines++;
+
+	return 0;
+}
+
+/*
+ * Parse the output of "gdb --batch ... -x gdb.command" held in buf into
+ * the backtrace and maps sections of a report summary.  buf is modified
+ * in place (gdb's stray 0x1a chars are blanked) but otherwise left alone.
+ *
+ * Returns 0 on success, -EINVAL if gdb decided the core does not belong
+ * to the executable (its backtrace can't be trusted) and -ENOMEM.
+ */
+int parse_gdb_output(char *buf, size_t len, struct gdb_summary *summary)
+{
+	char *line = buf, *end = buf + len, *nl;
+	int parsing_maps = 0;
+	int ret = 0;
+
+	memset(summary, 0, sizeof(struct gdb_summary));
+
+	for (; line < end; line = nl + 1) {
+		size_t linelen;
+
+		nl = memchr(line, '\n', end - line);
+		if (!nl)
+			nl = end;
+		linelen = (nl < end) ? (size_t)(nl - line + 1) : (size_t)(nl - line);
+
+		/* gdb outputs (to stderr) many "warning: " strings
+		 * We can't trust the gdb 'bt' if these two are seen.
+		 */
+		if (line[0] == 'w' &&
+		    ((linelen >= 59 && strncmp(line, "warning: core file may not match specified executable file.", 59) == 0) ||
+		     (linelen >= 43 && strncmp(line, "warning: exec file is newer than core file.", 43) == 0))) {
+			ret = -EINVAL;
+			goto err;
+		}
+
+		/* try to figure out if we're onto the maps output yet */
+		if (linelen >= 4 && strncmp(line, "From", 4) == 0)
+			parsing_maps = 1;
+		/* maps might not be present */
+		if (linelen >= 19 && strncmp(line, "No shared libraries", 19) == 0)
+			break;
+
+		if (!parsing_maps) { /* parsing backtrace */
+			char *badchar;
+
+			/* gdb's backtrace lines start with a line number */
+			if (line[0] != '#')
+				continue;
+
+			/* gdb prints some initial info which may include the
+			 * "#0" line of the backtrace, then prints the
+			 * backtrace in its entirety, leading to a
+			 * duplicate "#0" in our summary if we do do: */
+			if ((summary->backtrace.lines == 1) && (linelen >= 3) &&
+			    (strncmp(line, "#0 ", 3) == 0))
+				continue;
+
+			/* gdb outputs some 0x1a's which break XML */
+			while ((badchar = memchr(line, 0x1a, linelen)))
+				*badchar = ' ';
+
+			ret = append_line(&summary->backtrace, line, linelen);
+		} else { /* parsing maps */
+			ret = append_line(&summary->maps, line, linelen);
+		}
+		if (ret)
+			goto err;
+	}
+
+	return 0;
+err:
+	free_gdb_summary(summary);
+	return ret;
+}
+
+void free_gdb_summary(struct gdb_summary *summary)
+{
+	free(summary->backtrace.text);
+	free(summary->maps.text);
+	memset(summary, 0, sizeof(struct gdb_summary));
+}
+
+/* the MI c-string at *p, with its escapes undone; *p is moved past it */
+char *mi_unquote(const char **p)
+{
+	GString *s = g_string_new(NULL);
+	const char *c = *p + 1;
+
+	while (*c && *c != '"') {
+		if (*c != '\\' || !c[1]) {
+			g_string_append_c(s, *c++);
+			continue;
+		}
+		c++;
+		switch (*c) {
+		case 'n': g_string_append_c(s, '\n'); c++; break;
+		case 't': g_string_append_c(s, '\t'); c++; break;
+		case 'r': g_string_append_c(s, '\r'); c++; break;
+		case 'e': g_string_append_c(s, '\033'); c++; break;
+		case '0': case '1': case '2': case '3':
+		case '4': case '5': case '6': case '7': {
+			int n = 0, i;
+
+			for (i = 0; i < 3 && *c >= '0' && *c <= '7'; i++)
+				n = n * 8 + *c++ - '0';
+			g_string_append_c(s, n);
+			break;
+		}
+		default:
+			g_string_append_c(s, *c++);
+		}
+	}
+	*p = *c ? c + 1 : c;
+
+	return g_string_free(s, FALSE);
+}
+
+/*
+ * Append s to an MI command as a c-string.  gdb reads a command up to
+ * the end of its line, so every control character, not just a newline,
+ * goes in as a C escape: a core or executable name (which carries the
+ * comm of the crashed process, set to anything by prctl()) can never
+ * end the command and have the rest of its line run as another one.
+ */
+void mi_quote(GString *cmd, const char *s)
+{
+	g_string_append_c(cmd, '"');
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			g_string_append_printf(cmd, "\\%c", c);
+		else if (c == '\n')
+			g_string_append(cmd, "\\n");
+		else if (c == '\r')
+			g_string_append(cmd, "\\r");
+		else if (c == '\t')
+			g_string_append(cmd, "\\t");
+		else if (c < 0x20 || c == 0x7f)
+			g_string_append_printf(cmd, "\\%03o", c);
+		else
+			g_string_append_c(cmd, c);
+	}
+	g_string_append_c(cmd, '"');
+}
@@ -27,101 +27,111 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #include <glib.h>
 
 #include "corewatcher.h"
 
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+
 /*
  * rather than malloc() on each inotify event, preallocate a decent chunk
  * of memory so multiple events can be read in one go, trading a little
  * extra memory for less runtime overhead if/when multiple crashes happen
  * in short order.
  */
-#include <sys/inotify.h>
 #define BUF_LEN 2048
 
-gboolean inotify_source_prepare(__unused GSource *source, gint *timeout_)
+/* slight delay to minimize storms of notifications */
+#define SETTLE_MS 5000
+
+static int settle_timer = -1;
+
+static void settle_done(int fd, guint32 __unused events, void __unused *data)
 {
-	*timeout_ = 0;
-	fprintf(stderr, "+ inotification prepare\n");
-	return FALSE;
+	event_drain(fd);
+	fprintf(stderr, "+ inotify settled, scanning\n");
+	scan_core_folder(NULL);
 }
 
-gboolean inotify_source_check(__unused GSource *source)
+/*
+ * A core was written: if the ignore rules don't want it, unlink it right
+ * away.  Returns 1 if it's to be kept for the next scan.
+ */
+static int core_written(const char *name)
+{
+	struct core_name cn;
+	const char *why;
+
+	if (parse_core_name(name, &cn) || cn.state != CORE_NEW)
+		return 1;	/* left to scan_core_folder() */
+	why = unwanted_core(&cn);
+	if (!why)
+		return 1;
+
+	fprintf(stderr, "+ %s: %s, unlinking\n", name, why);
+	unlinkat(core_dirfd, name, 0);
+
+	return 0;
+}
+
+static void inotify_ready(int fd, guint32 __unused events, void __unused *data)
+{
+	char buffer[BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *p;
+	int wanted = 0;
+
+	/*
+	 * check each crash file we've been notified of against the ignore
+	 * rules, and let the settle timer go look for the rest
+	 */
+	while ((len = read(fd, buffer, BUF_LEN)) > 0) {
+		for (p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)p;
+			if (event->mask & IN_Q_OVERFLOW || !event->len)
+				wanted = 1;
+			else
+				wanted |= core_written(event->name);
+		}
+	}
+	if (len < 0 && errno != EAGAIN) {
+		fprintf(stderr, "corewatcher inotify read failed\n");
+		return;
+	}
+	fprintf(stderr, "+ inotification received!\n");
+
+	/* (re)start the settle delay, a storm of crashes is one scan */
+	if (wanted)
+		timer_arm(settle_timer, SETTLE_MS, 0);
+}
+
+/* inotification of crashes */
+int start_inotify(void)
 {
 	int fd, wd;
-	char buffer[BUF_LEN];
-	size_t len;
 
-	fprintf(stderr, "+ inotification check\n");
-	/* inotification of crashes */
-	fd = inotify_init();
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 	if (fd < 0) {
-		fprintf(stderr, "corewatcher inotify init failed...exiting\n");
-		return EXIT_FAILURE;
+		fprintf(stderr, "corewatcher inotify init failed\n");
+		return -1;
 	}
 	wd = inotify_add_watch(fd, core_folder, IN_CLOSE_WRITE);
 	if (wd < 0) {
-		fprintf(stderr, "corewatcher inotify add failed...exiting\n");
-		return EXIT_FAILURE;
-	}
-	fprintf(stderr, "+ awaiting inotification...\n");
-	len = read(fd, buffer, BUF_LEN);
-	if (len <=0 ) {
-		fprintf(stderr, "corewatcher inotify read failed...exiting\n");
-		return FALSE;
+		fprintf(stderr, "corewatcher inotify add failed\n");
+		close(fd);
+		return -1;
 	}
-	fprintf(stderr, "+ inotification received!\n");
-	/* for now simply ignore the actual crash files we've been notified of
-	 * and let our callback be dispatched to go look for any/all crash
-	 * files */
-
-	/* slight delay to minimize storms of notifications (the inotify
-	 * read() can return a batch of notifications*/
-	sleep(5);
-	return TRUE;
-}
 
-gboolean inotify_source_dispatch(__unused GSource *source,
-                                 GSourceFunc callback, gpointer user_data)
-{
-	fprintf(stderr, "+ inotify dispatch\n");
-	if(callback(user_data)) {
-		fprintf(stderr, "+ inotify dispatch success\n");
-		return TRUE;
-	} else {
-		//should not happen as our callback always returns 1
-		fprintf(stderr, "+ inotify dispatch failed\n");
-		return FALSE;
+	settle_timer = timer_new(settle_done, NULL);
+	if (settle_timer < 0 || event_add(fd, EPOLLIN, inotify_ready, NULL)) {
+		close(fd);
+		return -1;
 	}
-}
+	fprintf(stderr, "+ awaiting inotification...\n");
 
-void *inotify_loop(void __unused *unused)
-{
-	/* inotification of crashes */
-	GMainLoop *loop;
-	GMainContext *context;
-	GSource *source;
-	GSourceFuncs InotifySourceFuncs = {
-		inotify_source_prepare,
-		inotify_source_check,
-		inotify_source_dispatch,
-		NULL,
-		NULL,
-		NULL,
-	};
-
-	context = g_main_context_new();
-	loop = g_main_loop_new(context, FALSE);
-	loop = g_main_loop_ref(loop);
-	source = g_source_new(&InotifySourceFuncs, sizeof(GSource));
-	g_source_attach(source, context);
-	g_source_set_callback(source, scan_core_folder, NULL, NULL);
-
-	fprintf(stderr, "+ inotify loop starting\n");
-	g_main_loop_run(loop);
-	fprintf(stderr, "+ inotify loop finished\n");
-
-	return NULL;
+	return 0;
 }
@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * Lock free hand off of reports from the analysis side (any number of
+ * producers) to the submit thread (the single consumer).
+ */
+
+/*
+ * Multi producer / single consumer report stack: producers push with a
+ * compare and swap on the head, the consumer takes the whole stack at
+ * once with an exchange.  As nothing but the consumer ever pops there is
+ * no ABA problem.
+ */
+void oops_push(struct oops **head, struct oops *oops)
+{
+	struct oops *old = __atomic_load_n(head, __ATOMIC_RELAXED);
+
+	do {
+		oops->next = old;
+	} while (!__atomic_compare_exchange_n(head, &old, oops, TRUE,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* consumer only: take everything pushed so far, oldest first */
+struct oops *oops_take_all(struct oops **head)
+{
+	struct oops *oops, *next, *fifo = NULL;
+
+	oops = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+	while (oops) {
+		next = oops->next;
+		oops->next = fifo;
+		fifo = oops;
+		oops = next;
+	}
+
+	return fifo;
+}
+
+/*
+ * Concurrent set of report ids: open addressing with linear probing over
+ * 64 bit slots claimed with compare and swap.  Any thread may insert or
+ * look up, only the consumer removes.  Removal leaves a tombstone since
+ * emptying the slot would cut probe chains other ids depend on; the
+ * consumer rebuilds the table in place as soon as tombstones pile up,
+ * briefly holding off inserters (which never wait on the consumer
+ * otherwise).
+ */
+#define SLOT_EMPTY	0ULL
+#define SLOT_TOMBSTONE	(~0ULL)
+
+int id_set_init(struct id_set *set, guint entries)
+{
+	guint size = 64;
+
+	/* keep the table at most a quarter full of live ids */
+	while (size < entries * 4)
+		size *= 2;
+
+	memset(set, 0, sizeof(struct id_set));
+	set->slots = calloc(size, sizeof(guint64));
+	if (!set->slots)
+		return -1;
+	set->mask = size - 1;
+
+	return 0;
+}
+
+static void begin_insert(struct id_set *set)
+{
+	while (1) {
+		__atomic_add_fetch(&set->inserters, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&set->rebuilding, __ATOMIC_SEQ_CST))
+			return;
+		__atomic_sub_fetch(&set->inserters, 1, __ATOMIC_SEQ_CST);
+		sched_yield();
+	}
+}
+
+/*
+ * Returns 1 if id was added, 0 if it was already present and -1 if the
+ * table has no room left.
+ */
+int id_set_insert(struct id_set *set, guint64 id)
+{
+	guint i, slot;
+	int ret = -1;
+
+	begin_insert(set);
+	for (i = 0; i <= set->mask; i++) {
+		guint64 cur;
+
+		slot = (id + i) & set->mask;
+		cur = __atomic_load_n(&set->slots[slot], __ATOMIC_ACQUIRE);
+		if (cur == id) {
+			ret = 0;
+			break;
+		}
+		if (cur != SLOT_EMPTY)
+			continue;
+		if (__atomic_compare_exchange_n(&set->slots[slot], &cur, id, FALSE,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_add_fetch(&set->live, 1, __ATOMIC_RELAXED);
+			ret = 1;
+			break;
+		}
+		/* lost the race for this slot; was it to the same id? */
+		if (cur == id) {
+			ret = 0;
+			break;
+		}
+	}
+	__atomic_sub_fetch(&set->inserters, 1, __ATOMIC_SEQ_CST);
+
+	return ret;
+}
+
+int id_set_contains(struct id_set *set, guint64 id)
+{
+	guint i;
+
+	for (i = 0; i <= set->mask; i++) {
+		guint64 cur = __atomic_load_n(&set->slots[(id + i) & set->mask], __ATOMIC_ACQUIRE);
+
+		if (cur == id)
+			return 1;
+		if (cur == SLOT_EMPTY)
+			return 0;
+	}
+
+	return 0;
+}
+
+/* consumer only */
+void id_set_remove(struct id_set *set, guint64 id)
+{
+	guint i;
+
+	for (i = 0; i <= set->mask; i++) {
+		guint slot = (id + i) & set->mask;
+		guint64 cur = __atomic_load_n(&set->slots[slot], __ATOMIC_ACQUIRE);
+
+		if (cur == SLOT_EMPTY)
+			return;
+		if (cur == id) {
+			__atomic_store_n(&set->slots[slot], SLOT_TOMBSTONE, __ATOMIC_RELEASE);
+			__atomic_sub_fetch(&set->live, 1, __ATOMIC_RELAXED);
+			set->tombstones++;
+			return;
+		}
+	}
+}
+
+/*
+ * Consumer only, after removing: once a quarter of the table is
+ * tombstones, rehash the live ids in place.  New inserts are held off
+ * and the ones in progress, a single probe sequence each, are waited
+ * out, so the rebuild always happens and, with live ids kept to a
+ * quarter of the table, an insert always finds an empty slot.
+ * Concurrent lookups may briefly miss an id, which only costs the
+ * caller a redundant queue_backtrace().
+ */
+void id_set_compact(struct id_set *set)
+{
+	guint64 *live;
+	guint i, n = 0;
+
+	if (set->tombstones * 4 < set->mask + 1)
+		return;
+
+	__atomic_store_n(&set->rebuilding, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&set->inserters, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	live = malloc((set->mask + 1) * sizeof(guint64));
+	if (!live)
+		goto out;
+	for (i = 0; i <= set->mask; i++) {
+		if (set->slots[i] != SLOT_EMPTY && set->slots[i] != SLOT_TOMBSTONE)
+			live[n++] = set->slots[i];
+		__atomic_store_n(&set->slots[i], SLOT_EMPTY, __ATOMIC_RELAXED);
+	}
+	for (i = 0; i < n; i++) {
+		guint slot = live[i] & set->mask;
+
+		while (set->slots[slot] != SLOT_EMPTY)
+			slot = (slot + 1) & set->mask;
+		__atomic_store_n(&set->slots[slot], live[i], __ATOMIC_RELAXED);
+	}
+	free(live);
+	set->tombstones = 0;
+out:
+	__atomic_store_n(&set->rebuilding, 0, __ATOMIC_SEQ_CST);
+}
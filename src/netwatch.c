@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * Network state, from rtnetlink: any link, address or route change
+ * (settled for a moment, they come in bursts) has the main routing table
+ * dumped again to see whether there is a default route, and over which
+ * interfaces.  Reports failing for want of a network are then sent the
+ * moment it is back rather than at the next periodic scan.
+ *
+ * An interface matching one of metered-interfaces (shell patterns, e.g.
+ * "wwan* ppp*") is metered; while every default route is over one, only
+ * summary reports are sent, full ones wait for a better link.
+ */
+#define SETTLE_MS 250
+#define RETRY_MS 1000
+
+char **metered_interfaces = NULL;
+
+static int nl_fd = -1;
+static guint32 nl_pid;
+static int settle_timer = -1;
+static guint32 dump_seq;
+static int dumping, redump;
+static int dump_routes, dump_unmetered;
+
+/* until told otherwise, assume we're online and free to send anything */
+static int online = 1;
+static int metered = 0;
+
+int network_online(void)
+{
+	return online;
+}
+
+int network_metered(void)
+{
+	return metered;
+}
+
+static int metered_interface(int ifindex)
+{
+	char name[IF_NAMESIZE];
+	int i;
+
+	if (!metered_interfaces || !if_indextoname(ifindex, name))
+		return 0;
+	for (i = 0; metered_interfaces[i]; i++)
+		if (metered_interfaces[i][0] && g_pattern_match_simple(metered_interfaces[i], name))
+			return 1;
+
+	return 0;
+}
+
+static void start_dump(void)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct rtmsg rtm;
+	} req;
+
+	if (dumping) {
+		redump = 1;
+		return;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.nh.nlmsg_type = RTM_GETROUTE;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq = ++dump_seq;
+	req.rtm.rtm_family = AF_UNSPEC;
+
+	if (send(nl_fd, &req, req.nh.nlmsg_len, 0) < 0) {
+		fprintf(stderr, "+ Unable to ask for routes, retrying: %s\n", strerror(errno));
+		timer_arm(settle_timer, RETRY_MS, 0);
+		return;
+	}
+	dumping = 1;
+	redump = 0;
+	dump_routes = dump_unmetered = 0;
+}
+
+/* a route of the dump: count default routes of the main table */
+static void dump_route(struct nlmsghdr *nh)
+{
+	struct rtmsg *rtm = NLMSG_DATA(nh);
+	struct rtattr *rta;
+	int len = RTM_PAYLOAD(nh);
+	int table = rtm->rtm_table, oif = 0;
+
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg)) ||
+	    rtm->rtm_dst_len || rtm->rtm_type != RTN_UNICAST)
+		return;
+	for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == RTA_TABLE)
+			table = *(guint32 *)RTA_DATA(rta);
+		else if (rta->rta_type == RTA_OIF)
+			oif = *(int *)RTA_DATA(rta);
+	}
+	if (table != RT_TABLE_MAIN)
+		return;
+
+	dump_routes++;
+	/* multipath routes have no single oif, call them unmetered */
+	if (!oif || !metered_interface(oif))
+		dump_unmetered++;
+}
+
+static void dump_done(void)
+{
+	int was_online = online, was_metered = metered;
+
+	dumping = 0;
+	online = dump_routes > 0;
+	metered = online && !dump_unmetered;
+
+	if (online != was_online || metered != was_metered)
+		fprintf(stderr, "+ network is %s%s\n", online ? "up" : "down",
+			metered ? ", metered" : "");
+	/* back online, or off a metered link: send what's waiting */
+	if (online && (!was_online || (was_metered && !metered)))
+		kick_submitter();
+
+	if (redump)
+		start_dump();
+}
+
+/*
+ * Give up on the dump in progress, its NLMSG_DONE may never come; what
+ * still arrives of it is ignored and the next start_dump() goes ahead.
+ */
+static void drop_dump(void)
+{
+	if (!dumping)
+		return;
+	dumping = 0;
+	dump_seq++;
+}
+
+static void settle_done(int fd, guint32 __unused events, void __unused *data)
+{
+	event_drain(fd);
+	/* a dump takes nowhere near SETTLE_MS, this one got lost */
+	if (dumping)
+		fprintf(stderr, "+ Route dump went unanswered, asking again\n");
+	drop_dump();
+	start_dump();
+}
+
+static void netlink_ready(int fd, guint32 __unused events, void __unused *data)
+{
+	char buf[8192] __attribute__ ((aligned(__alignof__(struct nlmsghdr))));
+	struct nlmsghdr *nh;
+	ssize_t len;
+	int changed = 0;
+
+	while (1) {
+		len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == ENOBUFS) {
+			/* missed some, maybe of the dump too, so look again */
+			drop_dump();
+			changed = 1;
+			continue;
+		}
+		if (len <= 0)
+			break;
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			if (dumping && nh->nlmsg_pid == nl_pid && nh->nlmsg_seq == dump_seq) {
+				if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR)
+					dump_done();
+				else if (nh->nlmsg_type == RTM_NEWROUTE)
+					dump_route(nh);
+			} else if (nh->nlmsg_type != NLMSG_DONE && nh->nlmsg_type != NLMSG_ERROR) {
+				changed = 1;
+			}
+		}
+	}
+
+	if (changed)
+		timer_arm(settle_timer, SETTLE_MS, 0);
+}
+
+/* watch the network for the submitter */
+int start_netwatch(void)
+{
+	struct sockaddr_nl sa;
+	socklen_t sa_len = sizeof(sa);
+
+	nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nl_fd < 0) {
+		fprintf(stderr, "+ Unable to open rtnetlink: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR |
+		       RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+	if (bind(nl_fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		fprintf(stderr, "+ Unable to watch rtnetlink: %s\n", strerror(errno));
+		goto fail;
+	}
+	/* the port id the kernel gave us, to tell our dump's replies apart */
+	if (getsockname(nl_fd, (struct sockaddr *)&sa, &sa_len))
+		goto fail;
+	nl_pid = sa.nl_pid;
+
+	settle_timer = timer_new(settle_done, NULL);
+	if (settle_timer < 0 || event_add(nl_fd, EPOLLIN, netlink_ready, NULL))
+		goto fail;
+	start_dump();
+
+	return 0;
+fail:
+	close(nl_fd);
+	nl_fd = -1;
+
+	return -1;
+}
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * The processing pipeline:
+ *
+ *   ingest -> triage -> analyze -> persist -> submit
+ *
+ * ingest (scan_core_folder(), scan_processed_folder()) turns core files
+ * into jobs, triage decides whether and how a core gets a report, analyze
+ * runs gdb and parse turns its output into a report, persist writes the
+ * report and renames the core, and submit is fed by queue_backtrace().
+ *
+ * Each stage has a bounded queue.  Only parse, the one CPU bound stage,
+ * has worker threads; the others are run from the event loop (see
+ * eventloop.c), woken through an eventfd when work is queued.  Analyze
+ * only waits for gdb, so it is run from the loop too, keeping at most
+ * "limit" gdbs going at a time and reading their output from the loop.
+ *
+ * A full queue pushes back on the stage feeding it: ingest and triage
+ * never block, they leave the core where it is in the filesystem (which
+ * stays the durable queue) for the periodic scan to pick up again, and
+ * triage sheds cores of applications already waiting for analysis.
+ * Memory use is thus bounded by the queue depths no matter how many cores
+ * arrive.  Nothing run from the loop may wait for room in a queue.
+ *
+ * A stage may have a gate holding its queue back, analyze has one that
+ * waits for the host to be less busy (see pressure.c).
+ *
+ * A core is "claimed" while a job for it is anywhere in the pipeline so
+ * rescans of the folders don't queue it twice.
+ */
+struct stage triage_stage = { .name = "triage", .work = triage_core };
+struct stage analyze_stage = { .name = "analyze", .work = analyze_core, .gate = analysis_deferred };
+struct stage parse_stage = { .name = "parse", .work = parse_core };
+struct stage persist_stage = { .name = "persist", .work = persist_core };
+
+static GMutex claim_mtx;
+static GHashTable *claimed = NULL;
+
+/*
+ * Interned report id: a 64 bit hash of the core's name minus its state
+ * extension, so a report keeps its id through every state change of its
+ * core.  Never 0 or ~0, which the id sets in lockfree.c reserve.
+ */
+guint64 report_id(const char *fullpath)
+{
+	guint64 h = 0xcbf29ce484222325ULL;
+	struct core_name cn;
+	const char *name;
+	size_t len, i;
+
+	if (parse_core_name(fullpath, &cn) == 0) {
+		name = cn.base;
+		len = cn.key_len;
+	} else {
+		name = fullpath;
+		len = strlen(fullpath);
+	}
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 0x100000001b3ULL;
+	}
+	if (h == 0 || h == ~0ULL)
+		h = 1;
+
+	return h;
+}
+
+/*
+ * Create a job for fullpath unless one is already in the pipeline.  The
+ * claim is on the core's name minus its state extension.
+ */
+struct job *claim_core(const char *fullpath)
+{
+	struct job *job;
+	char *key;
+
+	job = calloc(1, sizeof(struct job));
+	if (!job)
+		return NULL;
+	job->fullpath = strdup(fullpath);
+	if (!job->fullpath || parse_core_name(job->fullpath, &job->name) ||
+	    !(key = strndup(job->name.base, job->name.key_len))) {
+		free(job->fullpath);
+		free(job);
+		return NULL;
+	}
+
+	g_mutex_lock(&claim_mtx);
+	if (g_hash_table_lookup(claimed, key)) {
+		g_mutex_unlock(&claim_mtx);
+		free(key);
+		free(job->fullpath);
+		free(job);
+		return NULL;
+	}
+	g_hash_table_insert(claimed, key, key);
+	g_mutex_unlock(&claim_mtx);
+	job->key = key;
+
+	return job;
+}
+
+/* done with a job, whatever the outcome: drop its claim and free it */
+void finish_job(struct job *job)
+{
+	if (!job)
+		return;
+
+	g_mutex_lock(&claim_mtx);
+	g_hash_table_remove(claimed, job->key);
+	g_mutex_unlock(&claim_mtx);
+
+	free(job->key);
+	free(job->fullpath);
+	free(job->appfile);
+	free(job->reportname);
+	free(job->output);
+	FREE_OOPS(job->oops);
+	free(job);
+}
+
+/*
+ * Queue job on stage s.  If the queue is full either wait for room or,
+ * without wait, return -1 leaving the job with the caller.
+ */
+int stage_push(struct stage *s, struct job *job, gboolean wait)
+{
+	g_mutex_lock(&s->mtx);
+	while (g_queue_get_length(&s->queue) >= s->capacity) {
+		if (!wait) {
+			g_mutex_unlock(&s->mtx);
+			return -1;
+		}
+		g_cond_wait(&s->not_full, &s->mtx);
+	}
+	job->queued = g_get_monotonic_time();
+	g_queue_push_tail(&s->queue, job);
+	g_cond_signal(&s->not_empty);
+	g_mutex_unlock(&s->mtx);
+
+	if (s->wake >= 0)
+		eventfd_write(s->wake, 1);
+
+	return 0;
+}
+
+/*
+ * A job of a stage with a limit on jobs in progress is done with that
+ * stage; may be called from any thread.
+ */
+void stage_done(struct stage *s)
+{
+	g_mutex_lock(&s->mtx);
+	s->running--;
+	g_mutex_unlock(&s->mtx);
+
+	eventfd_write(s->wake, 1);
+}
+
+static int job_has_app(gconstpointer a, gconstpointer b)
+{
+	const struct job *job = a;
+
+	return strcmp(job->appfile, b);
+}
+
+/* is a core of appfile already waiting in stage s */
+gboolean stage_has_app(struct stage *s, const char *appfile)
+{
+	gboolean ret;
+
+	g_mutex_lock(&s->mtx);
+	ret = g_queue_find_custom(&s->queue, appfile, job_has_app) != NULL;
+	g_mutex_unlock(&s->mtx);
+
+	return ret;
+}
+
+static void *stage_worker(void *data)
+{
+	struct stage *s = data;
+	struct job *job;
+
+	/* only analysis has worker threads */
+	place_thread();
+
+	while (1) {
+		g_mutex_lock(&s->mtx);
+		while (g_queue_is_empty(&s->queue)) {
+			fprintf(stderr, "+ %s stage awaiting work\n", s->name);
+			g_cond_wait(&s->not_empty, &s->mtx);
+		}
+		job = g_queue_pop_head(&s->queue);
+		g_cond_signal(&s->not_full);
+		g_mutex_unlock(&s->mtx);
+
+		s->work(job);
+	}
+
+	return NULL;
+}
+
+/* run the jobs queued on a stage without worker threads */
+static void stage_ready(int fd, guint32 __unused events, void *data)
+{
+	struct stage *s = data;
+	struct job *job;
+
+	event_drain(fd);
+
+	g_mutex_lock(&s->mtx);
+	while (!g_queue_is_empty(&s->queue) && (!s->limit || s->running < s->limit)) {
+		if (s->gate && s->gate(s, g_queue_peek_head(&s->queue)))
+			break;
+		job = g_queue_pop_head(&s->queue);
+		if (s->limit)
+			s->running++;
+		g_cond_signal(&s->not_full);
+		g_mutex_unlock(&s->mtx);
+
+		s->work(job);
+
+		g_mutex_lock(&s->mtx);
+	}
+	g_mutex_unlock(&s->mtx);
+}
+
+/*
+ * Start stage s with workers threads, or when workers is 0 run it from
+ * the event loop with at most limit jobs in progress (0: no limit, each
+ * job is done once s->work returns).  Its queue has room for at least as
+ * many jobs as it works on at once.
+ */
+static int start_stage(struct stage *s, guint workers, guint limit)
+{
+	char name[16];
+	guint i;
+
+	g_mutex_init(&s->mtx);
+	g_cond_init(&s->not_empty);
+	g_cond_init(&s->not_full);
+	g_queue_init(&s->queue);
+	s->capacity = MAX((guint)queue_depth, MAX(limit, workers));
+	s->workers = workers;
+	s->limit = limit;
+	s->wake = -1;
+
+	if (!workers) {
+		s->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (s->wake < 0 || event_add(s->wake, EPOLLIN, stage_ready, s))
+			return -1;
+	}
+	for (i = 0; i < workers; i++) {
+		snprintf(name, sizeof(name), "cw%s%u", s->name, i);
+		if (!g_thread_new(name, stage_worker, s))
+			return -1;
+	}
+	fprintf(stderr, "+ %s stage started: %u workers, limit %u, queue depth %u\n",
+		s->name, workers, limit, s->capacity);
+
+	return 0;
+}
+
+int start_pipeline(void)
+{
+	guint workers = analyze_workers;
+
+	/* gdb and parsing its output are the expensive part, by default give them half the cpus */
+	if (!workers)
+		workers = CLAMP(g_get_num_processors() / 2, 1, 4);
+
+	g_mutex_init(&claim_mtx);
+	claimed = g_hash_table_new(g_str_hash, g_str_equal);
+
+	if (start_placement() || start_pressure() ||
+	    start_stage(&persist_stage, 0, 0) ||
+	    start_stage(&parse_stage, workers, 0) ||
+	    start_stage(&analyze_stage, 0, workers) ||
+	    start_stage(&triage_stage, 0, 0))
+		return -1;
+
+	/*
+	 * A job keeps its analyze slot until parse_core() is done with it, so
+	 * at most analyze's limit of jobs are ever queued for parsing and the
+	 * loop's pushes onto that queue always find room.
+	 */
+	assert(parse_stage.capacity >= analyze_stage.limit);
+
+	return 0;
+}
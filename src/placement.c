@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/sched.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * Where analysis runs.  On hosts with cpus set aside for latency
+ * critical work, gdb and the parse threads must stay on the
+ * housekeeping cpus however many cores arrive at once:
+ *   analyze-cpus=LIST        cpus for gdb and parse threads ("0-1,8")
+ *   analyze-numa-node=N      cpus (and memory) of a NUMA node
+ *   analyze-cgroup=PATH      a cgroup v2 directory every gdb is moved to,
+ *   analyze-cpu-max=QUOTA PERIOD   with these cpu.max and
+ *   analyze-memory-max=SIZE        memory.max
+ * gdb takes its affinity and memory policy from the thread spawning it,
+ * and is spawned straight into the cgroup (clone3's CLONE_INTO_CGROUP,
+ * linux 5.7), so none of it ever runs or allocates outside them.  Older
+ * kernels have it moved into the cgroup right after it is spawned.
+ */
+char *analyze_cpus;
+int analyze_node = -1;
+char *analyze_cgroup;
+char *analyze_cpu_max;
+long long analyze_memory_max;
+
+static cpu_set_t cpus;
+static int have_cpus;
+static int cgroup_procs = -1;
+static int cgroup_dir = -1;
+
+/* "0-3,8" into set, returns the number of cpus in it */
+static int parse_cpulist(const char *list, cpu_set_t *set)
+{
+	char *end;
+	long a, b;
+
+	CPU_ZERO(set);
+	while (*list) {
+		a = strtol(list, &end, 10);
+		if (end == list)
+			break;
+		b = a;
+		if (*end == '-')
+			b = strtol(end + 1, &end, 10);
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			if (a >= 0)
+				CPU_SET(a, set);
+		list = end + strspn(end, ", \n");
+	}
+
+	return CPU_COUNT(set);
+}
+
+static int write_file(const char *dir, const char *file, const char *value)
+{
+	char path[PATH_MAX];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || write(fd, value, strlen(value)) < 0) {
+		fprintf(stderr, "+ Unable to set %s to %s: %s\n", path, value, strerror(errno));
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+/* the cpus of NUMA node */
+static int node_cpus(int node, cpu_set_t *set)
+{
+	char path[64], list[4096];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	len = read(fd, list, sizeof(list) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	list[len] = '\0';
+
+	return parse_cpulist(list, set);
+}
+
+static int setup_cgroup(void)
+{
+	char parent[PATH_MAX], *slash, value[64];
+
+	if (mkdir(analyze_cgroup, 0755) && errno != EEXIST) {
+		fprintf(stderr, "+ Unable to create cgroup %s: %s\n", analyze_cgroup, strerror(errno));
+		return -1;
+	}
+
+	/* the controllers need enabling in the parent, which may well be done */
+	snprintf(parent, sizeof(parent), "%s", analyze_cgroup);
+	slash = strrchr(parent, '/');
+	if (slash && slash != parent) {
+		*slash = '\0';
+		if (analyze_cpu_max)
+			write_file(parent, "cgroup.subtree_control", "+cpu");
+		if (analyze_memory_max)
+			write_file(parent, "cgroup.subtree_control", "+memory");
+		if (have_cpus || analyze_node >= 0)
+			write_file(parent, "cgroup.subtree_control", "+cpuset");
+	}
+
+	if (analyze_cpu_max)
+		write_file(analyze_cgroup, "cpu.max", analyze_cpu_max);
+	if (analyze_memory_max) {
+		snprintf(value, sizeof(value), "%lld", analyze_memory_max);
+		write_file(analyze_cgroup, "memory.max", value);
+	}
+	if (analyze_cpus)
+		write_file(analyze_cgroup, "cpuset.cpus", analyze_cpus);
+	if (analyze_node >= 0) {
+		snprintf(value, sizeof(value), "%d", analyze_node);
+		write_file(analyze_cgroup, "cpuset.mems", value);
+	}
+
+	cgroup_dir = open(analyze_cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	snprintf(parent, sizeof(parent), "%s/cgroup.procs", analyze_cgroup);
+	cgroup_procs = open(parent, O_WRONLY | O_CLOEXEC);
+	if (cgroup_procs < 0) {
+		fprintf(stderr, "+ Unable to open %s: %s\n", parent, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* work out the placement from corewatcher.conf, before any worker starts */
+int start_placement(void)
+{
+	cpu_set_t node;
+
+	if (analyze_cpus && !parse_cpulist(analyze_cpus, &cpus)) {
+		fprintf(stderr, "+ analyze-cpus=%s has no cpus, ignoring it\n", analyze_cpus);
+	} else if (analyze_cpus) {
+		have_cpus = 1;
+	}
+	if (analyze_node >= 0) {
+		if (!node_cpus(analyze_node, &node)) {
+			fprintf(stderr, "+ No cpus for NUMA node %d, ignoring it\n", analyze_node);
+			analyze_node = -1;
+		} else if (have_cpus) {
+			CPU_AND(&cpus, &cpus, &node);
+			if (!CPU_COUNT(&cpus)) {
+				fprintf(stderr, "+ analyze-cpus and NUMA node %d don't overlap\n",
+					analyze_node);
+				have_cpus = 0;
+			}
+		} else {
+			cpus = node;
+			have_cpus = 1;
+		}
+	}
+
+	if (analyze_cgroup && setup_cgroup())
+		return -1;
+
+	return 0;
+}
+
+static void set_mempolicy_node(int node)
+{
+	unsigned long mask[16] = { 0 };
+
+	if (node < 0 || node >= (int)(sizeof(mask) * 8)) {
+		syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+		return;
+	}
+	mask[node / (8 * sizeof(long))] = 1UL << (node % (8 * sizeof(long)));
+	syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8);
+}
+
+/* place the calling worker thread */
+void place_thread(void)
+{
+	if (have_cpus)
+		sched_setaffinity(0, sizeof(cpus), &cpus);
+	if (analyze_node >= 0)
+		set_mempolicy_node(analyze_node);
+}
+
+/*
+ * Around spawning a worker process from the event loop: a child takes
+ * the affinity and memory policy of the thread spawning it, so it starts
+ * out on the analysis cpus rather than wherever the loop runs.
+ */
+void spawn_placement(int spawning)
+{
+	static cpu_set_t loop_cpus;
+	static int have_loop_cpus;
+
+	if (have_cpus) {
+		if (spawning) {
+			have_loop_cpus = !sched_getaffinity(0, sizeof(loop_cpus), &loop_cpus);
+			sched_setaffinity(0, sizeof(cpus), &cpus);
+		} else if (have_loop_cpus) {
+			sched_setaffinity(0, sizeof(loop_cpus), &loop_cpus);
+		}
+	}
+	if (analyze_node >= 0)
+		set_mempolicy_node(spawning ? analyze_node : -1);
+}
+
+/* in the child of spawn_into_cgroup(): fd as target, kept across exec */
+static void child_fd(int fd, int target)
+{
+	if (fd == target)
+		fcntl(target, F_SETFD, 0);
+	else
+		dup2(fd, target);
+}
+
+/* name looked up in PATH the way execvp() does, into buf; returns 0 */
+static int find_program(const char *name, char *buf, size_t size)
+{
+	const char *path = getenv("PATH"), *p, *end;
+
+	if (strchr(name, '/'))
+		return snprintf(buf, size, "%s", name) < (int)size ? 0 : -1;
+	if (!path)
+		path = "/bin:/usr/bin";
+	for (p = path; *p; p = *end ? end + 1 : end) {
+		end = strchrnul(p, ':');
+		/* an empty entry is the current directory */
+		if (snprintf(buf, size, "%.*s%s%s", (int)(end - p), p, end > p ? "/" : "",
+			     name) < (int)size && !access(buf, X_OK))
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Spawn argv (looked up in PATH) with env straight into analyze-cgroup,
+ * between spawn_placement() calls: its stdin is in, ours if -1, its
+ * stdout and stderr go to out, and it runs in a process group of its own
+ * with no signals blocked or handled.  Returns 0 with its pid in pid, or
+ * -1 for the caller to spawn it as usual and place_process() it: there
+ * is no cgroup, argv[0] isn't found, or clone3() failed (kernels before
+ * 5.7 can't spawn into a cgroup, and the cgroup may refuse a process).
+ */
+int spawn_into_cgroup(pid_t *pid, char *const argv[], char *const env[], int in, int out)
+{
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+	struct clone_args args;
+	struct sigaction sa;
+	char path[PATH_MAX];
+	sigset_t mask;
+	long ret;
+	int sig;
+
+	if (cgroup_dir < 0 || find_program(argv[0], path, sizeof(path)))
+		return -1;
+
+	memset(&args, 0, sizeof(args));
+	args.flags = CLONE_INTO_CGROUP;
+	args.exit_signal = SIGCHLD;
+	args.cgroup = cgroup_dir;
+	ret = syscall(SYS_clone3, &args, sizeof(args));
+	if (ret < 0) {
+		/* ENOSYS or E2BIG before 5.3, EINVAL for the flag before 5.7 */
+		if (errno != ENOSYS && errno != E2BIG && errno != EINVAL)
+			fprintf(stderr, "+ Unable to start %s in %s: %s\n", argv[0],
+				analyze_cgroup, strerror(errno));
+		return -1;
+	}
+	if (ret > 0) {
+		/* as the child does, so it can be signalled as a group right away */
+		setpgid(ret, ret);
+		*pid = ret;
+		return 0;
+	}
+
+	/*
+	 * The child, a copy of a threaded process: only plain syscalls until
+	 * exec, so no PATH search (path was found above) and execve().
+	 */
+	if (in >= 0)
+		child_fd(in, STDIN_FILENO);
+	child_fd(out, STDOUT_FILENO);
+	child_fd(out, STDERR_FILENO);
+	setpgid(0, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	for (sig = 1; sig < NSIG; sig++)
+		sigaction(sig, &sa, NULL);
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	execve(path, argv, env);
+	_exit(127);
+#else
+	return -1;
+#endif
+}
+
+/* move the worker process pid just spawned into analyze-cgroup */
+void place_process(pid_t pid)
+{
+	char buf[16];
+
+	if (cgroup_procs >= 0) {
+		snprintf(buf, sizeof(buf), "%d", pid);
+		if (write(cgroup_procs, buf, strlen(buf)) < 0)
+			fprintf(stderr, "+ Unable to move %d to %s: %s\n", pid, analyze_cgroup,
+				strerror(errno));
+	}
+}
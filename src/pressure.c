@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * Holding back analysis while the host is busy.  A crash often comes
+ * with a saturated host, and gdb loading debuginfo only adds to it, so
+ * before the analyze stage starts a gdb it looks at the kernel's
+ * pressure stall information (the "some avg10" of /proc/pressure/cpu,
+ * io and memory) and the load average per cpu.  Past any of the
+ * configured thresholds no new gdb is started; the queued cores wait,
+ * and further ones stay on disk, until the host quiets down.
+ *
+ * So analysis can't be put off forever on a host that is always busy,
+ * once the oldest waiting core has waited pressure-max-defer seconds
+ * one gdb at a time is let through anyway.
+ *
+ * Reports that need no gdb are not held back.
+ */
+#define POLL_MS 2000
+
+static const char *psi_name[PSI_KINDS] = { "cpu", "io", "memory" };
+static int psi_fd[PSI_KINDS] = { -1, -1, -1 };
+double psi_limit[PSI_KINDS];	/* % of time stalled, 0 for no limit */
+double max_load;		/* load average per cpu, 0 for no limit */
+int max_defer = 600;		/* seconds */
+
+static int poll_timer = -1;
+static int deferring;
+
+/* the "some avg10=" of a /proc/pressure file */
+static double psi_avg10(int fd)
+{
+	char buf[256], *c;
+	ssize_t len;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+	c = strstr(buf, "some avg10=");
+
+	return c ? atof(c + 11) : 0;
+}
+
+/* NULL if the host has room for analysis, else what it's short of */
+static const char *host_busy(double *level)
+{
+	double load;
+	int i;
+
+	for (i = 0; i < PSI_KINDS; i++) {
+		if (psi_limit[i] <= 0 || psi_fd[i] < 0)
+			continue;
+		*level = psi_avg10(psi_fd[i]);
+		if (*level > psi_limit[i])
+			return psi_name[i];
+	}
+	if (max_load > 0 && getloadavg(&load, 1) == 1) {
+		*level = load / g_get_num_processors();
+		if (*level > max_load)
+			return "load";
+	}
+
+	return NULL;
+}
+
+static void poll_pressure(int fd, guint32 __unused events, void __unused *data)
+{
+	event_drain(fd);
+	/* have the analyze stage look again */
+	eventfd_write(analyze_stage.wake, 1);
+}
+
+/*
+ * The analyze stage's gate, called with its lock held before it starts
+ * on job.  Returns 1 to leave job queued for now.
+ */
+int analysis_deferred(struct stage *s, struct job *job)
+{
+	const char *busy;
+	double level = 0;
+
+	if (poll_timer < 0)
+		return 0;
+
+	busy = host_busy(&level);
+	if (!busy) {
+		if (deferring)
+			fprintf(stderr, "+ host quiet again, resuming analysis\n");
+		deferring = 0;
+		return 0;
+	}
+
+	/* put off long enough: one at a time */
+	if (!s->running && g_get_monotonic_time() - job->queued > (gint64)max_defer * G_USEC_PER_SEC)
+		return 0;
+
+	if (!deferring)
+		fprintf(stderr, "+ host busy (%s at %.1f), deferring analysis\n", busy, level);
+	deferring = 1;
+	timer_arm(poll_timer, POLL_MS, 0);
+
+	return 1;
+}
+
+/* open what start_pipeline() needs to tell a busy host, if configured */
+int start_pressure(void)
+{
+	char path[64];
+	int i, any = max_load > 0;
+
+	for (i = 0; i < PSI_KINDS; i++) {
+		if (psi_limit[i] <= 0)
+			continue;
+		snprintf(path, sizeof(path), "/proc/pressure/%s", psi_name[i]);
+		psi_fd[i] = open(path, O_RDONLY | O_CLOEXEC);
+		if (psi_fd[i] < 0)
+			fprintf(stderr, "+ Unable to open %s, not gating on it\n", path);
+		else
+			any = 1;
+	}
+	if (!any)
+		return 0;
+
+	poll_timer = timer_new(poll_pressure, NULL);
+
+	return poll_timer < 0 ? -1 : 0;
+}
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * Crash prefetch: with crash-prefetch=yes the proc connector tells us
+ * the moment a process starts dumping core, long before inotify sees the
+ * core closed.  The process is still there while the kernel writes its
+ * core, so right then its executable, command line, cgroup and mapped
+ * files are taken from /proc.  A thread reads the executable and mapped
+ * files into the page cache and indexes their symbols (symcache.c), and
+ * an idle gdb session is handed the executable (gdbmi.c), all while the
+ * core is still being written.
+ *
+ * What was seen is kept by pid for when the core shows up: triage takes
+ * the executable from here rather than searching for the (at most 15
+ * character) name in the core's name, and reports get the full command
+ * line and the cgroup.  A core matches if its pid, name and time do, and
+ * the executable is only used if it is the same file in our mount
+ * namespace too.
+ *
+ * Listening needs CAP_NET_ADMIN.  Linux 6.6 and later only send us
+ * coredump events, older ones every fork, exec and exit, which are
+ * dropped as they come in.
+ */
+#define MAX_CRASHES	64
+#define MAX_PREFETCH	64
+#define MAX_PREFETCHING	2
+#define MATCH_SECONDS	60
+
+int crash_prefetch = 0;
+
+struct crash {
+	int pid;		/* 0 for an empty slot */
+	char comm[16];
+	time_t seen;
+	char *exe;		/* as the process saw it */
+	dev_t dev;		/* of the file /proc/PID/exe was */
+	ino_t ino;
+	char *cmdline;
+	char *cgroup;
+};
+
+struct prefetch {
+	int count;
+	int fds[MAX_PREFETCH];
+	char *names[MAX_PREFETCH];
+};
+
+/* the layout of struct proc_input, linux 6.6 and later */
+struct proc_listen {
+	guint32 mcast_op;
+	guint32 event_type;
+};
+
+static GMutex crash_mtx;
+static struct crash crashes[MAX_CRASHES];
+static int next_crash;
+static int prefetching;
+
+/* a /proc/PID file, up to size - 1 bytes; returns its length or -1 */
+static ssize_t read_proc(int pid, const char *file, char *buf, size_t size)
+{
+	char path[64];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+
+	return len;
+}
+
+/* read the mapped files ahead and index their symbols, off the event loop */
+static void *prefetch_files(void *data)
+{
+	struct prefetch *pf = data;
+	char path[64];
+	int i;
+
+	place_thread();
+	for (i = 0; i < pf->count; i++) {
+		posix_fadvise(pf->fds[i], 0, 0, POSIX_FADV_WILLNEED);
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", pf->fds[i]);
+		prewarm_symbols(path, pf->names[i]);
+		close(pf->fds[i]);
+		free(pf->names[i]);
+	}
+	free(pf);
+	__atomic_sub_fetch(&prefetching, 1, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+/*
+ * Open the executable and every file mapped executable by pid through
+ * /proc, which reaches the files the process has whatever its mount
+ * namespace, and hand them to a prefetch thread.
+ */
+static void start_prefetch(int pid)
+{
+	struct prefetch *pf;
+	GThread *thread;
+	char path[128], line[PATH_MAX + 128];
+	char range[64], perms[8];
+	FILE *maps;
+	int fd, i, seen;
+
+	if (__atomic_add_fetch(&prefetching, 1, __ATOMIC_RELAXED) > MAX_PREFETCHING) {
+		__atomic_sub_fetch(&prefetching, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	pf = calloc(1, sizeof(struct prefetch));
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	maps = pf ? fopen(path, "re") : NULL;
+	while (maps && pf->count < MAX_PREFETCH && fgets(line, sizeof(line), maps)) {
+		char *name = strchr(line, '/'), *nl;
+
+		if (!name || sscanf(line, "%63s %7s", range, perms) != 2 || !strchr(perms, 'x'))
+			continue;
+		nl = strchr(name, '\n');
+		if (nl)
+			*nl = '\0';
+		for (i = 0, seen = 0; i < pf->count && !seen; i++)
+			seen = !strcmp(pf->names[i], name);
+		if (seen)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/map_files/%s", pid, range);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		pf->names[pf->count] = strdup(name);
+		if (!pf->names[pf->count]) {
+			close(fd);
+			break;
+		}
+		pf->fds[pf->count++] = fd;
+	}
+	if (maps)
+		fclose(maps);
+
+	thread = pf && pf->count ? g_thread_new("cwprefetch", prefetch_files, pf) : NULL;
+	if (thread) {
+		g_thread_unref(thread);
+		return;
+	}
+	for (i = 0; pf && i < pf->count; i++) {
+		close(pf->fds[i]);
+		free(pf->names[i]);
+	}
+	free(pf);
+	__atomic_sub_fetch(&prefetching, 1, __ATOMIC_RELAXED);
+}
+
+/* pid has started dumping core: note what it was and start warming up */
+static void crash_started(int pid)
+{
+	struct crash *c, new;
+	struct stat st;
+	char path[64], buf[4096], *nl;
+	ssize_t len, i;
+
+	memset(&new, 0, sizeof(new));
+	new.pid = pid;
+	new.seen = time(NULL);
+
+	snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+	len = readlink(path, buf, sizeof(buf) - 1);
+	if (len <= 0 || stat(path, &st))
+		return;
+	buf[len] = '\0';
+	new.exe = strdup(buf);
+	new.dev = st.st_dev;
+	new.ino = st.st_ino;
+
+	if (read_proc(pid, "comm", new.comm, sizeof(new.comm)) > 0 &&
+	    (nl = strchr(new.comm, '\n')))
+		*nl = '\0';
+	/* arguments are NUL separated, and may be cut short */
+	len = read_proc(pid, "cmdline", buf, sizeof(buf));
+	if (len > 0) {
+		for (i = 0; i < len - 1; i++)
+			if (!buf[i] || buf[i] == '\n')
+				buf[i] = ' ';
+		new.cmdline = strdup(buf);
+	}
+	/* "0::/path" on the unified hierarchy */
+	if (read_proc(pid, "cgroup", buf, sizeof(buf)) > 0) {
+		char *c0 = strstr(buf, "0::");
+
+		if (c0 == buf || (c0 && c0[-1] == '\n')) {
+			nl = strchr(c0 + 3, '\n');
+			if (nl)
+				*nl = '\0';
+			new.cgroup = strdup(c0 + 3);
+		}
+	}
+	fprintf(stderr, "+ %s (pid %d) is dumping core\n", new.exe, pid);
+
+	g_mutex_lock(&crash_mtx);
+	c = &crashes[next_crash];
+	next_crash = (next_crash + 1) % MAX_CRASHES;
+	free(c->exe);
+	free(c->cmdline);
+	free(c->cgroup);
+	*c = new;
+	g_mutex_unlock(&crash_mtx);
+
+	start_prefetch(pid);
+	if (gdb_session_cores > 0 && system_path(new.exe))
+		session_prewarm(new.exe);
+}
+
+static void connector_ready(int fd, guint32 __unused events, void __unused *data)
+{
+	char buf[8192] __attribute__ ((aligned(__alignof__(struct nlmsghdr))));
+	struct nlmsghdr *nh;
+	struct cn_msg *cn;
+	struct proc_event *ev;
+	ssize_t len;
+
+	while (1) {
+		len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0 && (errno == EINTR || errno == ENOBUFS))
+			continue;
+		if (len <= 0)
+			break;
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(struct proc_event)))
+				continue;
+			cn = NLMSG_DATA(nh);
+			if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+				continue;
+			ev = (struct proc_event *)cn->data;
+			if (ev->what == PROC_EVENT_COREDUMP)
+				crash_started(ev->event_data.coredump.process_tgid);
+		}
+	}
+}
+
+/* whether the kernel takes a struct proc_input, filtering events by type */
+static int kernel_filters(void)
+{
+	struct utsname u;
+	int major, minor;
+
+	if (uname(&u) || sscanf(u.release, "%d.%d", &major, &minor) != 2)
+		return 0;
+
+	return major > 6 || (major == 6 && minor >= 6);
+}
+
+/* listen for processes starting to dump core, if crash-prefetch is on */
+int start_procwatch(void)
+{
+	char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(struct proc_listen))]
+		__attribute__ ((aligned(__alignof__(struct nlmsghdr))));
+	struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+	struct cn_msg *cn = NLMSG_DATA(nh);
+	struct proc_listen listen = { PROC_CN_MCAST_LISTEN, PROC_EVENT_COREDUMP };
+	struct sockaddr_nl sa;
+	int fd;
+
+	if (!crash_prefetch)
+		return 0;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (fd < 0) {
+		fprintf(stderr, "+ Unable to open the proc connector: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = CN_IDX_PROC;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		fprintf(stderr, "+ Unable to watch the proc connector: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	cn->id.idx = CN_IDX_PROC;
+	cn->id.val = CN_VAL_PROC;
+	/* older kernels only take the bare operation */
+	cn->len = kernel_filters() ? sizeof(listen) : sizeof(listen.mcast_op);
+	memcpy(cn->data, &listen, cn->len);
+	nh->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + cn->len);
+	nh->nlmsg_type = NLMSG_DONE;
+	nh->nlmsg_pid = 0;
+	if (send(fd, nh, nh->nlmsg_len, 0) < 0) {
+		fprintf(stderr, "+ Unable to listen to the proc connector: %s\n", strerror(errno));
+		goto fail;
+	}
+	if (event_add(fd, EPOLLIN, connector_ready, NULL))
+		goto fail;
+	fprintf(stderr, "+ Watching for processes dumping core\n");
+
+	return 0;
+fail:
+	close(fd);
+
+	return -1;
+}
+
+/* the crash the core named cn is of; called with crash_mtx held */
+static struct crash *find_crash(const struct core_name *cn)
+{
+	char app[NAME_MAX + 1];
+	int i;
+
+	if (!cn->pid || core_app(app, sizeof(app), cn))
+		return NULL;
+	for (i = 0; i < MAX_CRASHES; i++) {
+		struct crash *c = &crashes[i];
+
+		if (c->pid != cn->pid || strcmp(c->comm, app))
+			continue;
+		if (cn->timestamp && llabs(cn->timestamp - (long long)c->seen) > MATCH_SECONDS)
+			continue;
+		return c;
+	}
+
+	return NULL;
+}
+
+/*
+ * The executable of the process the core named cn is of, to free(), if
+ * it was seen dumping and is a system binary.  NULL if not.
+ */
+char *crash_exe(const struct core_name *cn)
+{
+	struct crash *c;
+	struct stat st;
+	char *exe = NULL;
+
+	g_mutex_lock(&crash_mtx);
+	c = find_crash(cn);
+	if (c && c->exe && !stat(c->exe, &st) && st.st_dev == c->dev && st.st_ino == c->ino &&
+	    system_path(c->exe))
+		exe = strdup(c->exe);
+	g_mutex_unlock(&crash_mtx);
+
+	return exe;
+}
+
+/* the report lines on the process the core named cn is of, to free(), or NULL */
+char *crash_details(const struct core_name *cn)
+{
+	struct crash *c;
+	char *text = NULL;
+
+	g_mutex_lock(&crash_mtx);
+	c = find_crash(cn);
+	if (c && (c->cmdline || c->cgroup) &&
+	    asprintf(&text, "command-line: |\n        %s\ncgroup: |\n        %s\n",
+		     c->cmdline ? c->cmdline : "Unknown", c->cgroup ? c->cgroup : "Unknown") < 0)
+		text = NULL;
+	g_mutex_unlock(&crash_mtx);
+
+	return text;
+}
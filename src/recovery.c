@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * Startup recovery: whatever state the folders were left in by the last
+ * run is picked up from the event loop in small steps, after the inotify
+ * watch is armed, so new crashes are never missed and the daemon is up
+ * right away no matter how many files there are.
+ *
+ * The folders (of processed_folder, its top and the shards in the shard
+ * index) are listed with getdents64 in large batches, one batch per
+ * step, keeping only the names that still need work, sorted by state:
+ * cores in core_folder first, then reports that only need submitting,
+ * then cores that still need gdb.  Those are then fed to the pipeline as
+ * fast as triage takes them.
+ */
+#define BATCH_BYTES (256 * 1024)
+#define FEED_PER_STEP 64
+#define RETRY_MS 1000
+
+struct linux_dirent64 {
+	guint64 d_ino;
+	gint64 d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+enum {
+	R_CORE,		/* core_* in core_folder */
+	R_PROCESSED,	/* core_*.processed */
+	R_TO_PROCESS,	/* core_*.to-process */
+	R_STATES
+};
+
+static struct {
+	const char *folder;	/* being listed, NULL once done */
+	const char *shard;	/* of processed_folder being listed */
+	char **shards;		/* to list after the top of processed_folder */
+	int next_shard;
+	int pending;		/* cores needing work in the shard */
+	int dirfd;
+	char *buf;
+	GQueue work[R_STATES];
+	int wake;		/* eventfd: take another step */
+	int retry;		/* timerfd: triage was backlogged */
+	int files;
+	int queued;
+	gint64 start;
+} rec;
+
+static void next_step(void)
+{
+	eventfd_write(rec.wake, 1);
+}
+
+static void classify(const char *folder, const char *name)
+{
+	struct core_name cn;
+	char *relname;
+	int state;
+
+	if (name[0] == '.')
+		return;
+
+	if (folder == core_folder) {
+		/* move_core() deals with names it can't parse */
+		if (!strncmp(name, "core_", 5))
+			g_queue_push_tail(&rec.work[R_CORE], strdup(name));
+		return;
+	}
+	if (parse_core_name(name, &cn))
+		return;
+	if (cn.state == CORE_PROCESSED)
+		state = R_PROCESSED;
+	else if (cn.state == CORE_TO_PROCESS)
+		state = R_TO_PROCESS;
+	else
+		return;
+	rec.pending++;
+	/* relative to processed_folder */
+	if (asprintf(&relname, "%s%s", rec.shard, name) != -1)
+		g_queue_push_tail(&rec.work[state], relname);
+}
+
+/* a directory fd of our own, for its own getdents offset */
+static int open_folder(const char *folder, const char *shard)
+{
+	rec.folder = folder;
+	rec.shard = shard;
+	rec.pending = 0;
+	if (folder == core_folder)
+		rec.dirfd = openat(core_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	else
+		rec.dirfd = openat(processed_dirfd, shard[0] ? shard : ".",
+				   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (rec.dirfd < 0) {
+		fprintf(stderr, "+ Unable to open %s%s\n", folder, shard);
+		if (errno == ENOENT && shard[0])
+			shard_idle(shard);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* on to the next folder to list, returns 0 once there are none */
+static int next_folder(void)
+{
+	if (rec.folder == core_folder && open_folder(processed_folder, "") == 0)
+		return 1;
+	while (rec.shards[rec.next_shard])
+		if (open_folder(processed_folder, rec.shards[rec.next_shard++]) == 0)
+			return 1;
+
+	return 0;
+}
+
+/* list one batch of the current folder */
+static void list_step(void)
+{
+	struct linux_dirent64 *d;
+	long n, pos;
+
+	n = syscall(SYS_getdents64, rec.dirfd, rec.buf, BATCH_BYTES);
+	if (n > 0) {
+		for (pos = 0; pos < n; pos += d->d_reclen) {
+			d = (struct linux_dirent64 *)(rec.buf + pos);
+			if (d->d_type != DT_REG && d->d_type != DT_UNKNOWN)
+				continue;
+			rec.files++;
+			classify(rec.folder, d->d_name);
+		}
+		return;
+	}
+	if (n < 0)
+		fprintf(stderr, "+ Listing %s failed: %s\n", rec.folder, strerror(errno));
+
+	close(rec.dirfd);
+	rec.dirfd = -1;
+	/* nothing left to do in this shard, stop looking at it */
+	if (rec.folder == processed_folder && rec.shard[0] && !rec.pending)
+		shard_idle(rec.shard);
+	if (next_folder())
+		return;
+	rec.folder = NULL;
+
+	g_strfreev(rec.shards);
+	rec.shards = NULL;
+	free(rec.buf);
+	rec.buf = NULL;
+	fprintf(stderr, "+ Recovery listed %d files: %u cores, %u reports, %u to analyze\n",
+		rec.files, g_queue_get_length(&rec.work[R_CORE]),
+		g_queue_get_length(&rec.work[R_PROCESSED]),
+		g_queue_get_length(&rec.work[R_TO_PROCESS]));
+}
+
+/*
+ * Feed up to FEED_PER_STEP names to the pipeline.  Returns -EBUSY if
+ * triage is backlogged, 1 if there is more to do and 0 once done.
+ */
+static int feed_step(void)
+{
+	char *name, *path = NULL;
+	char moved[PATH_MAX];
+	int i, state, ret;
+
+	for (i = 0; i < FEED_PER_STEP; i++) {
+		for (state = 0; state < R_STATES; state++)
+			if (!g_queue_is_empty(&rec.work[state]))
+				break;
+		if (state == R_STATES)
+			return 0;
+		name = g_queue_peek_head(&rec.work[state]);
+
+		if (state == R_CORE) {
+			/* move it along, it's analysed like any .to-process */
+			g_queue_pop_head(&rec.work[state]);
+			if (move_core(name, moved, sizeof(moved)) == 0)
+				g_queue_push_head(&rec.work[R_TO_PROCESS],
+						  strdup(moved + strlen(processed_folder)));
+			free(name);
+			continue;
+		}
+
+		if (asprintf(&path, "%s%s", processed_folder, name) == -1)
+			return -ENOMEM;
+		ret = ingest_core(path);
+		free(path);
+		if (ret == -EBUSY)
+			return ret;
+		if (ret > 0)
+			rec.queued++;
+		g_queue_pop_head(&rec.work[state]);
+		free(name);
+	}
+
+	return 1;
+}
+
+static void recovery_step(int fd, guint32 __unused events, void __unused *data)
+{
+	int ret;
+
+	event_drain(fd);
+
+	if (rec.folder) {
+		list_step();
+		next_step();
+		return;
+	}
+
+	ret = feed_step();
+	if (ret == -EBUSY) {
+		timer_arm(rec.retry, RETRY_MS, 0);
+		return;
+	}
+	if (ret > 0) {
+		next_step();
+		return;
+	}
+
+	fprintf(stderr, "+ Recovery done: %d cores queued in %lld ms\n", rec.queued,
+		(long long)(g_get_monotonic_time() - rec.start) / 1000);
+	event_del(rec.wake);
+	close(rec.wake);
+	event_del(rec.retry);
+	close(rec.retry);
+
+	/* reports already in the submit queue may have failed before */
+	kick_submitter();
+}
+
+/* start recovering from the folders' state, returns right away */
+int start_recovery(void)
+{
+	int i;
+
+	memset(&rec, 0, sizeof(rec));
+	for (i = 0; i < R_STATES; i++)
+		g_queue_init(&rec.work[i]);
+	rec.start = g_get_monotonic_time();
+
+	rec.shards = active_shards();
+	rec.buf = malloc(BATCH_BYTES);
+	if (!rec.buf || open_folder(core_folder, ""))
+		return -1;
+
+	rec.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rec.wake < 0 || event_add(rec.wake, EPOLLIN, recovery_step, NULL))
+		return -1;
+	rec.retry = timer_new(recovery_step, NULL);
+	if (rec.retry < 0)
+		return -1;
+
+	next_step();
+
+	return 0;
+}
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * Which cores are worth a report, from corewatcher.conf:
+ *   ignore-app=GLOB    allow-app=GLOB     on the application name
+ *   ignore-path=GLOB   allow-path=GLOB    on the executable's path
+ *   ignore-signal=N[,N...]                on the killing signal
+ *   max-core-size=SIZE[K|M|G]
+ * Ignores always win.  Once there is any allow rule of a kind, only
+ * what matches one of them is allowed.  Crashes of rpm, gdb and
+ * corewatcher itself are always ignored, as are executables not found
+ * in the system path.
+ *
+ * The rules are compiled as they are read: globs without wildcards into
+ * a hash table, the others into GPatternSpecs.  They are checked on the
+ * inotify event for a new core so unwanted ones are unlinked before
+ * anything else is done with them.
+ */
+struct matcher {
+	GHashTable *exact;
+	GPatternSpec **globs;
+	int nglobs;
+	int rules;
+};
+
+static struct matcher ignore_app, allow_app, ignore_path, allow_path;
+static guint64 ignored_signals;
+long long max_core_size;
+
+static void add_match(struct matcher *m, const char *glob)
+{
+	GPatternSpec **globs;
+
+	if (!m->exact)
+		m->exact = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	if (!strpbrk(glob, "*?")) {
+		g_hash_table_add(m->exact, g_strdup(glob));
+	} else {
+		globs = realloc(m->globs, (m->nglobs + 1) * sizeof(GPatternSpec *));
+		if (!globs)
+			return;
+		m->globs = globs;
+		m->globs[m->nglobs++] = g_pattern_spec_new(glob);
+	}
+	m->rules++;
+}
+
+static int matches(struct matcher *m, const char *s)
+{
+	int i;
+
+	if (!m->rules)
+		return 0;
+	if (g_hash_table_contains(m->exact, s))
+		return 1;
+	for (i = 0; i < m->nglobs; i++)
+		if (g_pattern_match_string(m->globs[i], s))
+			return 1;
+
+	return 0;
+}
+
+static int allowed(struct matcher *ignore, struct matcher *allow, const char *s)
+{
+	if (matches(ignore, s))
+		return 0;
+
+	return !allow->rules || matches(allow, s);
+}
+
+static void add_signals(const char *list)
+{
+	char *end;
+	long sig;
+
+	while (*list) {
+		sig = strtol(list, &end, 10);
+		if (end == list)
+			break;
+		if (sig > 0 && sig <= 64)
+			ignored_signals |= 1ULL << (sig - 1);
+		list = end + strspn(end, " ,");
+	}
+}
+
+/* one "key=value" of corewatcher.conf, returns 1 if it was a rule */
+int add_rule(const char *key, const char *value)
+{
+	value += strspn(value, " \t");
+
+	if (!strcmp(key, "ignore-app"))
+		add_match(&ignore_app, value);
+	else if (!strcmp(key, "allow-app"))
+		add_match(&allow_app, value);
+	else if (!strcmp(key, "ignore-path"))
+		add_match(&ignore_path, value);
+	else if (!strcmp(key, "allow-path"))
+		add_match(&allow_path, value);
+	else if (!strcmp(key, "ignore-signal"))
+		add_signals(value);
+	else if (!strcmp(key, "max-core-size"))
+		max_core_size = parse_size(value);
+	else
+		return 0;
+
+	return 1;
+}
+
+/* the rules that are always there, before corewatcher.conf */
+void init_rules(void)
+{
+	add_match(&ignore_app, "rpm*");
+	add_match(&ignore_app, "gdb*");
+	add_match(&ignore_app, "corewatcher*");
+}
+
+int app_allowed(const char *app)
+{
+	return allowed(&ignore_app, &allow_app, app);
+}
+
+int path_allowed(const char *path)
+{
+	return allowed(&ignore_path, &allow_path, path);
+}
+
+/*
+ * Check the new core cn in core_folder against the rules, only reading
+ * its notes if a signal rule needs them.  Returns NULL if it is wanted,
+ * or why not.
+ */
+const char *unwanted_core(const struct core_name *cn)
+{
+	char app[NAME_MAX + 1];
+	struct stat stat_buf;
+	char *path;
+	int sig, ok;
+
+	if (core_app(app, sizeof(app), cn))
+		return "no application name";
+	if (!app_allowed(app))
+		return "application ignored";
+
+	if (max_core_size &&
+	    fstatat(core_dirfd, cn->base, &stat_buf, 0) == 0 && stat_buf.st_size > max_core_size)
+		return "core too large";
+
+	if (ignored_signals) {
+		sig = core_signal(core_dirfd, cn->base);
+		if (sig > 0 && sig <= 64 && (ignored_signals & (1ULL << (sig - 1))))
+			return "signal ignored";
+	}
+
+	path = crash_exe(cn);
+	if (!path)
+		path = find_apppath(app);
+	if (!path)
+		return "not part of the OS";
+	ok = path_allowed(path);
+	free(path);
+
+	return ok ? NULL : "executable ignored";
+}
@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * processed_folder layout.  By default ("flat") every core and report
+ * sits in processed_folder itself; with processed-layout=date or =hash
+ * in corewatcher.conf they go into a subfolder, a "shard", named after
+ * the crash's day (YYYYMMDD/) or a hash of $APP_$TIMESTAMP (00/ to ff/).
+ * A core and its report always land in the same shard.
+ *
+ * The shards holding cores that still need work (.to-process and
+ * .processed) are kept in an index, processed_folder/.shards, so scans
+ * skip the ones with only finished crashes.  The top of processed_folder
+ * is always scanned too, for flat layouts and anything not migrated.
+ */
+#define SHARD_FILE ".shards"
+
+int processed_layout = LAYOUT_FLAT;
+
+static GMutex shard_mtx;
+static GHashTable *active = NULL;
+
+/*
+ * The shard cn belongs in, with a trailing '/', or "" for the flat
+ * layout.  Only $APP and $TIMESTAMP are looked at, which a report's name
+ * carries as well.
+ */
+int core_shard(char *buf, size_t size, const struct core_name *cn)
+{
+	guint64 h = 0xcbf29ce484222325ULL;
+	time_t t = cn->timestamp;
+	struct tm tm;
+	size_t i;
+
+	if (size < SHARD_MAX)
+		return -ENAMETOOLONG;
+
+	switch (processed_layout) {
+	case LAYOUT_DATE:
+		if (!gmtime_r(&t, &tm) || !strftime(buf, size, "%Y%m%d/", &tm))
+			return -EINVAL;
+		break;
+	case LAYOUT_HASH:
+		/* FNV-1a over "$APP_$TIMESTAMP" */
+		for (i = 0; i < cn->app_len + 1 + cn->stamp_len; i++) {
+			h ^= (unsigned char)cn->app[i];
+			h *= 0x100000001b3ULL;
+		}
+		snprintf(buf, size, "%02x/", (unsigned int)(h & 0xff));
+		break;
+	default:
+		buf[0] = '\0';
+		break;
+	}
+
+	return 0;
+}
+
+/* create the shard that name, relative to processed_folder, goes in */
+int make_shard(const char *name)
+{
+	char shard[SHARD_MAX];
+	const char *slash = strchr(name, '/');
+
+	if (!slash)
+		return 0;
+	if ((size_t)(slash - name) >= sizeof(shard))
+		return -ENAMETOOLONG;
+	memcpy(shard, name, slash - name);
+	shard[slash - name] = '\0';
+
+	if (mkdirat(processed_dirfd, shard, S_IRWXU) && errno != EEXIST)
+		return -errno;
+
+	return 0;
+}
+
+static void save_shards(void)
+{
+	GHashTableIter iter;
+	gpointer key;
+	FILE *file = NULL;
+	int fd;
+
+	fd = openat(processed_dirfd, SHARD_FILE ".tmp",
+		    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd >= 0 && !(file = fdopen(fd, "w")))
+		close(fd);
+	if (!file)
+		return;
+
+	g_hash_table_iter_init(&iter, active);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		fprintf(file, "%s\n", (char *)key);
+	if (fclose(file) == 0)
+		renameat(processed_dirfd, SHARD_FILE ".tmp", processed_dirfd, SHARD_FILE);
+}
+
+/* shard ("" for the top of processed_folder) now has cores needing work */
+void shard_active(const char *shard)
+{
+	if (!shard[0])
+		return;
+
+	g_mutex_lock(&shard_mtx);
+	if (!g_hash_table_contains(active, shard)) {
+		g_hash_table_add(active, g_strdup(shard));
+		save_shards();
+	}
+	g_mutex_unlock(&shard_mtx);
+}
+
+/* a scan found nothing in shard left to do */
+void shard_idle(const char *shard)
+{
+	g_mutex_lock(&shard_mtx);
+	if (g_hash_table_remove(active, shard))
+		save_shards();
+	g_mutex_unlock(&shard_mtx);
+}
+
+/* the active shards right now, a NULL terminated list to g_strfreev() */
+char **active_shards(void)
+{
+	GHashTableIter iter;
+	gpointer key;
+	char **list;
+	guint i = 0;
+
+	g_mutex_lock(&shard_mtx);
+	list = g_new0(char *, g_hash_table_size(active) + 1);
+	g_hash_table_iter_init(&iter, active);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		list[i++] = g_strdup(key);
+	g_mutex_unlock(&shard_mtx);
+
+	return list;
+}
+
+/* every subfolder of processed_folder counts as active */
+static void all_shards_active(void)
+{
+	struct dirent *entry;
+	char shard[SHARD_MAX];
+	DIR *dir;
+	int fd;
+
+	fd = openat(processed_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!dir) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.' || entry->d_type != DT_DIR)
+			continue;
+		if (snprintf(shard, sizeof(shard), "%s/", entry->d_name) < (int)sizeof(shard))
+			g_hash_table_add(active, g_strdup(shard));
+	}
+	closedir(dir);
+}
+
+/*
+ * Load the shard index.  Without one every shard is assumed to be
+ * active until a scan finds otherwise.  Must be called before any
+ * processing starts.
+ */
+void load_shards(void)
+{
+	char *line = NULL;
+	size_t size = 0;
+	FILE *file;
+	int fd;
+
+	g_mutex_init(&shard_mtx);
+	active = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	fd = openat(processed_dirfd, SHARD_FILE, O_RDONLY | O_CLOEXEC);
+	file = fd < 0 ? NULL : fdopen(fd, "r");
+	if (!file) {
+		if (fd >= 0)
+			close(fd);
+		all_shards_active();
+		return;
+	}
+	while (getline(&line, &size, file) != -1) {
+		size_t len;
+
+		line[strcspn(line, "\n")] = '\0';
+		len = strlen(line);
+		/* "$SHARD/" */
+		if (len > 1 && len < SHARD_MAX && line[0] != '.' &&
+		    strchr(line, '/') == line + len - 1)
+			g_hash_table_add(active, g_strdup(line));
+	}
+	free(line);
+	fclose(file);
+}
+
+/*
+ * $APP_$TIMESTAMP.txt, or its .acked sidecar (see submit.c), taken apart
+ * into the fields of cn core_shard() looks at.
+ */
+static int parse_report_name(const char *name, struct core_name *cn)
+{
+	const char *end, *c;
+
+	memset(cn, 0, sizeof(struct core_name));
+	end = name + strlen(name);
+	if (end - name > 4 && !strcmp(end - 4, ".txt"))
+		end -= 4;
+	else if (end - name > 6 && !strcmp(end - 6, ".acked"))
+		end -= 6;
+	else
+		return -EINVAL;
+	c = memrchr(name, '_', end - name);
+	if (!c || c == name || c + 1 == end)
+		return -EINVAL;
+	for (cn->stamp = c + 1; c + 1 < end; c++) {
+		if (c[1] < '0' || c[1] > '9')
+			return -EINVAL;
+		cn->timestamp = cn->timestamp * 10 + (c[1] - '0');
+	}
+	cn->app = name;
+	cn->app_len = cn->stamp - 1 - name;
+	cn->stamp_len = end - cn->stamp;
+
+	return 0;
+}
+
+/*
+ * Move one file of processed_folder, in shard from, to where the
+ * current layout wants it.  Returns 1 if it was moved.
+ */
+static int migrate_file(const char *from, const char *name)
+{
+	char shard[SHARD_MAX], old[PATH_MAX], new[PATH_MAX];
+	const char *in = from;
+	struct core_name cn;
+	int moved = 0;
+
+	if (parse_core_name(name, &cn) && parse_report_name(name, &cn))
+		return 0;
+	if (core_shard(shard, sizeof(shard), &cn) == 0 && strcmp(shard, from)) {
+		snprintf(old, sizeof(old), "%s%s", from, name);
+		snprintf(new, sizeof(new), "%s%s", shard, name);
+		if (make_shard(new) == 0 &&
+		    rename_noreplace(processed_dirfd, old, processed_dirfd, new) == 0) {
+			in = shard;
+			moved = 1;
+		} else {
+			fprintf(stderr, "+ Unable to move %s%s to %s: %s\n",
+				processed_folder, old, new, strerror(errno));
+		}
+	}
+
+	/* a core still needing work keeps its shard active */
+	if (in[0] && cn.base && (cn.state == CORE_TO_PROCESS || cn.state == CORE_PROCESSED))
+		g_hash_table_add(active, g_strdup(in));
+
+	return moved;
+}
+
+/* migrate the files of one shard, "" being the top of processed_folder */
+static int migrate_shard(const char *shard, GQueue *subfolders)
+{
+	struct dirent *entry;
+	char name[SHARD_MAX];
+	DIR *dir;
+	int fd, moved = 0;
+
+	fd = openat(processed_dirfd, shard[0] ? shard : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!dir) {
+		if (fd >= 0)
+			close(fd);
+		fprintf(stderr, "+ Unable to open %s%s\n", processed_folder, shard);
+		return 0;
+	}
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		if (entry->d_type == DT_DIR) {
+			if (!shard[0] && snprintf(name, sizeof(name), "%s/", entry->d_name) <
+			    (int)sizeof(name))
+				g_queue_push_tail(subfolders, g_strdup(name));
+			continue;
+		}
+		moved += migrate_file(shard, entry->d_name);
+	}
+	closedir(dir);
+
+	return moved;
+}
+
+/*
+ * corewatcher --migrate: move everything in processed_folder to where
+ * processed-layout wants it, drop the shards left empty and rebuild the
+ * shard index.  Run with the daemon stopped.
+ */
+int migrate_processed(void)
+{
+	GQueue subfolders = G_QUEUE_INIT;
+	char *shard;
+	int moved;
+
+	load_shards();
+	g_hash_table_remove_all(active);
+
+	/* the top first: files moved into shards there are looked at again */
+	moved = migrate_shard("", &subfolders);
+	while ((shard = g_queue_pop_head(&subfolders))) {
+		moved += migrate_shard(shard, &subfolders);
+		/* only succeeds once empty */
+		unlinkat(processed_dirfd, shard, AT_REMOVEDIR);
+		g_free(shard);
+	}
+	save_shards();
+
+	fprintf(stderr, "+ Migrated %d files in %s, %u active shards\n", moved,
+		processed_folder, g_hash_table_size(active));
+
+	return 0;
+}
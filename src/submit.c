@@ -27,272 +27,1061 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 #include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <glib.h>
 #include <asm/unistd.h>
 #include <curl/curl.h>
 
 #include "corewatcher.h"
 
-GMutex *bt_mtx;
-GCond *bt_work;
-GHashTable *bt_hash;
-static struct oops *bt_list = NULL;
+/*
+ * Hand off from the analysis side to the submitter is lock free (see
+ * lockfree.c): producers push onto bt_stack and post bt_wake, the event
+ * loop takes the whole stack at once.  bt_ids holds the id of every
+ * report the submit side holds, on bt_stack or being sent/requeued, so
+ * the same report is never queued twice and rescans can ask about it
+ * without taking a lock.
+ */
+static struct oops *bt_stack = NULL;
+static struct id_set bt_ids;
+static int bt_wake = -1;
+/* reports held by the submit side, bounded by queue_depth */
+static gint bt_count = 0;
+
+/*
+ * Submission itself runs in the event loop, over a curl multi handle
+ * whose sockets and timeout are watched by the loop.  None of this is
+ * touched from any other thread.
+ */
+static CURLM *multi = NULL;
+static int curl_timer = -1;
+
+/* accumulates the server's reply to a POST */
+struct reply {
+	char *text;
+	size_t len;
+};
+
+/*
+ * POSTs in flight.  How many at a time is up to a per url AIMD window
+ * between 1 and submit-concurrency: it grows by one every window's
+ * worth of POSTs that went fine and halves, at most once per round
+ * trip, on a failed POST or once the kernel's smoothed rtt of the
+ * connection is twice what it was at best.  submit-rate caps the bytes
+ * per second of all POSTs together, each gets its share of it.
+ */
+#define MAX_TRANSFERS 16
+
+/* what a POST may take: this, and its size at submit-rate or FLOOR_RATE */
+#define SUBMIT_TIMEOUT_MS 5000
+#define FLOOR_RATE (8 * 1024)
+
+/* rtt growth over the best seen that isn't yet taken as congestion */
+#define RTT_SLACK_US 20000
+
+struct transfer {
+	struct queue *q;
+	CURL *handle;
+	int busy;
+	int url;		/* index into submit_url */
+	curl_mime *mime;
+	struct reply reply;
+	struct oops *oops;	/* the report sent, or the list offered */
+	int offer;
+	char *map;		/* the report's text, mapped while it is sent */
+	size_t map_len;
+	size_t sent;		/* how much of it curl has taken so far */
+};
+
+/*
+ * Reports are sent from a queue.  By default there is one, sent to the
+ * first url that can be reached.  With submit-to=all there is one per
+ * url, every report is copied onto each (minus the urls that already
+ * have it, see the .acked sidecar below) and each queue is sent, retried
+ * and acknowledged on its own, so a slow url doesn't hold up the others.
+ */
+static struct queue {
+	/* fingerprint mode: reports whose fingerprint is yet to be offered */
+	struct oops *offer_list;
+	/* reports to POST, in order */
+	struct oops *work_list;
+	/* reports that failed, retried on the next kick_submitter() */
+	struct oops *requeue_list;
+	int home;		/* url the queue starts each round with */
+	int url;		/* url it is sending to */
+	int inflight;
+	int offering;
+	int sentcount, failcount;
+	struct transfer transfers[MAX_TRANSFERS];
+} queues[MAX_URLS];
+static int queue_count = 1;
+
+static struct url_state {
+	double window;		/* POSTs allowed in flight */
+	guint32 base_rtt;	/* best smoothed rtt this round, usec */
+	guint32 srtt;
+	gint64 backoff;		/* last decrease, monotonic usec */
+} urls[MAX_URLS];
+
+static void submit_wake(int fd, guint32 events, void *data);
+
+int init_submit_queue(void)
+{
+	int i;
+
+	bt_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (bt_wake < 0 || event_add(bt_wake, EPOLLIN, submit_wake, NULL))
+		return -1;
+	for (i = 0; i < MAX_URLS; i++) {
+		urls[i].window = 1;
+		queues[i].home = queues[i].url = i;
+	}
+	if (submit_fanout)
+		queue_count = url_count;
+
+	return id_set_init(&bt_ids, queue_depth);
+}
+
+/* wake the submitter, e.g. to retry requeued reports */
+void kick_submitter(void)
+{
+	if (bt_wake >= 0)
+		eventfd_write(bt_wake, 1);
+}
+
+/* reserve room for one more report, fails once queue_depth are held */
+static int reserve_slot(void)
+{
+	gint count = __atomic_load_n(&bt_count, __ATOMIC_RELAXED);
+
+	do {
+		if (count >= queue_depth)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&bt_count, &count, count + 1, TRUE,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return 0;
+}
 
 /*
  * Adds an oops to the work queue if the oops
- * isn't already there.
+ * isn't already there.  The queue is bounded: once full, the report is
+ * dropped from memory and left on disk for a later scan to requeue.
  */
 void queue_backtrace(struct oops *oops)
 {
 	if (!oops || !oops->filename)
 		return;
 
-	g_mutex_lock(bt_mtx);
+	oops->id = report_id(oops->filename);
+	/* a summary and the full report replacing it are queued independently */
+	if (oops->summary)
+		oops->id = ~oops->id;
+
+	if (reserve_slot()) {
+		fprintf(stderr, "+ Submit queue full, leaving %s for later\n", oops->detail_filename);
+		FREE_OOPS(oops);
+		return;
+	}
 
-	/* if this is already on bt_list / bt_hash, free and done */
-	if (g_hash_table_lookup(bt_hash, oops->filename)) {
+	switch (id_set_insert(&bt_ids, oops->id)) {
+	case 1:
+		break;
+	case 0:
+		/* already held by the submit side, free and done */
+		__atomic_sub_fetch(&bt_count, 1, __ATOMIC_RELAXED);
+		FREE_OOPS(oops);
+		return;
+	default:
+		fprintf(stderr, "+ Report id table full, leaving %s for later\n",
+			oops->detail_filename);
+		__atomic_sub_fetch(&bt_count, 1, __ATOMIC_RELAXED);
 		FREE_OOPS(oops);
-		g_mutex_unlock(bt_mtx);
 		return;
 	}
 
-	/* otherwise add to bt_list / bt_hash, signal work */
-	oops->next = bt_list;
-	bt_list = oops;
-	g_hash_table_insert(bt_hash, oops->filename, oops->filename);
-	g_cond_signal(bt_work);
-	g_mutex_unlock(bt_mtx);
+	oops_push(&bt_stack, oops);
+	kick_submitter();
+}
+
+/* is the report for core filename waiting to be submitted */
+int backtrace_queued(const char *filename)
+{
+	return id_set_contains(&bt_ids, report_id(filename));
+}
+
+/*
+ * the submit side is done with a report, sent or not.  Of a report sent
+ * to all urls that is once every queue is done with its copy.
+ */
+static void forget_report(struct oops *oops)
+{
+	if (oops->fanout && --*oops->fanout > 0) {
+		FREE_OOPS(oops);
+		return;
+	}
+	free(oops->fanout);
+	id_set_remove(&bt_ids, oops->id);
+	id_set_compact(&bt_ids);
+	__atomic_sub_fetch(&bt_count, 1, __ATOMIC_RELAXED);
+	FREE_OOPS(oops);
 }
 
 /*
  * For testmode to display all oops that would
  * be submitted.
- *
- * Picks up and sets down the bt_mtx.
  */
 static void print_queue(void)
 {
 	struct oops *oops = NULL, *next = NULL;
-	int count = 0;
 
-	g_mutex_lock(bt_mtx);
-	oops = bt_list;
+	oops = oops_take_all(&bt_stack);
 	while (oops) {
-		fprintf(stderr, "+ Submit text is:\n---[start of oops]---\n%s\n---[end of oops]---\n", oops->text);
+		char *text = read_report(oops);
+
+		fprintf(stderr, "+ Submit text is:\n---[start of oops]---\n%s\n---[end of oops]---\n", text ? text : "");
+		free(text);
 		next = oops->next;
-		FREE_OOPS(oops);
+		forget_report(oops);
 		oops = next;
-		count++;
 	}
-	g_hash_table_remove_all(bt_hash);
-	g_mutex_unlock(bt_mtx);
 }
 
-static size_t writefunction(void *ptr, size_t size, size_t nmemb, void __attribute((unused)) *stream)
+static size_t writefunction(void *ptr, size_t size, size_t nmemb, void *stream)
 {
-	char *httppost_ret = NULL;
-	int ret = 0;
+	struct reply *reply = stream;
+	size_t bytes = size * nmemb;
+	char *n;
 
-	httppost_ret = malloc(size * nmemb + 1);
-	if (!httppost_ret)
-		return -1;
+	n = realloc(reply->text, reply->len + bytes + 1);
+	if (!n)
+		return 0;
+	memcpy(n + reply->len, ptr, bytes);
+	reply->len += bytes;
+	n[reply->len] = '\0';
+	reply->text = n;
 
-	memset(httppost_ret, 0, size * nmemb + 1);
-	memcpy(httppost_ret, ptr, size * nmemb);
+	return bytes;
+}
+
+/*
+ * Decide whether the server accepted a POST.  In fingerprint mode the
+ * server answers with a plain "ok" line, otherwise all we have to go on
+ * is the error pages known crashdb servers send back.
+ */
+static int check_reply(CURL *handle, int result, struct reply *reply)
+{
+	long code = 0;
 
-	fprintf(stderr, "+ received:\n");
-	fprintf(stderr, "%s", httppost_ret);
+	if (result)
+		return -1;
+
+	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+	fprintf(stderr, "+ received (%ld):\n", code);
+	fprintf(stderr, "%s", reply->text ? reply->text : "");
 	fprintf(stderr, "\n\n");
 
-	if (strstr(httppost_ret, "the server encountered an error") != NULL) {
-		ret = -1;
-		goto err;
-	}
-	if (strstr(httppost_ret, "ScannerError at /crash_submit/") != NULL) {
-		ret = -1;
-		goto err;
+	if (code >= 400)
+		return -1;
+
+	if (fingerprint_submit)
+		return (reply->text && !strncmp(reply->text, "ok", 2)) ? 0 : -1;
+
+	if (!reply->text)
+		return 0;
+	if (strstr(reply->text, "the server encountered an error") != NULL)
+		return -1;
+	if (strstr(reply->text, "ScannerError at /crash_submit/") != NULL)
+		return -1;
+	if (strstr(reply->text, "was not found on this server") != NULL)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * With submit-to=all, which urls have a report is kept next to it in
+ * $APP_$TIMESTAMP.acked, one "$QUALITY $URL" line each, so a restart
+ * only sends it to the urls still missing it.
+ */
+static int acked_path(char *buf, size_t size, struct oops *oops, int *dirfd)
+{
+	const char *name;
+	size_t len;
+
+	*dirfd = folder_at(oops->detail_filename, &name);
+	len = strlen(name);
+	if (len < 4 || strcmp(name + len - 4, ".txt"))
+		return -1;
+
+	return snprintf(buf, size, "%.*s.acked", (int)(len - 4), name) >= (int)size ? -1 : 0;
+}
+
+static const char *quality(struct oops *oops)
+{
+	return oops->summary || oops->gdb_failed ? "summary" : "full";
+}
+
+/* has url acknowledged report oops, in its quality */
+static int report_acked(struct oops *oops, int url)
+{
+	char path[PATH_MAX], *line = NULL;
+	size_t line_len = 0, qlen = strlen(quality(oops));
+	FILE *file = NULL;
+	int dirfd, fd, found = 0;
+
+	if (acked_path(path, sizeof(path), oops, &dirfd))
+		return 0;
+	fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || !(file = fdopen(fd, "r"))) {
+		if (fd >= 0)
+			close(fd);
+		return 0;
 	}
-	if (strstr(httppost_ret, "was not found on this server") != NULL) {
-		ret = -1;
-		goto err;
+	while (!found && getline(&line, &line_len, file) != -1) {
+		line[strcspn(line, "\n")] = '\0';
+		found = !strncmp(line, quality(oops), qlen) && line[qlen] == ' ' &&
+			!strcmp(line + qlen + 1, submit_url[url]);
 	}
+	free(line);
+	fclose(file);
+
+	return found;
+}
+
+static void ack_report(struct oops *oops, int url)
+{
+	char path[PATH_MAX], *line = NULL;
+	int dirfd, fd, len;
+
+	if (acked_path(path, sizeof(path), oops, &dirfd))
+		return;
+	len = asprintf(&line, "%s %s\n", quality(oops), submit_url[url]);
+	if (len < 0)
+		return;
+	fd = openat(dirfd, path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0 || write(fd, line, len) != len)
+		fprintf(stderr, "+ Unable to record %s in %s\n", submit_url[url], path);
+	if (fd >= 0)
+		close(fd);
+	free(line);
+}
+
+static int acked_by_all(struct oops *oops)
+{
+	int i;
+
+	for (i = 0; i < url_count; i++)
+		if (!report_acked(oops, i))
+			return 0;
+
+	return 1;
+}
+
+/* url has report oops, the core is done with once every url has it */
+static void report_good_send(struct oops *oops, int url)
+{
+	struct core_name cn;
+
+	fprintf(stderr, "+ successfully sent %s to %s\n", oops->detail_filename, submit_url[url]);
+	if (submit_fanout)
+		ack_report(oops, url);
+
+	/* after a summary the core still waits for gdb */
+	if (!oops->summary && (!submit_fanout || acked_by_all(oops)) &&
+	    parse_core_name(oops->filename, &cn) == 0)
+		core_rename(&cn, CORE_SUBMITTED, NULL, 0);
+
+	forget_report(oops);
+}
+
+static void report_fail_send(struct queue *q, struct oops *oops)
+{
+	fprintf(stderr, "+ requeuing %s\n", oops->detail_filename);
+	q->failcount++;
+
+	oops->next = q->requeue_list;
+	q->requeue_list = oops;
+}
 
-	ret = size * nmemb;
-err:
-	free(httppost_ret);
-	return ret;
+/* append list b to the end of list a */
+static struct oops *append_list(struct oops *a, struct oops *b)
+{
+	struct oops *tail = a;
+
+	if (!a)
+		return b;
+	while (tail->next)
+		tail = tail->next;
+	tail->next = b;
+
+	return a;
 }
 
 /*
- * Replace the extension of a file.
- * TODO: make search from end of string
+ * Feed curl the mapped report straight from the page cache: this copy
+ * into curl's upload buffer is the only one the text gets on its way
+ * from disk to the socket.
  */
-char *replace_name(char *filename, char *replace, char *new)
+static size_t readfunction(char *buf, size_t size, size_t nmemb, void *stream)
 {
-	char *newfile = NULL, *oldfile, *c = NULL;
+	struct transfer *t = stream;
+	size_t bytes = MIN(size * nmemb, t->map_len - t->sent);
 
-	if (!filename || !replace || !new)
-		return NULL;
+	memcpy(buf, t->map + t->sent, bytes);
+	t->sent += bytes;
 
-	oldfile = strdup(filename);
-	if (!oldfile)
-		return NULL;
+	return bytes;
+}
+
+/*
+ * curl rewinds the report to send it again, e.g. when a reused
+ * connection turns out to have been closed by the server.
+ */
+static int seekfunction(void *stream, curl_off_t offset, int origin)
+{
+	struct transfer *t = stream;
+
+	if (origin != SEEK_SET || offset < 0 || (size_t)offset > t->map_len)
+		return CURL_SEEKFUNC_CANTSEEK;
+	t->sent = offset;
+
+	return CURL_SEEKFUNC_OK;
+}
+
+/* add a form field name=value to mime, curl keeps a copy of value */
+static int add_field(curl_mime *mime, const char *name, const char *value)
+{
+	curl_mimepart *part = curl_mime_addpart(mime);
+
+	if (!part || curl_mime_name(part, name) != CURLE_OK ||
+	    curl_mime_data(part, value, CURL_ZERO_TERMINATED) != CURLE_OK)
+		return -1;
+
+	return 0;
+}
 
-	c = strstr(oldfile, replace);
-	if (!c) {
-		free(oldfile);
+/* may another POST of q go to its url */
+static int have_room(struct queue *q)
+{
+	return q->inflight < MIN((int)urls[q->url].window, MAX_TRANSFERS);
+}
+
+/* a free transfer of q, its easy handle set up; have_room() said there is one */
+static struct transfer *new_transfer(struct queue *q)
+{
+	struct transfer *t;
+	CURL *handle;
+	int i;
+
+	for (i = 0; i < MAX_TRANSFERS && q->transfers[i].busy; i++)
+		;
+	if (i == MAX_TRANSFERS)
+		return NULL;
+	t = &q->transfers[i];
+	handle = t->handle;
+	if (!handle && !(handle = curl_easy_init()))
 		return NULL;
+	memset(t, 0, sizeof(struct transfer));
+	t->handle = handle;
+	t->q = q;
+
+	return t;
+}
+
+/*
+ * POST the form mime to t's queue's url, the reply is handled by
+ * transfer_done().  A report's "crash" part streams from t->map through
+ * readfunction().
+ */
+static void start_transfer(struct transfer *t, curl_mime *mime, size_t size)
+{
+	CURL *handle = t->handle;
+	long timeout = SUBMIT_TIMEOUT_MS;
+	curl_off_t share = 0;
+
+	t->busy = 1;
+	t->url = t->q->url;
+	t->mime = mime;
+	t->q->inflight++;
+	if (t->offer)
+		t->q->offering = 1;
+
+	if (submit_rate) {
+		/* shared by all queues */
+		share = submit_rate / queue_count / MAX(1, (int)urls[t->url].window);
+		timeout += (long)(size * 2000 / MAX(share, 1));
+	} else {
+		timeout += (long)(size * 1000 / FLOOR_RATE);
 	}
 
-	oldfile[strlen(oldfile) - strlen(c)] = '\0';
+	curl_easy_setopt(handle, CURLOPT_URL, submit_url[t->url]);
+	curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0L);
+	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, 5L);
+	curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, timeout);
+	curl_easy_setopt(handle, CURLOPT_MAX_SEND_SPEED_LARGE, share);
+	curl_easy_setopt(handle, CURLOPT_MIMEPOST, mime);
+	curl_easy_setopt(handle, CURLOPT_POSTREDIR, 0L);
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writefunction);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &t->reply);
+	curl_easy_setopt(handle, CURLOPT_PRIVATE, t);
+	curl_multi_add_handle(multi, handle);
+}
 
-	if (asprintf(&newfile, "%s%s",  oldfile, new) == -1) {
-		free(oldfile);
+/*
+ * Fingerprint first submission: offer the fingerprints of everything on
+ * offer_list in one small POST and let the server answer, one line per
+ * fingerprint, with one of
+ *	$FP need-body
+ *	$FP count-only
+ *	$FP suppress $HOURS
+ * Reports the server only wants counted (or suppressed) are acknowledged
+ * in offer_done() without their body ever being sent.  Whatever is left,
+ * including anything the server didn't mention, needs a full upload.
+ */
+static int start_offer(struct queue *q)
+{
+	curl_mime *mime;
+	struct oops *oops;
+	struct transfer *t;
+	char *batch;
+	size_t len = 0;
+
+	t = new_transfer(q);
+	if (!t)
+		return -1;
+	for (oops = q->offer_list; oops; oops = oops->next)
+		len += strlen(oops->fingerprint) + strlen(oops->application) + 2;
+	batch = malloc(len + 1);
+	if (!batch)
+		return -1;
+	batch[0] = '\0';
+	len = 0;
+	for (oops = q->offer_list; oops; oops = oops->next)
+		len += sprintf(batch + len, "%s %s\n", oops->fingerprint, oops->application);
+
+	mime = curl_mime_init(t->handle);
+	if (!mime || add_field(mime, "fingerprints", batch)) {
+		curl_mime_free(mime);
+		free(batch);
+		return -1;
+	}
+	free(batch);
+
+	t->oops = q->offer_list;
+	t->offer = 1;
+	q->offer_list = NULL;
+	start_transfer(t, mime, len);
+
+	return 0;
+}
+
+static void offer_done(struct queue *q, int url, int result, struct reply *reply,
+		       struct oops *offered)
+{
+	struct oops *oops, *next, *need_body = NULL;
+	GHashTable *decisions;
+	char *line, *saveptr = NULL;
+
+	if (result || !reply->text) {
+		fprintf(stderr, "+ fingerprint offer failed, sending full reports\n");
+		q->work_list = append_list(q->work_list, offered);
+		return;
+	}
+
+	/* fingerprint -> rest of the server's line for it */
+	decisions = g_hash_table_new(g_str_hash, g_str_equal);
+	for (line = strtok_r(reply->text, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		char *action = strchr(line, ' ');
+
+		if (!action)
+			continue;
+		*action++ = '\0';
+		g_hash_table_insert(decisions, line, action);
+
+		/* app wide suppression applies to cores we haven't seen yet */
+		if (strlen(line) == APP_FINGERPRINT_LEN && !strncmp(action, "suppress ", 9))
+			suppress_fingerprint(line, atoi(action + 9));
+	}
+
+	for (oops = offered; oops; oops = next) {
+		char app[APP_FINGERPRINT_LEN + 1];
+		char *action;
+
+		next = oops->next;
+		oops->next = NULL;
+
+		action = g_hash_table_lookup(decisions, oops->fingerprint);
+		if (action && !strncmp(action, "suppress ", 9))
+			suppress_fingerprint(oops->fingerprint, atoi(action + 9));
+		if (!action) {
+			snprintf(app, sizeof(app), "%s", oops->fingerprint);
+			action = g_hash_table_lookup(decisions, app);
+		}
+
+		if (action && (!strcmp(action, "count-only") || !strncmp(action, "suppress ", 9))) {
+			q->sentcount++;
+			report_good_send(oops, url);
+		} else {
+			oops->next = need_body;
+			need_body = oops;
+		}
+	}
+
+	g_hash_table_destroy(decisions);
+
+	q->work_list = append_list(q->work_list, need_body);
+}
+
+/* map a report's text from disk for the length of its upload */
+static void *map_report(struct oops *oops, size_t *len)
+{
+	struct stat stat_buf;
+	const char *name;
+	void *map;
+	int fd;
+
+	fd = openat(folder_at(oops->detail_filename, &name), name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, &stat_buf) || stat_buf.st_size == 0) {
+		close(fd);
 		return NULL;
 	}
-	free(oldfile);
+	map = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	/* read once, front to back */
+	madvise(map, stat_buf.st_size, MADV_SEQUENTIAL);
+	*len = stat_buf.st_size;
 
-	return newfile;
+	return map;
 }
 
-void report_good_send(int *sentcount, struct oops *oops)
+/*
+ * Start the upload of a report.  Returns 1 if there was nothing to
+ * upload as its text is gone from disk; the report is dropped then, a
+ * rescan makes a new one if its core is still around.
+ */
+static int start_report(struct queue *q, struct oops *oops)
 {
-	char *newfilename = NULL;
+	curl_mimepart *part;
+	curl_mime *mime;
+	struct transfer *t;
+	char id[17], *map;
+	size_t len = 0;
 
-	fprintf(stderr, "+ successfully sent %s\n", oops->detail_filename);
-	sentcount++;
+	t = new_transfer(q);
+	if (!t) {
+		report_fail_send(q, oops);
+		return 1;
+	}
+	map = map_report(oops, &len);
+	if (!map) {
+		fprintf(stderr, "+ %s is gone, dropping it\n", oops->detail_filename);
+		forget_report(oops);
+		return 1;
+	}
+	if (oops->summary && !summary_report(map, len)) {
+		/* the full report replaced it while it waited, and is queued too */
+		fprintf(stderr, "+ summary %s superseded, dropping it\n", oops->detail_filename);
+		munmap(map, len);
+		forget_report(oops);
+		return 1;
+	}
+	/* a report found on disk may be one gdb couldn't do better than */
+	if (!oops->summary && summary_report(map, len))
+		oops->gdb_failed = 1;
+	snprintf(id, sizeof(id), "%016llx", (unsigned long long)report_id(oops->filename));
 
-	newfilename = replace_name(oops->filename, ".processed", ".submitted");
-	rename(oops->filename, newfilename);
-	free(newfilename);
+	mime = curl_mime_init(t->handle);
+	part = mime ? curl_mime_addpart(mime) : NULL;
+	if (!part || curl_mime_name(part, "crash") != CURLE_OK ||
+	    curl_mime_data_cb(part, len, readfunction, seekfunction, NULL, t) != CURLE_OK ||
+	    add_field(mime, "report-id", id) ||
+	    add_field(mime, "quality", quality(oops)) ||
+	    (fingerprint_submit && add_field(mime, "fingerprint", oops->fingerprint))) {
+		curl_mime_free(mime);
+		munmap(map, len);
+		report_fail_send(q, oops);
+		return 1;
+	}
 
-	g_mutex_lock(bt_mtx);
-	g_hash_table_remove(bt_hash, oops->filename);
-	g_mutex_unlock(bt_mtx);
-	FREE_OOPS(oops);
+	fprintf(stderr, "+ attempting to POST %s\n", oops->detail_filename);
+
+	t->oops = oops;
+	t->map = map;
+	t->map_len = len;
+	start_transfer(t, mime, len);
+
+	return 0;
 }
 
-void report_fail_send(int *failcount, struct oops *oops, struct oops *requeue_list)
+/* the url couldn't be reached at all, as opposed to refusing a report */
+static int unreachable(int result)
 {
-	fprintf(stderr, "+ requeuing %s\n", oops->detail_filename);
-	failcount++;
+	return result == CURLE_COULDNT_RESOLVE_PROXY ||
+	       result == CURLE_COULDNT_RESOLVE_HOST ||
+	       result == CURLE_COULDNT_CONNECT ||
+	       result == CURLE_OPERATION_TIMEDOUT;
+}
+
+/* start q's next POSTs, if there is anything left to send */
+static void submit_next(struct queue *q)
+{
+	struct oops *oops;
+	int i;
+
+	if (!q->offer_list && !q->work_list) {
+		if (q->inflight)
+			return;
+		if (q->sentcount)
+			syslog(LOG_INFO, "corewatcher: Successfully sent %d coredump signatures to %s", q->sentcount, submit_url[q->url]);
+		if (q->failcount)
+			syslog(LOG_INFO, "corewatcher: Failed to send %d coredump signatures to %s", q->failcount, submit_url[q->url]);
+		/* links change between rounds, learn their rtt anew */
+		for (i = q->home; i <= q->url && i < url_count; i++)
+			urls[i].base_rtt = 0;
+		q->sentcount = q->failcount = 0;
+		q->url = q->home;
+		fprintf(stderr, "+ submit queue empty, awaiting new work\n");
+		return;
+	}
+
+	if (q->url >= url_count) {
+		if (q->inflight)
+			return;
+		fprintf(stderr, "+ No urls worked, requeueing all work\n");
+		q->requeue_list = append_list(q->requeue_list,
+					      append_list(q->offer_list, q->work_list));
+		q->offer_list = q->work_list = NULL;
+		q->url = q->home;
+		return;
+	}
 
-	oops->next = requeue_list;
-	requeue_list = oops;
+	if (q->offer_list && !q->offering && have_room(q) && start_offer(q)) {
+		/* couldn't even build the offer, just send everything */
+		q->work_list = append_list(q->work_list, q->offer_list);
+		q->offer_list = NULL;
+	}
+
+	while (q->work_list && have_room(q)) {
+		oops = q->work_list;
+		q->work_list = oops->next;
+		oops->next = NULL;
+		/* one found on disk by a scan may be a summary gdb couldn't do better than */
+		if (network_metered() && !oops->summary && !oops->gdb_failed &&
+		    summary_report_at(oops->detail_filename))
+			oops->gdb_failed = 1;
+		if (network_metered() && !strcmp(quality(oops), "full")) {
+			/* kicked again once off the metered link */
+			fprintf(stderr, "+ metered network, holding %s\n", oops->detail_filename);
+			oops->next = q->requeue_list;
+			q->requeue_list = oops;
+			continue;
+		}
+		start_report(q, oops);
+	}
+	if (!q->inflight)
+		submit_next(q);
 }
 
 /*
- * Worker thread for submitting backtraces
- *
- * Picks up and sets down the bt_mtx.
+ * AIMD: widen the url's window after a good POST, halve it after a
+ * failed one or when the connection's rtt says the link is queueing.
  */
-void *submit_loop(void __unused *unused)
+static void adapt_window(struct transfer *t, int result)
 {
-	int i = 0, sentcount, failcount;
-	struct oops *oops = NULL;
-	struct oops *work_list = NULL;
-	struct oops *requeue_list = NULL;
-	int result = 0;
-	CURL *handle = NULL;
-	struct curl_httppost *post;
-	struct curl_httppost *last;
+	struct url_state *u = &urls[t->url];
+	curl_socket_t sock = CURL_SOCKET_BAD;
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	gint64 now = g_get_monotonic_time();
+	long code = 0;
+	int congested;
 
-	fprintf(stderr, "+ Begin submit_loop()\n");
+	curl_easy_getinfo(t->handle, CURLINFO_RESPONSE_CODE, &code);
+	congested = result || code == 429 || code >= 500;
 
-	if (testmode) {
-		fprintf(stderr, "+ The queue contains:\n");
-		print_queue();
-		fprintf(stderr, "+ Leaving submit_loop(), testmode\n");
-		return NULL;
+	if (curl_easy_getinfo(t->handle, CURLINFO_ACTIVESOCKET, &sock) == CURLE_OK &&
+	    sock != CURL_SOCKET_BAD &&
+	    getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 && ti.tcpi_rtt) {
+		u->srtt = u->srtt ? (7 * u->srtt + ti.tcpi_rtt) / 8 : ti.tcpi_rtt;
+		if (!u->base_rtt || ti.tcpi_rtt < u->base_rtt)
+			u->base_rtt = ti.tcpi_rtt;
+		if (u->srtt > 2 * u->base_rtt + RTT_SLACK_US)
+			congested = 1;
 	}
 
-	while (1) {
-		g_mutex_lock(bt_mtx);
-		while (!bt_list) {
-			if (requeue_list) {
-				bt_list = requeue_list;
-				requeue_list = NULL;
-				fprintf(stderr, "+ submit_loop() requeued old work, awaiting new work\n");
-			} else {
-				fprintf(stderr, "+ submit_loop() queue empty, awaiting new work\n");
-			}
-			g_cond_wait(bt_work, bt_mtx);
+	if (!congested) {
+		u->window = MIN(u->window + 1 / u->window, (double)submit_concurrency);
+	} else if (now - u->backoff > MAX((gint64)u->srtt, 100000)) {
+		/* once per round trip, however many POSTs in flight saw it */
+		u->window = MAX(u->window / 2, 1.0);
+		u->backoff = now;
+		fprintf(stderr, "+ %s congested, down to %d POSTs at a time\n",
+			submit_url[t->url], (int)u->window);
+	}
+}
+
+static void transfer_done(struct transfer *t, int result)
+{
+	struct queue *q = t->q;
+
+	adapt_window(t, result);
+
+	q->inflight--;
+	if (t->offer)
+		q->offering = 0;
+	curl_multi_remove_handle(multi, t->handle);
+	curl_mime_free(t->mime);
+	if (t->map)
+		munmap(t->map, t->map_len);
+
+	if (unreachable(result)) {
+		/* put the work back as it was and try the next url */
+		fprintf(stderr, "+ unable to contact %s\n", submit_url[t->url]);
+		if (t->offer) {
+			q->offer_list = append_list(t->oops, q->offer_list);
+		} else {
+			t->oops->next = q->work_list;
+			q->work_list = t->oops;
 		}
-		fprintf(stderr, "+ submit_loop() checking for work\n");
-		/* pull out current work and release the mutex */
-		work_list = bt_list;
-		bt_list = NULL;
-		g_mutex_unlock(bt_mtx);
-
-		/* net init */
-		handle = curl_easy_init();
-		curl_easy_setopt(handle, CURLOPT_NOBODY, 1);
-		curl_easy_setopt(handle, CURLOPT_TIMEOUT, 5);
-
-		/* try to find a good url (curl automagically will use config'd proxies */
-		for (i = 0; i < url_count; i++) {
-			sentcount = 0;
-			failcount = 0;
+		/* a queue of its own url has nowhere else to go */
+		if (t->url == q->url)
+			q->url = submit_fanout ? url_count : q->url + 1;
+	} else if (t->offer) {
+		offer_done(q, t->url, result, &t->reply, t->oops);
+	} else if (!check_reply(t->handle, result, &t->reply)) {
+		q->sentcount++;
+		report_good_send(t->oops, t->url);
+	} else {
+		report_fail_send(q, t->oops);
+	}
 
-			curl_easy_setopt(handle, CURLOPT_URL, submit_url[i]);
-			curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0L);
+	free(t->reply.text);
+	t->busy = 0;
 
-			/* check the connection before POSTing form */
-			result = curl_easy_perform(handle);
-			if (result) {
-				fprintf(stderr, "+ unable to contact %s\n", submit_url[i]);
-				continue;
-			}
-			fprintf(stderr, "+ Draining work_list to %s\n", submit_url[i]);
-
-			/* have a good url/proxy now...attempt sending all reports there */
-			while (work_list) {
-				oops = work_list;
-				work_list = oops->next;
-				oops->next = NULL;
-
-				fprintf(stderr, "+ attempting to POST %s\n", oops->detail_filename);
-
-				/* set up the POST data */
-				post = NULL;
-				last = NULL;
-				curl_formadd(&post, &last,
-					CURLFORM_COPYNAME, "crash",
-					CURLFORM_COPYCONTENTS, oops->text, CURLFORM_END);
-				curl_easy_setopt(handle, CURLOPT_HTTPPOST, post);
-				curl_easy_setopt(handle, CURLOPT_POSTREDIR, 0L);
-				curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writefunction);
-				result = curl_easy_perform(handle);
-				curl_formfree(post);
-
-				if (!result) {
-					report_good_send(&sentcount, oops);
-				} else {
-					report_fail_send(&failcount, oops, requeue_list);
-				}
-			}
+	submit_next(q);
+}
+
+/* reap finished transfers */
+static void check_transfers(void)
+{
+	CURLMsg *msg;
+	int left;
+
+	while ((msg = curl_multi_info_read(multi, &left))) {
+		struct transfer *t = NULL;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &t);
+		if (t)
+			transfer_done(t, msg->data.result);
+	}
+}
+
+static void curl_socket_ready(int fd, guint32 events, void __unused *data)
+{
+	int flags = 0, running;
+
+	if (events & EPOLLIN)
+		flags |= CURL_CSELECT_IN;
+	if (events & EPOLLOUT)
+		flags |= CURL_CSELECT_OUT;
+	if (events & (EPOLLERR | EPOLLHUP))
+		flags |= CURL_CSELECT_ERR;
+	curl_multi_socket_action(multi, fd, flags, &running);
+	check_transfers();
+}
+
+static void curl_timeout(int fd, guint32 __unused events, void __unused *data)
+{
+	int running;
+
+	event_drain(fd);
+	curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	check_transfers();
+}
+
+/* curl telling us which of its sockets to watch for what */
+static int curl_socket(CURL __unused *easy, curl_socket_t s, int what,
+		       void __unused *userp, void __unused *socketp)
+{
+	guint32 events = 0;
+
+	if (what == CURL_POLL_REMOVE) {
+		event_del(s);
+		return 0;
+	}
+	if (what & CURL_POLL_IN)
+		events |= EPOLLIN;
+	if (what & CURL_POLL_OUT)
+		events |= EPOLLOUT;
+	event_add(s, events, curl_socket_ready, NULL);
+
+	return 0;
+}
+
+static int curl_set_timer(CURLM __unused *m, long timeout_ms, void __unused *userp)
+{
+	if (timeout_ms < 0)
+		timer_arm(curl_timer, 0, 0);
+	else
+		timer_arm(curl_timer, timeout_ms ? timeout_ms : 1, 0);
 
-			if (sentcount)
-				syslog(LOG_INFO, "corewatcher: Successfully sent %d coredump signatures to %s", sentcount, submit_url[i]);
-			if (failcount)
-				syslog(LOG_INFO, "corewatcher: Failed to send %d coredump signatures to %s", failcount, submit_url[i]);
+	return 0;
+}
+
+/*
+ * curl is only set up once there is something to send, most of the time
+ * this program will not use http at all.
+ */
+static int init_curl(void)
+{
+	if (multi)
+		return 0;
 
-			break;
+	multi = curl_multi_init();
+	curl_timer = timer_new(curl_timeout, NULL);
+	if (!multi || curl_timer < 0) {
+		fprintf(stderr, "+ Unable to set up curl\n");
+		return -1;
+	}
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, curl_socket);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, curl_set_timer);
+
+	return 0;
+}
+
+/* a copy of report oops for another queue */
+static struct oops *copy_report(struct oops *oops)
+{
+	struct oops *copy;
+
+	copy = calloc(1, sizeof(struct oops));
+	if (!copy)
+		return NULL;
+	*copy = *oops;
+	copy->next = NULL;
+	copy->application = strdup(oops->application);
+	copy->filename = strdup(oops->filename);
+	copy->detail_filename = strdup(oops->detail_filename);
+	copy->text = NULL;
+	if (!copy->application || !copy->filename || !copy->detail_filename) {
+		FREE_OOPS(copy);
+		return NULL;
+	}
+
+	return copy;
+}
+
+/*
+ * submit-to=all: put a copy of every new report on the queue of each url
+ * that doesn't have it yet.  The copies share a count of the queues
+ * still holding one.
+ */
+static void fan_out(struct oops *fresh, struct oops **pending)
+{
+	struct oops *oops, *next, *copy;
+	struct core_name cn;
+	int i, want[MAX_URLS], n;
+
+	for (oops = fresh; oops; oops = next) {
+		next = oops->next;
+		oops->next = NULL;
+
+		for (i = n = 0; i < url_count; i++)
+			n += want[i] = !report_acked(oops, i);
+		if (!n) {
+			/* every url has it already, only the core's rename got lost */
+			if (!oops->summary && parse_core_name(oops->filename, &cn) == 0)
+				core_rename(&cn, CORE_SUBMITTED, NULL, 0);
+			forget_report(oops);
+			continue;
 		}
-		if (work_list) {
-			fprintf(stderr, "+ No urls worked, requeueing all work\n");
-			requeue_list = work_list;
+		oops->fanout = malloc(sizeof(int));
+		if (!oops->fanout) {
+			forget_report(oops);
+			continue;
 		}
+		*oops->fanout = n;
+		for (i = 0; i < url_count; i++) {
+			if (!want[i])
+				continue;
+			copy = --n ? copy_report(oops) : oops;
+			if (!copy) {
+				/* sent to this url next time round */
+				(*oops->fanout)--;
+				continue;
+			}
+			pending[i] = append_list(pending[i], copy);
+		}
+	}
+}
+
+/*
+ * New reports were queued, or it's time to retry the ones that failed:
+ * pick them all up and keep POSTing until everything is sent or failed.
+ */
+static void submit_wake(int fd, guint32 __unused events, void __unused *data)
+{
+	struct oops *pending[MAX_URLS] = { NULL };
+	struct oops *fresh;
+	struct queue *q;
+	int i, online;
+
+	event_drain(fd);
 
-		curl_easy_cleanup(handle);
+	if (testmode) {
+		fprintf(stderr, "+ The queue contains:\n");
+		print_queue();
+		return;
 	}
 
-	fprintf(stderr, "+ End submit_loop()\n");
+	/* new reports in the order they came, failed ones at the end */
+	fresh = oops_take_all(&bt_stack);
+	if (submit_fanout)
+		fan_out(fresh, pending);
+	else
+		pending[0] = fresh;
 
-	/* curl docs say this is not thread safe...but we never get here*/
-	curl_global_cleanup();
+	online = network_online();
+	if (!online)
+		/* netwatch.c kicks us once there is a default route again */
+		fprintf(stderr, "+ network down, holding reports\n");
+	else if (init_curl())
+		online = 0;
 
-	return NULL;
+	for (i = 0; i < queue_count; i++) {
+		q = &queues[i];
+		pending[i] = append_list(pending[i], q->requeue_list);
+		q->requeue_list = NULL;
+		if (!pending[i])
+			continue;
+		if (!online) {
+			q->requeue_list = pending[i];
+			continue;
+		}
+
+		fprintf(stderr, "+ submitter checking for work for %s\n", submit_url[q->home]);
+		if (fingerprint_submit)
+			q->offer_list = append_list(q->offer_list, pending[i]);
+		else
+			q->work_list = append_list(q->work_list, pending[i]);
+
+		submit_next(q);
+	}
 }
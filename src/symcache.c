@@ -0,0 +1,653 @@
+#define _GNU_SOURCE
+/*
+ * Copyright 2007,2012 Intel Corporation
+ *
+ * This program file is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program in a file named COPYING; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * Authors:
+ *	Arjan van de Ven <arjan@linux.intel.com>
+ *	William Douglas <william.douglas@intel.com>
+ *	Tim Pepper <timothy.c.pepper@linux.intel.com>
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * Symbol cache: the same few binaries and libraries crash over and over,
+ * so what symbolizing an address in one needs is worked out once per
+ * build and kept in symbol-cache (default /var/cache/corewatcher):
+ *   symbols/BUILDID.sym   function ranges of the build, made by a thread
+ *                         the first time one of its addresses is looked
+ *                         up (that lookup gets none) or when crash-prefetch
+ *                         sees it dumping core
+ *   gdb-index/            gdb's own index cache (see start_gdb()), which
+ *                         spares gdb building the name index of a build's
+ *                         DWARF again on every core.  It has no line tables:
+ *                         gdb still reads .debug_line of the CUs a backtrace
+ *                         goes through, and the .sym format has none either
+ * A .sym file is made to be mmap()ed and searched as it is:
+ *   struct sym_head, nsegs struct sym_seg (the PT_LOADs, to go from a file
+ *   offset to an address), nsyms struct sym_ent sorted by address, then
+ *   the names.  Native byte order, so a cache isn't shared between hosts.
+ * Symbols come from the build's debuginfo under /usr/lib/debug/.build-id
+ * if installed, else from .symtab or .dynsym of the file itself.  Being
+ * keyed by build-id, a binary replaced since it crashed is never used.
+ */
+#define SYMBOL_CACHE	"/var/cache/corewatcher"
+#define SYM_MAGIC	"CWSYM01"
+#define MAX_MAPPED	256
+#define MAX_INDEXING	4
+#define MAX_SEGS	16
+
+#if __ELF_NATIVE_CLASS == 64
+#define ELF_CLASS ELFCLASS64
+#define ELF_ST_TYPE(i) ELF64_ST_TYPE(i)
+#else
+#define ELF_CLASS ELFCLASS32
+#define ELF_ST_TYPE(i) ELF32_ST_TYPE(i)
+#endif
+
+char *symbol_cache;
+
+struct sym_head {
+	char magic[8];
+	guint32 nsegs, nsyms, strsize, pad;
+};
+
+struct sym_seg {
+	guint64 offset, vaddr, filesz;
+};
+
+struct sym_ent {
+	guint64 addr;
+	guint32 size, name;
+};
+
+/* a mapped .sym file, or a build that couldn't be indexed (map NULL) */
+struct sym_map {
+	void *map;
+	size_t size;
+};
+
+struct elf_file {
+	const char *data;
+	size_t size;
+	const ElfW(Ehdr) *ehdr;
+};
+
+static GMutex cache_mtx;
+static GHashTable *mapped = NULL;	/* build-id -> struct sym_map */
+static GHashTable *indexing = NULL;	/* build-ids a thread is indexing */
+
+/* the cache directory, NULL if the cache is off */
+static const char *cache_dir(void)
+{
+	if (!symbol_cache)
+		return SYMBOL_CACHE;
+
+	return *symbol_cache ? symbol_cache : NULL;
+}
+
+/* dir/sub, created if need be; returns 0 */
+int cache_subdir(char *buf, size_t size, const char *sub)
+{
+	const char *dir = cache_dir();
+
+	if (!dir || snprintf(buf, size, "%s/%s", dir, sub) >= (int)size)
+		return -1;
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return -1;
+	if (mkdir(buf, 0755) && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * The build-id in the notes at notes (len bytes, aligned to align) as hex
+ * into hex.  Returns 0, or -1 if there is none.
+ */
+int note_build_id(const char *notes, size_t len, size_t align, char *hex, size_t size)
+{
+	const char *p = notes, *end = notes + len;
+	size_t i;
+
+	if (align != 8)
+		align = 4;
+	while (p + sizeof(ElfW(Nhdr)) <= end) {
+		const ElfW(Nhdr) *nh = (const ElfW(Nhdr) *)p;
+		const char *name = p + sizeof(ElfW(Nhdr));
+		const unsigned char *desc = (const unsigned char *)name +
+			((nh->n_namesz + align - 1) & ~(align - 1));
+
+		p = (const char *)desc + ((nh->n_descsz + align - 1) & ~(align - 1));
+		if (p > end || p < (const char *)desc)
+			break;
+		if (nh->n_type != NT_GNU_BUILD_ID || nh->n_namesz != 4 || memcmp(name, "GNU", 4) ||
+		    !nh->n_descsz || nh->n_descsz * 2 >= size)
+			continue;
+		for (i = 0; i < nh->n_descsz; i++)
+			sprintf(hex + i * 2, "%02x", desc[i]);
+
+		return 0;
+	}
+
+	return -1;
+}
+
+/* map path as an ELF file of our class; returns 0 */
+static int open_elf(const char *path, struct elf_file *elf)
+{
+	struct stat stat_buf;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &stat_buf) || (size_t)stat_buf.st_size < sizeof(ElfW(Ehdr))) {
+		close(fd);
+		return -1;
+	}
+	elf->size = stat_buf.st_size;
+	elf->data = mmap(NULL, elf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (elf->data == MAP_FAILED)
+		return -1;
+	elf->ehdr = (const ElfW(Ehdr) *)elf->data;
+	if (memcmp(elf->ehdr->e_ident, ELFMAG, SELFMAG) ||
+	    elf->ehdr->e_ident[EI_CLASS] != ELF_CLASS ||
+	    elf->ehdr->e_phentsize != sizeof(ElfW(Phdr)) ||
+	    elf->ehdr->e_phoff > elf->size ||
+	    elf->ehdr->e_phnum > (elf->size - elf->ehdr->e_phoff) / sizeof(ElfW(Phdr)) ||
+	    (elf->ehdr->e_shnum && (elf->ehdr->e_shentsize != sizeof(ElfW(Shdr)) ||
+				    elf->ehdr->e_shoff > elf->size ||
+				    elf->ehdr->e_shnum > (elf->size - elf->ehdr->e_shoff) /
+				    sizeof(ElfW(Shdr))))) {
+		munmap((void *)elf->data, elf->size);
+		return -1;
+	}
+
+	return 0;
+}
+
+static const ElfW(Phdr) *elf_phdr(const struct elf_file *elf, int i)
+{
+	return (const ElfW(Phdr) *)(elf->data + elf->ehdr->e_phoff) + i;
+}
+
+static const ElfW(Shdr) *elf_shdr(const struct elf_file *elf, int i)
+{
+	return (const ElfW(Shdr) *)(elf->data + elf->ehdr->e_shoff) + i;
+}
+
+/* the build-id of elf into hex; returns 0 */
+static int elf_build_id(const struct elf_file *elf, char *hex, size_t size)
+{
+	int i;
+
+	for (i = 0; i < elf->ehdr->e_phnum; i++) {
+		const ElfW(Phdr) *ph = elf_phdr(elf, i);
+
+		if (ph->p_type != PT_NOTE || ph->p_offset > elf->size ||
+		    ph->p_filesz > elf->size - ph->p_offset)
+			continue;
+		if (!note_build_id(elf->data + ph->p_offset, ph->p_filesz, ph->p_align, hex, size))
+			return 0;
+	}
+
+	return -1;
+}
+
+/* is the build-id of elf build_id */
+static int elf_is_build(const struct elf_file *elf, const char *build_id)
+{
+	char hex[128];
+
+	return !elf_build_id(elf, hex, sizeof(hex)) && !strcmp(hex, build_id);
+}
+
+/* the symbol table of elf (.symtab, else .dynsym) and its strings */
+static const ElfW(Shdr) *elf_symtab(const struct elf_file *elf, const ElfW(Shdr) **strtab)
+{
+	const ElfW(Shdr) *sh, *found = NULL;
+	int i;
+
+	for (i = 0; i < elf->ehdr->e_shnum; i++) {
+		sh = elf_shdr(elf, i);
+		if ((sh->sh_type != SHT_SYMTAB && sh->sh_type != SHT_DYNSYM) ||
+		    sh->sh_entsize != sizeof(ElfW(Sym)) || sh->sh_link >= elf->ehdr->e_shnum ||
+		    sh->sh_offset > elf->size || sh->sh_size > elf->size - sh->sh_offset)
+			continue;
+		if (!found || sh->sh_type == SHT_SYMTAB)
+			found = sh;
+	}
+	if (!found)
+		return NULL;
+	*strtab = elf_shdr(elf, found->sh_link);
+	if ((*strtab)->sh_type != SHT_STRTAB || (*strtab)->sh_offset > elf->size ||
+	    (*strtab)->sh_size > elf->size - (*strtab)->sh_offset || !(*strtab)->sh_size)
+		return NULL;
+
+	return found;
+}
+
+static int sym_cmp(const void *a, const void *b)
+{
+	const struct sym_ent *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	/* of aliases keep the one covering most */
+	return x->size > y->size ? -1 : x->size < y->size;
+}
+
+/*
+ * Write the .sym file for build build_id of the ELF file at path to out.
+ * Returns 0.
+ */
+static int index_build(const char *path, const char *build_id, FILE *out)
+{
+	struct elf_file bin, dbg, *src;
+	const ElfW(Shdr) *symtab, *strtab = NULL;
+	struct sym_head head;
+	struct sym_seg segs[MAX_SEGS];
+	struct sym_ent *ents = NULL;
+	GString *names;
+	char dbgpath[PATH_MAX];
+	size_t i, n, count;
+	int ret = -1, have_dbg = 0;
+
+	if (open_elf(path, &bin))
+		return -1;
+	if (!elf_is_build(&bin, build_id))
+		goto out;
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, SYM_MAGIC, sizeof(head.magic));
+	for (i = 0; i < bin.ehdr->e_phnum && head.nsegs < MAX_SEGS; i++) {
+		const ElfW(Phdr) *ph = elf_phdr(&bin, i);
+
+		if (ph->p_type != PT_LOAD)
+			continue;
+		segs[head.nsegs].offset = ph->p_offset;
+		segs[head.nsegs].vaddr = ph->p_vaddr;
+		segs[head.nsegs].filesz = ph->p_filesz;
+		head.nsegs++;
+	}
+
+	/* debuginfo has the full .symtab, and the same addresses */
+	src = &bin;
+	if (snprintf(dbgpath, sizeof(dbgpath), "/usr/lib/debug/.build-id/%.2s/%s.debug",
+		     build_id, build_id + 2) < (int)sizeof(dbgpath) &&
+	    !open_elf(dbgpath, &dbg)) {
+		have_dbg = 1;
+		if (elf_is_build(&dbg, build_id) && elf_symtab(&dbg, &strtab))
+			src = &dbg;
+	}
+	symtab = elf_symtab(src, &strtab);
+
+	names = g_string_new(NULL);
+	count = symtab ? symtab->sh_size / sizeof(ElfW(Sym)) : 0;
+	if (count)
+		ents = calloc(count, sizeof(struct sym_ent));
+	for (i = 0, n = 0; ents && i < count; i++) {
+		const ElfW(Sym) *sym = (const ElfW(Sym) *)(src->data + symtab->sh_offset) + i;
+		const char *name;
+
+		if ((ELF_ST_TYPE(sym->st_info) != STT_FUNC &&
+		     ELF_ST_TYPE(sym->st_info) != STT_GNU_IFUNC) ||
+		    sym->st_shndx == SHN_UNDEF || !sym->st_value ||
+		    sym->st_name >= strtab->sh_size)
+			continue;
+		name = src->data + strtab->sh_offset + sym->st_name;
+		if (!memchr(name, '\0', strtab->sh_size - sym->st_name) || !*name)
+			continue;
+		ents[n].addr = sym->st_value;
+		ents[n].size = sym->st_size > G_MAXUINT32 ? G_MAXUINT32 : sym->st_size;
+		ents[n].name = names->len;
+		g_string_append_len(names, name, strlen(name) + 1);
+		n++;
+	}
+	if (n)
+		qsort(ents, n, sizeof(struct sym_ent), sym_cmp);
+	/* drop aliases */
+	for (i = 0, count = 0; i < n; i++)
+		if (!count || ents[i].addr != ents[count - 1].addr)
+			ents[count++] = ents[i];
+	head.nsyms = count;
+	head.strsize = names->len;
+
+	if (fwrite(&head, sizeof(head), 1, out) == 1 &&
+	    (!head.nsegs || fwrite(segs, sizeof(struct sym_seg), head.nsegs, out) == head.nsegs) &&
+	    (!count || fwrite(ents, sizeof(struct sym_ent), count, out) == count) &&
+	    (!names->len || fwrite(names->str, names->len, 1, out) == 1))
+		ret = 0;
+
+	free(ents);
+	g_string_free(names, TRUE);
+	if (have_dbg)
+		munmap((void *)dbg.data, dbg.size);
+out:
+	munmap((void *)bin.data, bin.size);
+
+	return ret;
+}
+
+/* map a .sym file; returns 0 with its size checked against its header */
+static int map_index(const char *path, struct sym_map *sm)
+{
+	const struct sym_head *head;
+	struct stat stat_buf;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &stat_buf) || (size_t)stat_buf.st_size < sizeof(struct sym_head)) {
+		close(fd);
+		return -1;
+	}
+	sm->size = stat_buf.st_size;
+	sm->map = mmap(NULL, sm->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (sm->map == MAP_FAILED) {
+		sm->map = NULL;
+		return -1;
+	}
+	head = sm->map;
+	if (memcmp(head->magic, SYM_MAGIC, sizeof(head->magic)) || head->nsegs > MAX_SEGS ||
+	    sm->size != sizeof(struct sym_head) + head->nsegs * sizeof(struct sym_seg) +
+	    (size_t)head->nsyms * sizeof(struct sym_ent) + head->strsize ||
+	    (head->strsize && ((const char *)sm->map)[sm->size - 1])) {
+		munmap(sm->map, sm->size);
+		sm->map = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void unmap_index(gpointer data)
+{
+	struct sym_map *sm = data;
+
+	if (sm->map)
+		munmap(sm->map, sm->size);
+	free(sm);
+}
+
+/* remember sm as the index of build_id; called with cache_mtx held */
+static void add_index(const char *build_id, struct sym_map *sm)
+{
+	if (g_hash_table_size(mapped) >= MAX_MAPPED)
+		g_hash_table_remove_all(mapped);
+	g_hash_table_insert(mapped, strdup(build_id), sm);
+}
+
+/* the .sym file of build_id, and the temporary one it is written to; returns 0 */
+static int index_paths(const char *build_id, char *sym, char *tmp, size_t size)
+{
+	char dir[PATH_MAX];
+
+	if (cache_subdir(dir, sizeof(dir), "symbols") ||
+	    snprintf(sym, size, "%s/%s.sym", dir, build_id) >= (int)size ||
+	    snprintf(tmp, size, "%s/.%s.tmp", dir, build_id) >= (int)size)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * The index of build build_id if it is mapped or in the cache already,
+ * else NULL.  Only maps an existing .sym file, which is cheap enough for
+ * the event loop.  Called with cache_mtx held.
+ */
+static struct sym_map *find_index(const char *build_id)
+{
+	struct sym_map *sm;
+	char sym[PATH_MAX], tmp[PATH_MAX];
+
+	if (!mapped) {
+		mapped = g_hash_table_new_full(g_str_hash, g_str_equal, free, unmap_index);
+		indexing = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	}
+	sm = g_hash_table_lookup(mapped, build_id);
+	if (sm || g_hash_table_contains(indexing, build_id) ||
+	    index_paths(build_id, sym, tmp, sizeof(sym)))
+		return sm;
+	sm = calloc(1, sizeof(struct sym_map));
+	if (!sm)
+		return NULL;
+	if (map_index(sym, sm)) {
+		free(sm);
+		return NULL;
+	}
+	add_index(build_id, sm);
+
+	return sm;
+}
+
+/*
+ * Index build build_id from the ELF file at path (known as name), which
+ * the caller has put in indexing.  Reads the whole ELF file and writes
+ * the .sym file, so never runs on the event loop, and holds cache_mtx
+ * only to add the result.
+ */
+static void make_index(const char *path, const char *name, const char *build_id)
+{
+	struct sym_map *sm;
+	char sym[PATH_MAX], tmp[PATH_MAX];
+	FILE *out;
+	int fd, ret;
+
+	sm = calloc(1, sizeof(struct sym_map));
+	if (sm && !index_paths(build_id, sym, tmp, sizeof(sym))) {
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		out = fd >= 0 ? fdopen(fd, "w") : NULL;
+		if (out) {
+			ret = index_build(path, build_id, out);
+			if (fflush(out) || fsync(fd))
+				ret = -1;
+			if (fclose(out))
+				ret = -1;
+			if (ret || rename(tmp, sym)) {
+				unlink(tmp);
+			} else {
+				fprintf(stderr, "+ Indexed symbols of %s (%s)\n", name, build_id);
+				map_index(sym, sm);
+			}
+		} else if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+	}
+
+	g_mutex_lock(&cache_mtx);
+	g_hash_table_remove(indexing, build_id);
+	/* remember failures too, the file won't have changed its build */
+	if (sm)
+		add_index(build_id, sm);
+	g_mutex_unlock(&cache_mtx);
+}
+
+struct index_job {
+	char *path;
+	char *build_id;
+};
+
+static void *index_thread(void *data)
+{
+	struct index_job *job = data;
+
+	place_thread();
+	make_index(job->path, job->path, job->build_id);
+	free(job->path);
+	free(job->build_id);
+	free(job);
+
+	return NULL;
+}
+
+/*
+ * Have a thread index build build_id from the ELF file at path, for the
+ * next crash in it, unless it is being indexed already or MAX_INDEXING
+ * builds are.  Called with cache_mtx held.
+ */
+static void queue_index(const char *path, const char *build_id)
+{
+	struct index_job *job;
+	GThread *thread;
+
+	if (g_hash_table_contains(indexing, build_id) ||
+	    g_hash_table_size(indexing) >= MAX_INDEXING)
+		return;
+	job = calloc(1, sizeof(struct index_job));
+	if (!job)
+		return;
+	job->path = strdup(path);
+	job->build_id = strdup(build_id);
+	if (!job->path || !job->build_id)
+		goto err;
+	g_hash_table_add(indexing, strdup(build_id));
+	thread = g_thread_new("symcache", index_thread, job);
+	if (thread) {
+		g_thread_unref(thread);
+		return;
+	}
+	g_hash_table_remove(indexing, build_id);
+err:
+	free(job->path);
+	free(job->build_id);
+	free(job);
+}
+
+/*
+ * The function at offset into the ELF file at path, whose build-id is
+ * build_id, into name.  Returns 0, or -1 if it isn't known.  Only looks
+ * in the cache: a build not in it yet is queued to be indexed and the
+ * address is left unknown this time.
+ */
+int symbolize(const char *path, const char *build_id, guint64 offset, char *name, size_t size)
+{
+	const struct sym_head *head;
+	const struct sym_seg *segs;
+	const struct sym_ent *ents;
+	const char *names;
+	struct sym_map *sm;
+	guint64 addr = 0;
+	guint32 lo, hi, i;
+	int ret = -1;
+
+	if (!cache_dir() || !*build_id || strchr(build_id, '/'))
+		return -1;
+
+	g_mutex_lock(&cache_mtx);
+	sm = find_index(build_id);
+	if (!sm)
+		queue_index(path, build_id);
+	if (!sm || !sm->map)
+		goto out;
+
+	head = sm->map;
+	segs = (const struct sym_seg *)(head + 1);
+	ents = (const struct sym_ent *)(segs + head->nsegs);
+	names = (const char *)(ents + head->nsyms);
+	for (i = 0; i < head->nsegs; i++)
+		if (offset >= segs[i].offset && offset - segs[i].offset < segs[i].filesz) {
+			addr = segs[i].vaddr + offset - segs[i].offset;
+			break;
+		}
+	if (i == head->nsegs)
+		goto out;
+
+	/* the last function starting at or below addr */
+	lo = 0;
+	hi = head->nsyms;
+	while (lo < hi) {
+		guint32 mid = lo + (hi - lo) / 2;
+
+		if (ents[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		goto out;
+	i = lo - 1;
+	/* sizeless ones (assembly) run up to the next */
+	if (ents[i].size ? addr - ents[i].addr < ents[i].size :
+	    i + 1 == head->nsyms || addr < ents[i + 1].addr) {
+		if (ents[i].name < head->strsize &&
+		    snprintf(name, size, "%s", names + ents[i].name) < (int)size)
+			ret = 0;
+	}
+out:
+	g_mutex_unlock(&cache_mtx);
+
+	return ret;
+}
+
+/*
+ * Index the symbols of the ELF file at path (known as name) ahead of a
+ * crash in it being symbolized.  Runs on the caller's thread, never the
+ * event loop.  Returns 0 if they are in the cache.
+ */
+int prewarm_symbols(const char *path, const char *name)
+{
+	struct elf_file elf;
+	struct sym_map *sm;
+	char build_id[128];
+	int ret;
+
+	if (!cache_dir() || open_elf(path, &elf))
+		return -1;
+	ret = elf_build_id(&elf, build_id, sizeof(build_id));
+	munmap((void *)elf.data, elf.size);
+	if (ret)
+		return -1;
+
+	g_mutex_lock(&cache_mtx);
+	sm = find_index(build_id);
+	if (sm || g_hash_table_contains(indexing, build_id)) {
+		ret = sm && sm->map ? 0 : -1;
+		g_mutex_unlock(&cache_mtx);
+		return ret;
+	}
+	g_hash_table_add(indexing, strdup(build_id));
+	g_mutex_unlock(&cache_mtx);
+
+	make_index(path, name, build_id);
+
+	g_mutex_lock(&cache_mtx);
+	sm = g_hash_table_lookup(mapped, build_id);
+	ret = sm && sm->map ? 0 : -1;
+	g_mutex_unlock(&cache_mtx);
+
+	return ret;
+}
@@ -0,0 +1,641 @@
+#define _GNU_SOURCE
+/*
+ * crash-receiver.c - a minimal stand-in for a crashdb server
+ *
+ * Accepts the "crash" multipart form corewatcher POSTs (and the HEAD
+ * probe submit_loop() sends first) on a local port so submission can be
+ * exercised on a machine without network access.  Failures can be
+ * injected to exercise retry behaviour:
+ *
+ * usage: crash-receiver [-p port] [-l latency-ms] [-e error-%] [-5 5xx-%]
+ *                       [-x drop-%] [-r record-dir] [-s seed]
+ *                       [-S suppress-after]
+ *
+ *   -l  delay every response by this many milliseconds
+ *   -e  answer this share of POSTs with 200 and the "server encountered
+ *       an error" page corewatcher treats as a failure
+ *   -5  answer this share of POSTs with "500 Internal Server Error"
+ *   -x  close the connection without answering this share of POSTs
+ *   -r  write the "crash" field of every accepted POST to record-dir
+ *   -S  in fingerprint mode, ask for a fingerprint to be suppressed once
+ *       this many copies of it were reported (default: never)
+ *
+ * Fingerprint offers (submit-mode=fingerprint) are answered need-body the
+ * first time a fingerprint is seen and count-only after that.
+ *
+ * Bodies may come with a Content-Length or chunked (Transfer-Encoding:
+ * chunked, as curl sends a streamed form whose size it doesn't know).
+ *
+ * Statistics are printed on SIGUSR1 and on exit (SIGINT/SIGTERM).
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define MAX_CONNS 256
+#define MAX_REQUEST (64 * 1024 * 1024)
+
+struct conn {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t alloc;
+	size_t header_len;	/* 0 until the full header has arrived */
+	size_t body_len;	/* decoded, if chunked */
+	size_t wire_len;	/* the body as it came, 0 until all of it has */
+	int chunked;
+	int is_head;
+	int sent_continue;
+	long long respond_at;	/* ms; 0 when not waiting to respond */
+	int action;
+	char *answer;		/* text/plain reply for the fingerprint protocol */
+};
+
+enum { REPLY_OK, REPLY_ERROR_PAGE, REPLY_5XX, REPLY_DROP };
+
+static struct conn conns[MAX_CONNS];
+static int latency_ms = 0, error_pct = 0, fivexx_pct = 0, drop_pct = 0;
+static unsigned long suppress_after = 0;
+static const char *record_dir = NULL;
+
+static struct {
+	unsigned long connections;
+	unsigned long requests;
+	unsigned long posts;
+	unsigned long heads;
+	unsigned long recorded;
+	unsigned long offers;
+	unsigned long counted;
+	unsigned long suppressed;
+	unsigned long long bytes;
+	unsigned long error_pages;
+	unsigned long fivexx;
+	unsigned long drops;
+} stats;
+
+static volatile sig_atomic_t want_stats = 0, want_exit = 0;
+
+static void on_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		want_stats = 1;
+	else
+		want_exit = 1;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void print_stats(void)
+{
+	fprintf(stderr,
+		"connections %lu requests %lu (POST %lu, HEAD %lu) bytes %llu "
+		"recorded %lu offers %lu counted %lu suppressed %lu "
+		"injected: error-page %lu 5xx %lu drop %lu\n",
+		stats.connections, stats.requests, stats.posts, stats.heads,
+		stats.bytes, stats.recorded, stats.offers, stats.counted,
+		stats.suppressed, stats.error_pages, stats.fivexx, stats.drops);
+}
+
+static void close_conn(struct conn *c)
+{
+	close(c->fd);
+	free(c->buf);
+	free(c->answer);
+	memset(c, 0, sizeof(struct conn));
+	c->fd = -1;
+}
+
+static void send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = send(fd, buf, len, MSG_NOSIGNAL);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			return;
+		}
+		buf += r;
+		len -= r;
+	}
+}
+
+static const char *find_header(struct conn *c, const char *name)
+{
+	size_t nlen = strlen(name);
+	char *line = strstr(c->buf, "\r\n");
+
+	while (line && (size_t)(line - c->buf) < c->header_len) {
+		line += 2;
+		if (!strncasecmp(line, name, nlen) && line[nlen] == ':')
+			return line + nlen + 1;
+		line = strstr(line, "\r\n");
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the contents of form field name in a multipart/form-data body.
+ * Returns 0 and sets start and len if found.
+ */
+static int find_part(struct conn *c, const char *name, const char **start, size_t *len)
+{
+	const char *ctype, *b, *body = c->buf + c->header_len;
+	char boundary[256], needle[128];
+	const char *part, *s, *end;
+	size_t blen;
+
+	ctype = find_header(c, "Content-Type");
+	if (!ctype || !(b = strstr(ctype, "boundary=")))
+		return -1;
+	b += 9;
+	blen = strcspn(b, "\r\n;");
+	if (blen + 4 >= sizeof(boundary))
+		return -1;
+	boundary[0] = '-';
+	boundary[1] = '-';
+	memcpy(boundary + 2, b, blen);
+	boundary[blen + 2] = '\0';
+	blen += 2;
+
+	snprintf(needle, sizeof(needle), "name=\"%s\"", name);
+	part = memmem(body, c->body_len, needle, strlen(needle));
+	if (!part)
+		return -1;
+	s = memmem(part, c->body_len - (part - body), "\r\n\r\n", 4);
+	if (!s)
+		return -1;
+	s += 4;
+	end = memmem(s, c->body_len - (s - body), boundary, blen);
+	if (!end || end - s < 2)
+		return -1;
+	end -= 2;	/* the CRLF before the boundary belongs to the delimiter */
+
+	*start = s;
+	*len = end - s;
+	return 0;
+}
+
+/* write the "crash" field to the record directory */
+static void record_body(struct conn *c)
+{
+	const char *start;
+	char *path = NULL;
+	size_t len;
+	FILE *file;
+
+	if (find_part(c, "crash", &start, &len))
+		return;
+
+	if (asprintf(&path, "%s/%06lu.txt", record_dir, stats.recorded) == -1)
+		return;
+	file = fopen(path, "w");
+	free(path);
+	if (!file)
+		return;
+	if (fwrite(start, 1, len, file) == len)
+		stats.recorded++;
+	fclose(file);
+}
+
+/*
+ * Fingerprint first protocol: remember how often every fingerprint was
+ * reported so an offer can be answered with need-body (first copy),
+ * count-only (later copies) or suppress (more than suppress_after copies).
+ */
+#define FP_SLOTS 65536
+
+static struct {
+	char fp[64];
+	unsigned long count;
+} seen[FP_SLOTS];
+
+static unsigned long *seen_count(const char *fp, size_t len)
+{
+	unsigned long h = 5381;
+	size_t i;
+
+	if (len >= sizeof(seen[0].fp))
+		len = sizeof(seen[0].fp) - 1;
+	for (i = 0; i < len; i++)
+		h = h * 33 + (unsigned char)fp[i];
+	for (i = 0; i < FP_SLOTS; i++) {
+		unsigned long slot = (h + i) % FP_SLOTS;
+
+		if (!seen[slot].fp[0]) {
+			memcpy(seen[slot].fp, fp, len);
+			seen[slot].fp[len] = '\0';
+		}
+		if (!strncmp(seen[slot].fp, fp, len) && !seen[slot].fp[len])
+			return &seen[slot].count;
+	}
+
+	return NULL;
+}
+
+static char *answer_offer(const char *offer, size_t len)
+{
+	char *answer = NULL, *n;
+	size_t alen = 0;
+	const char *line = offer, *end = offer + len;
+
+	while (line < end) {
+		const char *eol = memchr(line, '\n', end - line);
+		size_t fplen = strcspn(line, " \n");
+		unsigned long *count;
+		char decision[128];
+		int dlen;
+
+		if (!eol)
+			eol = end;
+		if (fplen > (size_t)(eol - line))
+			fplen = eol - line;
+		if (fplen >= sizeof(seen[0].fp))
+			fplen = sizeof(seen[0].fp) - 1;
+		count = fplen ? seen_count(line, fplen) : NULL;
+		if (count) {
+			if (suppress_after && *count >= suppress_after) {
+				dlen = snprintf(decision, sizeof(decision), "%.*s suppress 24\n", (int)fplen, line);
+				stats.suppressed++;
+			} else if (*count) {
+				dlen = snprintf(decision, sizeof(decision), "%.*s count-only\n", (int)fplen, line);
+				(*count)++;
+				stats.counted++;
+			} else {
+				dlen = snprintf(decision, sizeof(decision), "%.*s need-body\n", (int)fplen, line);
+			}
+			n = realloc(answer, alen + dlen + 1);
+			if (!n)
+				break;
+			answer = n;
+			memcpy(answer + alen, decision, dlen + 1);
+			alen += dlen;
+		}
+		line = eol + 1;
+	}
+
+	return answer ? answer : strdup("");
+}
+
+static int roll(int pct)
+{
+	return pct > 0 && (rand() % 100) < pct;
+}
+
+static void respond(struct conn *c)
+{
+	static const char ok_page[] = "<html><body>Thank you for your crash report</body></html>\n";
+	static const char error_page[] = "<html><body>Sorry, the server encountered an error</body></html>\n";
+	static const char fivexx_page[] = "<html><body>Internal Server Error</body></html>\n";
+	const char *status = "200 OK", *page = ok_page;
+	char header[256];
+	size_t consumed = c->header_len + c->wire_len;
+	int n;
+
+	switch (c->action) {
+	case REPLY_DROP:
+		close_conn(c);
+		return;
+	case REPLY_ERROR_PAGE:
+		page = c->answer ? "error injected\n" : error_page;
+		break;
+	case REPLY_5XX:
+		status = "500 Internal Server Error";
+		page = fivexx_page;
+		break;
+	default:
+		if (c->answer)
+			page = c->answer;
+		break;
+	}
+
+	n = snprintf(header, sizeof(header),
+		     "HTTP/1.1 %s\r\n"
+		     "Content-Type: %s\r\n"
+		     "Content-Length: %zu\r\n"
+		     "\r\n", status, c->answer ? "text/plain" : "text/html",
+		     strlen(page));
+	send_all(c->fd, header, n);
+	if (!c->is_head)
+		send_all(c->fd, page, strlen(page));
+
+	/* keep the connection for the next request, shifting out this one */
+	memmove(c->buf, c->buf + consumed, c->len - consumed);
+	c->len -= consumed;
+	c->buf[c->len] = '\0';
+	c->header_len = 0;
+	c->body_len = 0;
+	c->wire_len = 0;
+	c->chunked = 0;
+	c->is_head = 0;
+	c->sent_continue = 0;
+	c->respond_at = 0;
+	free(c->answer);
+	c->answer = NULL;
+}
+
+/*
+ * The length of the chunked body after the header if all of it has
+ * arrived, else 0.  With decode, the chunks' data is also moved
+ * together to the start of the body and body_len set to its length.
+ */
+static size_t chunked_len(struct conn *c, int decode)
+{
+	char *body = c->buf + c->header_len, *end = c->buf + c->len;
+	char *p = body, *out = body, *eol;
+	unsigned long size;
+
+	while (1) {
+		eol = memmem(p, end - p, "\r\n", 2);
+		if (!eol)
+			return 0;
+		/* chunk extensions after ';' are left to strtoul() to stop at */
+		size = strtoul(p, NULL, 16);
+		p = eol + 2;
+		if (!size)
+			break;
+		if (size > (size_t)(end - p) || (size_t)(end - p) - size < 2)
+			return 0;
+		if (decode)
+			memmove(out, p, size);
+		out += size;
+		p += size + 2;
+	}
+	/* trailer fields, up to an empty line */
+	while (1) {
+		eol = memmem(p, end - p, "\r\n", 2);
+		if (!eol)
+			return 0;
+		if (eol == p)
+			break;
+		p = eol + 2;
+	}
+	if (decode)
+		c->body_len = out - body;
+
+	return p + 2 - body;
+}
+
+/* returns 1 once a complete request is buffered */
+static int request_complete(struct conn *c)
+{
+	const char *cl, *te, *expect;
+	char *eoh;
+
+	if (!c->header_len) {
+		eoh = strstr(c->buf, "\r\n\r\n");
+		if (!eoh)
+			return 0;
+		c->header_len = eoh - c->buf + 4;
+		c->is_head = !strncmp(c->buf, "HEAD ", 5);
+		cl = find_header(c, "Content-Length");
+		c->body_len = cl ? strtoul(cl, NULL, 10) : 0;
+		te = find_header(c, "Transfer-Encoding");
+		c->chunked = te && strstr(te, "chunked");
+		expect = find_header(c, "Expect");
+		if (expect && strstr(expect, "100-continue") && !c->sent_continue) {
+			send_all(c->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+			c->sent_continue = 1;
+		}
+	}
+	if (c->wire_len)
+		return 1;
+
+	if (c->chunked) {
+		c->wire_len = chunked_len(c, 0);
+		if (c->wire_len)
+			chunked_len(c, 1);
+		return c->wire_len != 0;
+	}
+	if (c->len < c->header_len + c->body_len)
+		return 0;
+	c->wire_len = c->body_len;
+
+	return 1;
+}
+
+static void answer_post(struct conn *c)
+{
+	const char *part;
+	size_t len;
+
+	if (!find_part(c, "fingerprints", &part, &len)) {
+		stats.offers++;
+		if (c->action == REPLY_OK)
+			c->answer = answer_offer(part, len);
+		else
+			c->answer = strdup("");
+		return;
+	}
+
+	if (c->action != REPLY_OK)
+		return;
+	if (record_dir)
+		record_body(c);
+	if (!find_part(c, "fingerprint", &part, &len)) {
+		unsigned long *count = seen_count(part, len);
+
+		if (count)
+			(*count)++;
+		c->answer = strdup("ok\n");
+	}
+}
+
+static void handle_request(struct conn *c)
+{
+	stats.requests++;
+	c->action = REPLY_OK;
+
+	if (c->is_head) {
+		stats.heads++;
+	} else {
+		stats.posts++;
+		stats.bytes += c->body_len;
+		if (roll(drop_pct)) {
+			c->action = REPLY_DROP;
+			stats.drops++;
+		} else if (roll(fivexx_pct)) {
+			c->action = REPLY_5XX;
+			stats.fivexx++;
+		} else if (roll(error_pct)) {
+			c->action = REPLY_ERROR_PAGE;
+			stats.error_pages++;
+		}
+		answer_post(c);
+	}
+
+	c->respond_at = now_ms() + latency_ms;
+}
+
+static void read_conn(struct conn *c)
+{
+	ssize_t r;
+
+	if (c->alloc - c->len < 65536) {
+		char *n;
+
+		if (c->alloc >= MAX_REQUEST) {
+			close_conn(c);
+			return;
+		}
+		c->alloc = c->alloc ? c->alloc * 2 : 65536;
+		n = realloc(c->buf, c->alloc + 1);
+		if (!n) {
+			close_conn(c);
+			return;
+		}
+		c->buf = n;
+	}
+
+	r = recv(c->fd, c->buf + c->len, c->alloc - c->len, 0);
+	if (r <= 0) {
+		if (r < 0 && (errno == EINTR || errno == EAGAIN))
+			return;
+		close_conn(c);
+		return;
+	}
+	c->len += r;
+	c->buf[c->len] = '\0';
+
+	if (!c->respond_at && request_complete(c))
+		handle_request(c);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	struct pollfd pfds[MAX_CONNS + 1];
+	struct sigaction sa;
+	int port = 8080, lfd, c, i, one = 1;
+	unsigned int seed = 1;
+
+	while ((c = getopt(argc, argv, "p:l:e:5:x:r:s:S:")) != -1) {
+		switch (c) {
+		case 'p': port = atoi(optarg); break;
+		case 'l': latency_ms = atoi(optarg); break;
+		case 'e': error_pct = atoi(optarg); break;
+		case '5': fivexx_pct = atoi(optarg); break;
+		case 'x': drop_pct = atoi(optarg); break;
+		case 'r': record_dir = optarg; break;
+		case 's': seed = strtoul(optarg, NULL, 10); break;
+		case 'S': suppress_after = strtoul(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [-p port] [-l latency-ms] [-e error-%%] "
+				"[-5 5xx-%%] [-x drop-%%] [-r record-dir] [-s seed] "
+				"[-S suppress-after]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	srand(seed);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (lfd < 0) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(lfd, 128)) {
+		perror("bind/listen");
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "crash-receiver listening on http://127.0.0.1:%d/\n", port);
+
+	for (i = 0; i < MAX_CONNS; i++)
+		conns[i].fd = -1;
+
+	while (!want_exit) {
+		long long next = -1, now = now_ms();
+		int nfds = 1, timeout = -1;
+
+		if (want_stats) {
+			print_stats();
+			want_stats = 0;
+		}
+
+		/* answer everything whose injected latency has expired */
+		for (i = 0; i < MAX_CONNS; i++) {
+			struct conn *cn = &conns[i];
+
+			if (cn->fd < 0 || !cn->respond_at)
+				continue;
+			if (cn->respond_at <= now) {
+				respond(cn);
+				/* a pipelined request may already be buffered */
+				if (cn->fd >= 0 && cn->len && request_complete(cn))
+					handle_request(cn);
+			}
+			if (cn->fd >= 0 && cn->respond_at && (next < 0 || cn->respond_at < next))
+				next = cn->respond_at;
+		}
+		if (next >= 0)
+			timeout = next > now ? (int)(next - now) : 0;
+
+		pfds[0].fd = lfd;
+		pfds[0].events = POLLIN;
+		for (i = 0; i < MAX_CONNS; i++) {
+			pfds[nfds].fd = conns[i].fd;
+			pfds[nfds].events = conns[i].respond_at ? 0 : POLLIN;
+			nfds++;
+		}
+
+		if (poll(pfds, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+
+			if (fd >= 0) {
+				for (i = 0; i < MAX_CONNS && conns[i].fd >= 0; i++)
+					;
+				if (i == MAX_CONNS) {
+					close(fd);
+				} else {
+					conns[i].fd = fd;
+					stats.connections++;
+				}
+			}
+		}
+
+		for (i = 0; i < MAX_CONNS; i++) {
+			if (pfds[i + 1].fd < 0 || !pfds[i + 1].revents)
+				continue;
+			if (pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+				read_conn(&conns[i]);
+		}
+	}
+
+	print_stats();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+/*
+ * crasher.c - a program that crashes with a configurable shape so the
+ *             cost of analyzing its core can be measured (see scaling.sh)
+ *
+ * usage: crasher [-m heap-MB] [-t threads] [-d stack-depth] [-l libdir]
+ *
+ *   -m  map this many MB of anonymous memory and touch one page per MB,
+ *       giving a large but sparse core
+ *   -t  start this many extra threads, all parked when the crash happens
+ *   -d  recurse this deep before dereferencing NULL
+ *   -l  dlopen() every lib*.so found in this directory first
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+static pthread_barrier_t started;
+
+static void *parked(void __attribute__((unused)) *arg)
+{
+	pthread_barrier_wait(&started);
+	while (1)
+		pause();
+	return NULL;
+}
+
+static int load_libs(const char *libdir)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char *path;
+	int count = 0;
+
+	dir = opendir(libdir);
+	if (!dir) {
+		perror(libdir);
+		return -1;
+	}
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, "lib", 3) || !strstr(entry->d_name, ".so"))
+			continue;
+		if (asprintf(&path, "%s/%s", libdir, entry->d_name) == -1)
+			break;
+		if (dlopen(path, RTLD_NOW | RTLD_LOCAL))
+			count++;
+		else
+			fprintf(stderr, "%s\n", dlerror());
+		free(path);
+	}
+	closedir(dir);
+
+	return count;
+}
+
+static void touch_heap(unsigned long mb)
+{
+	char *heap;
+	unsigned long i;
+
+	heap = mmap(NULL, mb << 20, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (heap == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < mb; i++)
+		heap[i << 20] = (char)i;
+}
+
+/* noinline and the volatile use keep every level as a real stack frame */
+static int __attribute__((noinline)) recurse(int depth)
+{
+	volatile int frame = depth;
+	int *ptr = NULL;
+
+	if (depth <= 0) {
+		/* NULL ptr dereference */
+		*ptr = frame;
+		return 0;
+	}
+
+	return recurse(depth - 1) + frame;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long heap_mb = 0;
+	int threads = 0, depth = 0, i, c;
+	const char *libdir = NULL;
+	pthread_t tid;
+
+	while ((c = getopt(argc, argv, "m:t:d:l:")) != -1) {
+		switch (c) {
+		case 'm':
+			heap_mb = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'l':
+			libdir = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m heap-MB] [-t threads] [-d stack-depth] [-l libdir]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (libdir && load_libs(libdir) < 0)
+		return EXIT_FAILURE;
+
+	if (heap_mb)
+		touch_heap(heap_mb);
+
+	if (threads > 0) {
+		pthread_attr_t attr;
+
+		pthread_barrier_init(&started, NULL, threads + 1);
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, 64 * 1024);
+		for (i = 0; i < threads; i++) {
+			if (pthread_create(&tid, &attr, parked, NULL)) {
+				fprintf(stderr, "only started %d threads\n", i);
+				return EXIT_FAILURE;
+			}
+		}
+		pthread_barrier_wait(&started);
+	}
+
+	return recurse(depth);
+}
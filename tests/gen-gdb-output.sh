@@ -0,0 +1,65 @@
+#!/bin/bash
+#
+# Generate large synthetic gdb transcripts for parse-bench.  These are too
+# big to keep in git but mimic what gdb prints for the shapes of crash that
+# hurt the report parser the most:
+#   huge-maps.txt       a process with tens of thousands of shared objects
+#   deep-recursion.txt  a stack overflow with a very deep backtrace
+#   many-threads.txt    a core with thousands of threads
+#
+# usage: gen-gdb-output.sh [outdir]
+
+outdir=${1:-gdb-output/generated}
+mkdir -p "$outdir"
+
+awk -v libs=20000 'BEGIN {
+	print "[New LWP 9001]"
+	print "Core was generated by `/usr/bin/plugin-host'\''."
+	print "Program terminated with signal SIGSEGV, Segmentation fault."
+	print "#0  0x00007f0000001000 in plugin_run () from /usr/lib64/plugins/libplugin0.so"
+	print "#0  0x00007f0000001000 in plugin_run () from /usr/lib64/plugins/libplugin0.so"
+	print "#1  0x0000000000401a2b in main ()"
+	print "From                To                  Syms Read   Shared Object Library"
+	for (i = 0; i < libs; i++)
+		printf "0x00007f%010x  0x00007f%010x  Yes (*)     /usr/lib64/plugins/libplugin%d.so\n", i * 65536, i * 65536 + 40000, i
+	print "(*): Shared library is missing debugging information."
+}' > "$outdir/huge-maps.txt"
+
+awk -v depth=100000 'BEGIN {
+	print "[New LWP 9002]"
+	print "Core was generated by `/usr/bin/recurse'\''."
+	print "Program terminated with signal SIGSEGV, Segmentation fault."
+	print "#0  0x0000000000401136 in recurse (n=100000) at recurse.c:5"
+	print "5\t\treturn recurse(n + 1) + 1;"
+	for (i = 0; i < depth; i++) {
+		printf "#%d  0x0000000000401136 in recurse (n=%d) at recurse.c:5\n", i, depth - i
+		print "        buf = \"\\000\\000\\000\\000\\000\\000\\000\""
+	}
+	print "From                To                  Syms Read   Shared Object Library"
+	print "0x00007ffff7fc5090  0x00007ffff7fee335  Yes         /lib64/ld-linux-x86-64.so.2"
+	print "0x00007ffff7dd4700  0x00007ffff7f6693d  Yes         /lib64/libc.so.6"
+}' > "$outdir/deep-recursion.txt"
+
+awk -v threads=10000 'BEGIN {
+	for (i = 0; i < threads; i++)
+		printf "[New LWP %d]\n", 20000 + i
+	print "[Thread debugging using libthread_db enabled]"
+	print "Using host libthread_db library \"/lib64/libthread_db.so.1\"."
+	print "Core was generated by `/usr/bin/threadpool'\''."
+	print "Program terminated with signal SIGABRT, Aborted."
+	print "#0  0x00007ffff7e2a83c in __pthread_kill_implementation () from /lib64/libc.so.6"
+	print "[Current thread is 1 (Thread 0x7ffff7d8a740 (LWP 20000))]"
+	print "#0  0x00007ffff7e2a83c in __pthread_kill_implementation () from /lib64/libc.so.6"
+	print "No symbol table info available."
+	print "#1  0x00007ffff7dd8668 in raise () from /lib64/libc.so.6"
+	print "No symbol table info available."
+	print "#2  0x00007ffff7dc04b8 in abort () from /lib64/libc.so.6"
+	print "No symbol table info available."
+	print "#3  0x0000000000401a2b in worker (arg=0x0) at threadpool.c:41"
+	print "        id = 17"
+	print "From                To                  Syms Read   Shared Object Library"
+	print "0x00007ffff7fc5090  0x00007ffff7fee335  Yes         /lib64/ld-linux-x86-64.so.2"
+	print "0x00007ffff7dd4700  0x00007ffff7f6693d  Yes         /lib64/libc.so.6"
+}' > "$outdir/many-threads.txt"
+
+ls -l "$outdir"
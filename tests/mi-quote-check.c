@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+/*
+ * mi-quote-check.c - check that names quoted into gdb/MI commands stay
+ *                    one argument of one command
+ *
+ * Core names carry the comm of the crashed process, which prctl() lets
+ * it set to anything, newlines included.  Each name below is quoted the
+ * way gdbmi.c puts it in a command, must come out with no control
+ * characters (gdb would end the command there and run the rest of the
+ * line as a command of its own) and must unquote back to the name.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+static const char *names[] = {
+	"/var/lib/corewatcher/core_crasher.1234.1500000000.to-process",
+	"/var/lib/corewatcher/core_a\nshell /t/x;#.1234.1500000000.to-process",
+	"/var/lib/corewatcher/core_a\r\nshell /t/x.1234.1500000000.to-process",
+	"/var/lib/corewatcher/core_\"quoted\\\".1234.1500000000.to-process",
+	"/var/lib/corewatcher/core_\t\033\177\001x.1234.1500000000.to-process",
+	"/var/lib/corewatcher/core_caf\xc3\xa9.1234.1500000000.to-process",
+};
+
+int main(void)
+{
+	const char *p, *c;
+	GString *cmd;
+	char *back;
+	size_t i;
+	int rc = EXIT_SUCCESS;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		cmd = g_string_new(NULL);
+		mi_quote(cmd, names[i]);
+		for (c = cmd->str; *c; c++)
+			if ((unsigned char)*c < 0x20 || *c == 0x7f)
+				break;
+		if (*c) {
+			printf("FAIL: name %zu quoted with a raw 0x%02x\n", i, (unsigned char)*c);
+			rc = EXIT_FAILURE;
+		}
+		p = cmd->str;
+		back = mi_unquote(&p);
+		if (strcmp(back, names[i]) || *p) {
+			printf("FAIL: name %zu doesn't unquote to itself: %s\n", i, cmd->str);
+			rc = EXIT_FAILURE;
+		}
+		free(back);
+		g_string_free(cmd, TRUE);
+	}
+
+	return rc;
+}
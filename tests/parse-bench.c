@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+/*
+ * parse-bench.c - measure parse_gdb_output() offline against recorded
+ *                 gdb transcripts (see gdb-output/ and gen-gdb-output.sh)
+ *
+ * usage: parse-bench [-n iterations] transcript...
+ *
+ * For every transcript the parser is run repeatedly over the same buffer
+ * and the throughput (MB/s of gdb output consumed) and the number of heap
+ * allocations made per report are printed.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+/*
+ * Count allocations by interposing the malloc family and handing the real
+ * work to glibc's internal entry points.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocs = 0;
+
+void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+static char *read_file(const char *name, size_t *len)
+{
+	FILE *file;
+	char *buf = NULL;
+	long size;
+
+	file = fopen(name, "r");
+	if (!file)
+		return NULL;
+	if (fseek(file, 0L, SEEK_END) == -1 || (size = ftell(file)) == -1 ||
+	    fseek(file, 0L, SEEK_SET) == -1)
+		goto out;
+	buf = malloc(size + 1);
+	if (!buf)
+		goto out;
+	*len = fread(buf, 1, size, file);
+	buf[*len] = '\0';
+out:
+	fclose(file);
+	return buf;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = 200;
+	int c, i, ret = EXIT_SUCCESS;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] transcript...\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc || iterations <= 0) {
+		fprintf(stderr, "usage: %s [-n iterations] transcript...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	printf("%-32s %10s %8s %8s %10s %12s\n",
+	       "transcript", "bytes", "frames", "libs", "MB/s", "allocs/rpt");
+
+	for (; optind < argc; optind++) {
+		struct gdb_summary summary;
+		const char *name = argv[optind];
+		unsigned long before;
+		double start, elapsed;
+		char *buf;
+		size_t len = 0;
+		int r = 0, frames = 0, libs = 0;
+
+		buf = read_file(name, &len);
+		if (!buf) {
+			fprintf(stderr, "%s: %s\n", name, strerror(errno));
+			ret = EXIT_FAILURE;
+			continue;
+		}
+
+		before = allocs;
+		start = now();
+		for (i = 0; i < iterations; i++) {
+			r = parse_gdb_output(buf, len, &summary);
+			if (r)
+				break;
+			frames = summary.backtrace.lines;
+			libs = summary.maps.lines;
+			free_gdb_summary(&summary);
+		}
+		elapsed = now() - start;
+
+		if (r == -EINVAL) {
+			printf("%-32s %10zu %8s %8s %10s %12s\n", name, len,
+			       "-", "-", "mismatch", "-");
+		} else if (r) {
+			printf("%-32s parse failed: %s\n", name, strerror(-r));
+			ret = EXIT_FAILURE;
+		} else {
+			printf("%-32s %10zu %8d %8d %10.1f %12.1f\n", name, len,
+			       frames, libs,
+			       (double)len * iterations / (1024 * 1024) / elapsed,
+			       (double)(allocs - before) / iterations);
+		}
+		free(buf);
+	}
+
+	return ret;
+}
@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+/*
+ * parse-check.c - run parse_gdb_output() over a recorded gdb transcript
+ *                 and print the sections it made (see parse-check.sh)
+ *
+ * usage: parse-check transcript
+ *
+ * The backtrace and maps sections are printed the way a report has them.
+ * Exits 0 if the transcript parsed, 2 if the parser said the core does
+ * not match its executable (-EINVAL) and 1 on any other failure.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+static char *read_file(const char *name, size_t *len)
+{
+	FILE *file;
+	char *buf = NULL;
+	long size;
+
+	file = fopen(name, "r");
+	if (!file)
+		return NULL;
+	if (fseek(file, 0L, SEEK_END) == -1 || (size = ftell(file)) == -1 ||
+	    fseek(file, 0L, SEEK_SET) == -1)
+		goto out;
+	buf = malloc(size + 1);
+	if (!buf)
+		goto out;
+	*len = fread(buf, 1, size, file);
+	buf[*len] = '\0';
+out:
+	fclose(file);
+	return buf;
+}
+
+int main(int argc, char **argv)
+{
+	struct gdb_summary summary;
+	size_t len = 0;
+	char *buf;
+	int r;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s transcript\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	buf = read_file(argv[1], &len);
+	if (!buf) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	r = parse_gdb_output(buf, len, &summary);
+	free(buf);
+	if (r == -EINVAL)
+		return 2;
+	if (r) {
+		fprintf(stderr, "%s: parse failed: %s\n", argv[1], strerror(-r));
+		return EXIT_FAILURE;
+	}
+
+	printf("backtrace: |\n%s", summary.backtrace.text ? summary.backtrace.text : "");
+	printf("maps: |\n%s", summary.maps.text ? summary.maps.text : "");
+	free_gdb_summary(&summary);
+
+	return EXIT_SUCCESS;
+}
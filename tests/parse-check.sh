@@ -0,0 +1,27 @@
+#!/bin/bash
+#
+# Check parse_gdb_output() against the recorded gdb transcripts: each
+# gdb-output/NAME.txt must parse into the sections in NAME.expected, and
+# mismatch.txt, where gdb warns the core is not of the executable, must
+# be refused.
+
+set -o pipefail
+
+dir=${srcdir:-.}/gdb-output
+rc=0
+
+for expected in "$dir"/*.expected; do
+	transcript=${expected%.expected}.txt
+	if ! ./parse-check "$transcript" | diff -u "$expected" -; then
+		echo "FAIL: $transcript"
+		rc=1
+	fi
+done
+
+./parse-check "$dir/mismatch.txt" > /dev/null
+if [ $? -ne 2 ]; then
+	echo "FAIL: $dir/mismatch.txt was not refused"
+	rc=1
+fi
+
+exit $rc
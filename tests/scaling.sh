@@ -0,0 +1,98 @@
+#!/bin/bash
+#
+# Drive crasher/crasher-stripped along one axis at a time and record how
+# the cost of analyzing each core scales.  For every core this runs the
+# same gdb command line extract_core() uses, then feeds gdb's output to
+# parse-bench, and prints one CSV row:
+#
+#   axis,value,binary,core_bytes,core_disk_kb,gdb_seconds,gdb_maxrss_kb,gdb_output_bytes,parse_mb_s
+#
+# usage: scaling.sh [axis...]   axes: heap threads depth libs (default: all)
+#
+# Needs sudo to point /proc/sys/kernel/core_pattern at a scratch directory
+# (restored on exit), and the check programs built ("make check").
+
+cd "$(dirname "$0")" || exit 1
+
+HEAP_MB=${HEAP_MB:-"1 64 1024 8192 32768"}
+THREADS=${THREADS:-"1 10 100 1000 10000"}
+DEPTHS=${DEPTHS:-"10 1000 10000 100000"}
+LIBS=${LIBS:-"1 10 100 1000"}
+GDB_COMMAND=${GDB_COMMAND:-../gdb.command}
+
+work=$(mktemp -d /tmp/corewatcher-scaling.XXXXXX)
+original_core_pattern=$(cat /proc/sys/kernel/core_pattern)
+
+cleanup() {
+	echo "$original_core_pattern" | sudo tee /proc/sys/kernel/core_pattern > /dev/null
+	rm -rf "$work"
+}
+trap cleanup EXIT
+
+echo "$work/core" | sudo tee /proc/sys/kernel/core_pattern > /dev/null
+ulimit -c unlimited
+ulimit -s unlimited
+
+# build N trivial shared objects into $work/libs-N for the "libs" axis,
+# once for both binaries; returns non-zero if any fails to build
+make_libs() {
+	local dir=$work/libs-$1 i
+
+	[ -e "$dir/.built" ] && return 0
+	mkdir -p "$dir" || return 1
+	for ((i = 0; i < $1; i++)); do
+		echo "int crasher_lib_$i(int x) { return x + $i; }" > "$dir/lib$i.c"
+		${CC:-cc} -shared -fPIC -o "$dir/libcrasher$i.so" "$dir/lib$i.c" || return 1
+		rm -f "$dir/lib$i.c"
+	done
+	touch "$dir/.built"
+}
+
+measure() {
+	local axis=$1 value=$2 binary=$3 core stats
+	shift 3
+
+	rm -f "$work"/core*
+	"./$binary" "$@" 2> /dev/null
+	core=$(ls "$work"/core* 2> /dev/null | head -1)
+	if [ -z "$core" ]; then
+		echo "$axis,$value,$binary,no core,,,,,"
+		return
+	fi
+
+	stats=$( { /usr/bin/time -f "%e,%M" \
+		env LANG=C gdb --batch -f "./$binary" "$core" -x "$GDB_COMMAND" \
+		> "$work/gdb.out" 2>&1; } 2>&1 | tail -1)
+
+	parse=$(./parse-bench -n 5 "$work/gdb.out" | awk 'NR == 2 { print $5 }')
+
+	echo "$axis,$value,$binary,$(stat -c %s "$core"),$(du -k "$core" | cut -f1),$stats,$(stat -c %s "$work/gdb.out"),$parse"
+	rm -f "$core"
+}
+
+axes=${*:-heap threads depth libs}
+
+echo "axis,value,binary,core_bytes,core_disk_kb,gdb_seconds,gdb_maxrss_kb,gdb_output_bytes,parse_mb_s"
+for axis in $axes; do
+	for binary in crasher crasher-stripped; do
+		case $axis in
+		heap)
+			for v in $HEAP_MB; do measure heap "$v" $binary -m "$v"; done ;;
+		threads)
+			for v in $THREADS; do measure threads "$v" $binary -t "$v"; done ;;
+		depth)
+			for v in $DEPTHS; do measure depth "$v" $binary -d "$v"; done ;;
+		libs)
+			for v in $LIBS; do
+				if ! make_libs "$v"; then
+					echo "unable to build $v libraries" >&2
+					exit 1
+				fi
+				measure libs "$v" $binary -l "$work/libs-$v"
+			done ;;
+		*)
+			echo "unknown axis $axis" >&2
+			exit 1 ;;
+		esac
+	done
+done
@@ -0,0 +1,480 @@
+#define _GNU_SOURCE
+/*
+ * submit-load.c - replay a processed_folder's *.txt reports at a fixed
+ *                 rate the way submit_loop() posts them
+ *
+ * usage: submit-load -u url [-r reports/s] [-n total] [-R rounds] [-F] [-f] [-c]
+ *                    processed_folder
+ *
+ *   -r  target submission rate (default: as fast as possible)
+ *   -n  stop after this many reports, cycling through the folder
+ *       (default: one pass over the folder)
+ *   -R  like corewatcher requeues a report whose POST failed for its next
+ *       round, retry the failed ones in up to this many further rounds
+ *       (default: 0, a failed POST is only counted)
+ *   -F  submit-mode=fingerprint: offer the reports' fingerprints first,
+ *       OFFER_BATCH at a time, and upload (with their "fingerprint" field)
+ *       only the ones the server answers need-body for
+ *   -f  use a fresh curl handle for every report instead of reusing one,
+ *       to compare against connection reuse
+ *   -c  have curl copy each report into the form (curl_mime_data())
+ *       instead of streaming it from the mmapped file, to compare
+ *
+ * Reports are taken from the top of processed_folder and from the
+ * shards one level down (processed-layout=date or =hash).
+ *
+ * Point it at tests/crash-receiver to measure submission throughput,
+ * latency and retry behaviour without a crashdb server.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+#include <glib.h>
+
+#include "corewatcher.h"
+
+#define OFFER_BATCH 64
+
+/* fingerprint.c keeps its suppressions there, which this never does */
+int processed_dirfd = -1;
+
+struct reply {
+	char *text;
+	size_t len;
+};
+
+struct report {
+	char *map;
+	size_t len;
+	size_t sent;
+	char *app;
+	char fingerprint[FINGERPRINT_LEN + 1];
+};
+
+static struct report *reports = NULL;
+static int nreports = 0;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* wait for the next slot of a submission rate */
+static void pace(double rate, double *next)
+{
+	double wait;
+
+	if (rate <= 0)
+		return;
+	wait = *next - now();
+	if (wait > 0)
+		usleep(wait * 1e6);
+	*next += 1.0 / rate;
+}
+
+/* gather the whole reply, as corewatcher's writefunction() does */
+static size_t writefunction(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+	struct reply *reply = stream;
+	size_t bytes = size * nmemb;
+	char *n;
+
+	n = realloc(reply->text, reply->len + bytes + 1);
+	if (!n)
+		return 0;
+	memcpy(n + reply->len, ptr, bytes);
+	reply->len += bytes;
+	n[reply->len] = '\0';
+	reply->text = n;
+
+	return bytes;
+}
+
+/* the same decision corewatcher's check_reply() makes */
+static int check_reply(CURL *handle, int result, struct reply *reply, int fingerprint)
+{
+	long code = 0;
+
+	if (result)
+		return -1;
+	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+	if (code >= 400)
+		return -1;
+	if (fingerprint)
+		return reply->text && !strncmp(reply->text, "ok", 2) ? 0 : -1;
+	if (!reply->text)
+		return 0;
+	if (strstr(reply->text, "the server encountered an error") ||
+	    strstr(reply->text, "ScannerError at /crash_submit/") ||
+	    strstr(reply->text, "was not found on this server"))
+		return -1;
+
+	return 0;
+}
+
+/* the application a report is of, from its "cmdline:" line */
+static char *report_app(const char *map, size_t len)
+{
+	const char *nl;
+
+	if (len < 9 || strncmp(map, "cmdline: ", 9))
+		return strdup("");
+	nl = memchr(map + 9, '\n', len - 9);
+
+	return strndup(map + 9, nl ? (size_t)(nl - map - 9) : len - 9);
+}
+
+static void add_report(const char *path, int fingerprint)
+{
+	struct report *n, *report;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) || st.st_size == 0 ||
+	    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED ||
+	    !(n = realloc(reports, (nreports + 1) * sizeof(struct report)))) {
+		close(fd);
+		return;
+	}
+	reports = n;
+	report = &reports[nreports++];
+	memset(report, 0, sizeof(struct report));
+	report->map = map;
+	report->len = st.st_size;
+	report->app = report_app(map, st.st_size);
+	/* what corewatcher offers for it, read the way persist_core() does */
+	if (fingerprint)
+		file_fingerprint(fd, report->app, report->fingerprint);
+	else
+		close(fd);
+}
+
+/* the *.txt reports in path and, if shards, in the folders under it */
+static void scan_folder(const char *path, int shards, int fingerprint)
+{
+	struct dirent *entry;
+	struct stat st;
+	char *name;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		return;
+	}
+	while ((entry = readdir(dir))) {
+		size_t len = strlen(entry->d_name);
+
+		if (entry->d_name[0] == '.' || asprintf(&name, "%s/%s", path, entry->d_name) == -1)
+			continue;
+		if (shards && !stat(name, &st) && S_ISDIR(st.st_mode))
+			scan_folder(name, 0, fingerprint);
+		else if (len >= 5 && !strcmp(entry->d_name + len - 4, ".txt"))
+			add_report(name, fingerprint);
+		free(name);
+	}
+	closedir(dir);
+}
+
+/* the same streaming corewatcher's readfunction() does */
+static size_t readfunction(char *buf, size_t size, size_t nmemb, void *stream)
+{
+	struct report *report = stream;
+	size_t bytes = size * nmemb;
+
+	if (bytes > report->len - report->sent)
+		bytes = report->len - report->sent;
+	memcpy(buf, report->map + report->sent, bytes);
+	report->sent += bytes;
+
+	return bytes;
+}
+
+/* and its seekfunction(), for curl to send a report again */
+static int seekfunction(void *stream, curl_off_t offset, int origin)
+{
+	struct report *report = stream;
+
+	if (origin != SEEK_SET || offset < 0 || (size_t)offset > report->len)
+		return CURL_SEEKFUNC_CANTSEEK;
+	report->sent = offset;
+
+	return CURL_SEEKFUNC_OK;
+}
+
+static int add_field(curl_mime *mime, const char *name, const char *value)
+{
+	curl_mimepart *part = curl_mime_addpart(mime);
+
+	if (!part || curl_mime_name(part, name) != CURLE_OK ||
+	    curl_mime_data(part, value, CURL_ZERO_TERMINATED) != CURLE_OK)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * POST mime over handle, which new_form() made, into reply.
+ * Returns curl's result, frees mime.
+ */
+static int perform(CURL **handle, const char *url, curl_mime *mime, struct reply *reply,
+		   long *connects, double *latency)
+{
+	long n = 0;
+	double t0;
+	int ret;
+
+	curl_easy_setopt(*handle, CURLOPT_URL, url);
+	curl_easy_setopt(*handle, CURLOPT_TIMEOUT, 5);
+	curl_easy_setopt(*handle, CURLOPT_SSL_VERIFYPEER, 0L);
+	curl_easy_setopt(*handle, CURLOPT_POSTREDIR, 0L);
+	curl_easy_setopt(*handle, CURLOPT_WRITEFUNCTION, writefunction);
+	curl_easy_setopt(*handle, CURLOPT_WRITEDATA, reply);
+	curl_easy_setopt(*handle, CURLOPT_MIMEPOST, mime);
+
+	t0 = now();
+	ret = curl_easy_perform(*handle);
+	if (latency)
+		*latency = now() - t0;
+	curl_mime_free(mime);
+
+	curl_easy_getinfo(*handle, CURLINFO_NUM_CONNECTS, &n);
+	*connects += n;
+
+	return ret;
+}
+
+static curl_mime *new_form(CURL **handle)
+{
+	if (!*handle)
+		*handle = curl_easy_init();
+
+	return *handle ? curl_mime_init(*handle) : NULL;
+}
+
+/* POST report over handle; returns 0 if it got through */
+static int post_report(CURL **handle, const char *url, struct report *report, int copy,
+		       int fingerprint, long *connects, double *latency)
+{
+	struct reply reply = { NULL, 0 };
+	curl_mimepart *part;
+	curl_mime *mime;
+	int ret;
+
+	report->sent = 0;
+	mime = new_form(handle);
+	part = mime ? curl_mime_addpart(mime) : NULL;
+	if (!part || curl_mime_name(part, "crash") != CURLE_OK ||
+	    (fingerprint && add_field(mime, "fingerprint", report->fingerprint))) {
+		curl_mime_free(mime);
+		return -1;
+	}
+	if (copy)
+		curl_mime_data(part, report->map, report->len);
+	else
+		curl_mime_data_cb(part, report->len, readfunction, seekfunction, NULL, report);
+
+	ret = perform(handle, url, mime, &reply, connects, latency);
+	ret = check_reply(*handle, ret, &reply, fingerprint);
+	free(reply.text);
+
+	return ret;
+}
+
+/* the server's line for fingerprint fp (len chars of it) in an offer's reply */
+static const char *decision(const char *text, const char *fp, size_t len)
+{
+	const char *line = text;
+
+	while (line && *line) {
+		if (!strncmp(line, fp, len) && line[len] == ' ')
+			return line + len + 1;
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Offer the fingerprints of the n reports in idx the way start_offer()
+ * does, clearing want[] for the ones the server only counts or
+ * suppresses, as offer_done() does.  Returns 0 if the server answered.
+ */
+static int offer(CURL **handle, const char *url, const long *idx, int n, int *want,
+		 long *connects)
+{
+	struct reply reply = { NULL, 0 };
+	GString *batch = g_string_new(NULL);
+	const char *action;
+	curl_mime *mime;
+	int k, ret;
+
+	for (k = 0; k < n; k++)
+		g_string_append_printf(batch, "%s %s\n", reports[idx[k]].fingerprint,
+				       reports[idx[k]].app);
+	mime = new_form(handle);
+	if (!mime || add_field(mime, "fingerprints", batch->str)) {
+		curl_mime_free(mime);
+		g_string_free(batch, TRUE);
+		return -1;
+	}
+	g_string_free(batch, TRUE);
+
+	ret = perform(handle, url, mime, &reply, connects, NULL);
+	ret = check_reply(*handle, ret, &reply, 0);
+	for (k = 0; !ret && reply.text && k < n; k++) {
+		const char *fp = reports[idx[k]].fingerprint;
+
+		action = decision(reply.text, fp, strlen(fp));
+		if (!action)
+			action = decision(reply.text, fp, APP_FINGERPRINT_LEN);
+		if (action && (!strncmp(action, "count-only", 10) || !strncmp(action, "suppress ", 9)))
+			want[k] = 0;
+	}
+	free(reply.text);
+
+	return ret;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+	const char *url = NULL, *folder;
+	double rate = 0, start, next, elapsed, *latency;
+	long total = -1, posts = 0, sent = 0, retried = 0, connects = 0, i;
+	long offers = 0, offers_failed = 0, counted = 0;
+	long npending, nfailed, *pending, *failed;
+	int fresh = 0, copy = 0, fingerprint = 0, rounds = 0, round, c, n, k;
+	int want[OFFER_BATCH];
+	CURL *handle = NULL;
+
+	while ((c = getopt(argc, argv, "u:r:n:R:Ffc")) != -1) {
+		switch (c) {
+		case 'u': url = optarg; break;
+		case 'r': rate = atof(optarg); break;
+		case 'n': total = atol(optarg); break;
+		case 'R': rounds = atoi(optarg); break;
+		case 'F': fingerprint = 1; break;
+		case 'f': fresh = 1; break;
+		case 'c': copy = 1; break;
+		default:
+			goto usage;
+		}
+	}
+	if (!url || optind != argc - 1 || rounds < 0)
+		goto usage;
+	folder = argv[optind];
+
+	scan_folder(folder, 1, fingerprint);
+	if (!nreports) {
+		fprintf(stderr, "no *.txt reports in %s or its shards\n", folder);
+		return EXIT_FAILURE;
+	}
+	if (total <= 0)
+		total = nreports;
+
+	/* every report is POSTed at most once per round */
+	latency = calloc(total * (rounds + 1), sizeof(double));
+	pending = calloc(total, sizeof(long));
+	failed = calloc(total, sizeof(long));
+	if (!latency || !pending || !failed)
+		return EXIT_FAILURE;
+	for (i = 0; i < total; i++)
+		pending[i] = i % nreports;
+	npending = total;
+	nfailed = 0;
+
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	start = next = now();
+	for (round = 0; round <= rounds && npending; round++) {
+		nfailed = 0;
+		for (i = 0; i < npending; i += n) {
+			n = fingerprint ? MIN(OFFER_BATCH, npending - i) : 1;
+			for (k = 0; k < n; k++)
+				want[k] = 1;
+			if (fingerprint) {
+				pace(rate, &next);
+				/* like corewatcher, upload them all if the offer fails */
+				if (offer(&handle, url, pending + i, n, want, &connects))
+					offers_failed++;
+				offers++;
+				if (fresh && handle) {
+					curl_easy_cleanup(handle);
+					handle = NULL;
+				}
+			}
+
+			for (k = 0; k < n; k++) {
+				if (!want[k]) {
+					counted++;
+					sent++;
+					continue;
+				}
+				pace(rate, &next);
+				if (post_report(&handle, url, &reports[pending[i + k]], copy,
+						fingerprint, &connects, &latency[posts]))
+					failed[nfailed++] = pending[i + k];
+				else
+					sent++;
+				posts++;
+
+				if (fresh && handle) {
+					curl_easy_cleanup(handle);
+					handle = NULL;
+				}
+			}
+		}
+		/* the failed ones make up the next round */
+		if (round < rounds)
+			retried += nfailed;
+		memcpy(pending, failed, nfailed * sizeof(long));
+		npending = nfailed;
+	}
+	if (handle)
+		curl_easy_cleanup(handle);
+	elapsed = now() - start;
+
+	printf("reports %d posts %ld sent %ld retried %ld failed %ld new-connections %ld\n",
+	       nreports, posts, sent, retried, nfailed, connects);
+	if (fingerprint)
+		printf("offers %ld failed %ld counted %ld\n", offers, offers_failed, counted);
+	printf("elapsed %.3fs rate %.1f/s", elapsed, (posts + offers) / elapsed);
+	if (posts) {
+		qsort(latency, posts, sizeof(double), cmp_double);
+		printf(" latency p50 %.1fms p99 %.1fms max %.1fms",
+		       latency[posts / 2] * 1000, latency[posts * 99 / 100] * 1000,
+		       latency[posts - 1] * 1000);
+	}
+	printf("\n");
+
+	curl_global_cleanup();
+	return nfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "usage: %s -u url [-r reports/s] [-n total] [-R rounds] [-F] [-f] [-c] processed_folder\n", argv[0]);
+	return EXIT_FAILURE;
+}